@@ -0,0 +1,210 @@
+/******************************************************************************/
+/**
+@file		SD.h
+@author		Ramon Lawrence
+@brief		Host mock of the Arduino SD and File classes. Files are kept in memory.
+@details	Like the SD library, a file cannot be positioned past its end so it
+			must be extended by writing. Every write is recorded so tests can
+			check the size and alignment of writes sent to the card.
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#if !defined(SD_MOCK_H_)
+#define SD_MOCK_H_
+
+#include <Arduino.h>
+
+#define O_READ		0x01
+#define O_WRITE		0x02
+#define O_APPEND	0x04
+#define O_CREAT		0x10
+#define FILE_READ	O_READ
+#define FILE_WRITE	(O_READ | O_WRITE | O_CREAT | O_APPEND)
+
+/* Maximum number of files on mock card */
+#define SD_MOCK_MAX_FILES		8
+#define SD_MOCK_MAX_NAME		32
+
+/* Block size of mock card. Writes that do not end on a block boundary (except at end of file) are counted. */
+#define SD_MOCK_BLOCK_SIZE		512
+
+/* File on mock card */
+typedef struct {
+	char		name[SD_MOCK_MAX_NAME];
+	uint8_t		*data;
+	uint32_t	size;
+	uint8_t		exists;
+} sdMockFile;
+
+/* Writes sent to mock card */
+typedef struct {
+	uint32_t	numWrites;				/* Number of write calls */
+	uint32_t	numBytes;				/* Number of bytes written */
+	uint32_t	maxWrite;				/* Largest write in bytes */
+	uint32_t	lastWrite;				/* Size of last write in bytes */
+	uint32_t	numUnaligned;			/* Writes ending inside a block that were followed by another write to the file */
+	uint32_t	lastEnd;				/* Position after last write */
+} sdMockStats;
+
+inline sdMockFile sdMockFiles[SD_MOCK_MAX_FILES];
+inline sdMockStats sdMockWrites;
+
+class File {
+public:
+	File() : file(NULL), pos(0), dir(0), next(0) {}
+	File(sdMockFile *f, uint32_t p, uint8_t d) : file(f), pos(p), dir(d), next(0) {}
+
+	operator bool() const { return file != NULL || dir; }
+	void close() { file = NULL; dir = 0; }
+	void flush() {}
+	const char* name() { return file != NULL ? file->name : "/"; }
+	uint32_t position() { return pos; }
+	uint32_t size() { return file != NULL ? file->size : 0; }
+
+	/* Position must be within file */
+	bool seek(uint32_t p)
+	{
+		if (file == NULL || p > file->size)
+			return false;
+		pos = p;
+		return true;
+	}
+
+	int read(void *buf, uint16_t num)
+	{
+		if (file == NULL)
+			return -1;
+		if (num > file->size - pos)
+			num = file->size - pos;
+		memcpy(buf, file->data + pos, num);
+		pos += num;
+		return num;
+	}
+
+	size_t write(const uint8_t *buf, size_t num)
+	{
+		if (file == NULL)
+			return 0;
+		if (pos + num > file->size)
+		{
+			uint8_t *data = (uint8_t*) realloc(file->data, pos + num);
+			if (data == NULL)
+				return 0;
+			file->data = data;
+			file->size = pos + num;
+		}
+		memcpy(file->data + pos, buf, num);
+
+		if (sdMockWrites.numWrites > 0 && sdMockWrites.lastEnd % SD_MOCK_BLOCK_SIZE != 0 && pos == sdMockWrites.lastEnd)
+			sdMockWrites.numUnaligned++;
+		pos += num;
+		sdMockWrites.numWrites++;
+		sdMockWrites.numBytes += num;
+		sdMockWrites.lastWrite = num;
+		sdMockWrites.lastEnd = pos;
+		if (num > sdMockWrites.maxWrite)
+			sdMockWrites.maxWrite = num;
+		return num;
+	}
+
+	/* Returns next file in directory */
+	File openNextFile()
+	{
+		for (; dir && next < SD_MOCK_MAX_FILES; next++)
+		{
+			if (sdMockFiles[next].exists)
+				return File(&sdMockFiles[next++], 0, 0);
+		}
+		return File();
+	}
+
+private:
+	sdMockFile	*file;
+	uint32_t	pos;
+	uint8_t		dir;
+	uint8_t		next;
+};
+
+class SDClass {
+public:
+	bool begin(uint8_t csPin) { (void) csPin; return true; }
+
+	bool exists(const char *name) { return find(name) != NULL; }
+
+	bool remove(const char *name)
+	{
+		sdMockFile *f = find(name);
+		if (f == NULL)
+			return false;
+		free(f->data);
+		memset(f, 0, sizeof(sdMockFile));
+		return true;
+	}
+
+	/* Opening for write creates file and positions at end of file */
+	File open(const char *name, uint8_t mode = FILE_READ)
+	{
+		if (strcmp(name, "/") == 0)
+			return File(NULL, 0, 1);
+
+		sdMockFile *f = find(name);
+		if (f == NULL)
+		{
+			if (!(mode & O_CREAT) || strlen(name) >= SD_MOCK_MAX_NAME)
+				return File();
+			for (uint8_t i = 0; i < SD_MOCK_MAX_FILES && f == NULL; i++)
+			{
+				if (!sdMockFiles[i].exists)
+					f = &sdMockFiles[i];
+			}
+			if (f == NULL)
+				return File();
+			strcpy(f->name, name);
+			f->exists = 1;
+		}
+		return File(f, (mode & O_APPEND) ? f->size : 0, 0);
+	}
+
+private:
+	sdMockFile* find(const char *name)
+	{
+		for (uint8_t i = 0; i < SD_MOCK_MAX_FILES; i++)
+		{
+			if (sdMockFiles[i].exists && strcmp(sdMockFiles[i].name, name) == 0)
+				return &sdMockFiles[i];
+		}
+		return NULL;
+	}
+};
+
+inline SDClass SD;
+
+#endif
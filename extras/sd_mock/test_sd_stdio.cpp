@@ -0,0 +1,165 @@
+/******************************************************************************/
+/**
+@file		test_sd_stdio.cpp
+@author		Ramon Lawrence
+@brief		Tests the SD card stdio interface on Linux with a mock of the Arduino
+			SD and File classes. Build and run from the repository root:
+			g++ -DARDUINO -Iextras/sd_mock extras/sd_mock/test_sd_stdio.cpp 
+				src/file/sd_stdio_c_iface.cpp -o test_sd_stdio && ./test_sd_stdio
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#include "../../src/file/sd_stdio_c_iface.h"
+#include <SD.h>
+
+/* Number of errors found by checks */
+static uint32_t errors = 0;
+
+static void check(int ok, const char *msg)
+{
+	if (!ok)
+	{
+		errors++;
+		printf("ERROR: %s\n", msg);
+	}
+}
+
+/* Returns 1 if bytes from start to end of file are all zero */
+static int isZero(const char *name, uint32_t start, uint32_t end)
+{
+	File f = SD.open(name);
+	uint8_t b;
+
+	if (!f || !f.seek(start))
+		return 0;
+	for (uint32_t i = start; i < end; i++)
+	{
+		if (f.read(&b, 1) != 1 || b != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Seeking past end of file pads file with zeros in block-aligned writes */
+static void testSeekPadding()
+{
+	uint8_t data[10];
+	SD_FILE *fp = fopen("pad.bin", "w+b");
+	check(fp != NULL, "Can't open file");
+	if (fp == NULL)
+		return;
+
+	memset(data, 7, sizeof(data));
+	check(fwrite(data, 1, sizeof(data), fp) == sizeof(data), "Write failed");
+
+	/* First write ends on a block boundary and following writes are whole blocks */
+	memset(&sdMockWrites, 0, sizeof(sdMockWrites));
+	check(fseek(fp, 5000, SEEK_SET) == 0, "SEEK_SET past end failed");
+	check(ftell(fp) == 5000, "Position is not at offset after SEEK_SET");
+	check(SD.open("pad.bin").size() == 5000, "File not padded to offset");
+	check(sdMockWrites.numBytes == 5000 - sizeof(data), "Padding wrote wrong number of bytes");
+	check(sdMockWrites.numWrites == 10 && sdMockWrites.maxWrite == SD_ZERO_BLOCK_SIZE && sdMockWrites.numUnaligned == 0, 
+		"Padding writes are not block-aligned");
+	check(isZero("pad.bin", sizeof(data), 5000), "Padding is not zero");
+
+	check(fseek(fp, 4000, SEEK_SET) == 0 && ftell(fp) == 4000, "SEEK_SET within file failed");
+	check(fseek(fp, 1500, SEEK_CUR) == 0 && ftell(fp) == 5500, "SEEK_CUR past end failed");
+	check(fseek(fp, 100, SEEK_END) == 0 && ftell(fp) == 5600, "SEEK_END past end failed");
+	check(SD.open("pad.bin").size() == 5600 && isZero("pad.bin", sizeof(data), 5600), "File not padded with zeros");
+
+	/* Data before padding is unchanged */
+	memset(data, 0, sizeof(data));
+	check(fseek(fp, 0, SEEK_SET) == 0 && fread(data, 1, sizeof(data), fp) == sizeof(data) && data[0] == 7 && data[9] == 7, 
+		"Data before padding changed");
+	fclose(fp);
+}
+
+/* Writing several elements writes each element once in one write */
+static void testWriteElements()
+{
+	uint32_t data[3] = {1, 2, 3}, read[3] = {0, 0, 0};
+	SD_FILE *fp = fopen("write.bin", "w+b");
+	check(fp != NULL, "Can't open file");
+	if (fp == NULL)
+		return;
+
+	memset(&sdMockWrites, 0, sizeof(sdMockWrites));
+	check(fwrite(data, sizeof(uint32_t), 3, fp) == 3, "Write did not return number of elements");
+	check(sdMockWrites.numWrites == 1 && sdMockWrites.lastWrite == sizeof(data), "Elements not written in one write");
+	check(ftell(fp) == sizeof(data), "Position is not after elements");
+	check(fseek(fp, 0, SEEK_SET) == 0 && fread(read, sizeof(uint32_t), 3, fp) == 3, "Read failed");
+	check(memcmp(data, read, sizeof(data)) == 0, "Elements read differ from elements written");
+	check(fwrite(data, 0, 3, fp) == 0, "Write of size 0 did not return 0");
+	fclose(fp);
+}
+
+/* Preallocating extends file with zeros without changing file position */
+static void testPreallocate()
+{
+	uint8_t data[100];
+	SD_FILE *fp = fopen("alloc.bin", "w+b");
+	check(fp != NULL, "Can't open file");
+	if (fp == NULL)
+		return;
+
+	memset(data, 9, sizeof(data));
+	check(fwrite(data, 1, sizeof(data), fp) == sizeof(data), "Write failed");
+	check(fseek(fp, 40, SEEK_SET) == 0, "Seek failed");
+
+	memset(&sdMockWrites, 0, sizeof(sdMockWrites));
+	check(sd_fpreallocate(fp, 8192) == 0, "Preallocate failed");
+	check(ftell(fp) == 40, "Preallocate changed file position");
+	check(SD.open("alloc.bin").size() == 8192 && isZero("alloc.bin", sizeof(data), 8192), "File not extended with zeros");
+	check(sdMockWrites.maxWrite == SD_ZERO_BLOCK_SIZE && sdMockWrites.numUnaligned == 0, "Preallocate writes are not block-aligned");
+
+	/* Smaller size does not truncate file */
+	check(sd_fpreallocate(fp, 1000) == 0 && SD.open("alloc.bin").size() == 8192 && ftell(fp) == 40, "Preallocate of smaller size changed file");
+
+	/* Write continues at file position */
+	check(fwrite(data, 1, 10, fp) == 10 && ftell(fp) == 50, "Write after preallocate not at file position");
+	memset(data, 0, sizeof(data));
+	check(fseek(fp, 0, SEEK_SET) == 0 && fread(data, 1, sizeof(data), fp) == sizeof(data) && data[0] == 9 && data[99] == 9, 
+		"Data before preallocated space changed");
+	fclose(fp);
+}
+
+int main()
+{
+	testSeekPadding();
+	testWriteElements();
+	testPreallocate();
+
+	if (errors == 0)
+		printf("SUCCESS\n");
+	else
+		printf("FAILURE: Errors: %lu\n", (unsigned long) errors);
+	return errors == 0 ? 0 : 1;
+}
@@ -111,6 +111,7 @@ void btreeInit(btreeState *state)
 
 	state->levels = 1;	
 	state->numNodes = 1;
+	state->rightLevels = 0;
 
 	/* Create and write empty root node */	
 	void *buf = initBufferPage(state->buffer, 0);	
@@ -130,8 +131,13 @@ void btreeRecover(btreeState *state)
 	state->recordSize = state->keySize + state->dataSize;
 	printf("Record size: %d\n", state->recordSize);	
 	
+	/* Connections between buffer and btree */
+	state->buffer->activePath = state->activePath;
+	state->buffer->state = state;
+	state->rightLevels = 0;
+
 	/* Recover and set root node */	
-	dbbufferRecover(state->buffer);
+	int8_t recovered = dbbufferRecover(state->buffer);
 
 	state->compareKey = uint32Compare;
 
@@ -144,7 +150,22 @@ void btreeRecover(btreeState *state)
 	/* Interior records consist of key and id reference. Note: One extra id reference (child pointer). If N keys, have N+1 id references (pointers). */
 	state->maxInteriorRecordsPerPage = (state->buffer->pageSize - state->headerSize - sizeof(id_t)) / (state->keySize+sizeof(id_t));
 
-	state->numNodes = state->buffer->nextPageWriteId-1;
+	dbsuperblock *sb = state->buffer->superblock;
+	if (recovered == 1)
+	{
+		if (sb->keySize == state->keySize && sb->dataSize == state->dataSize)
+		{
+			state->levels = sb->levels;
+			state->numNodes = sb->numNodes;
+			return;
+		}
+		printf("Record size in superblock does not match. Key size: %d Data size: %d\n", sb->keySize, sb->dataSize);
+	}
+
+	/* Every page except superblock pages and free pages is a node */
+	state->numNodes = state->buffer->nextPageWriteId - state->buffer->numFree;
+	if (state->buffer->superblock != NULL)
+		state->numNodes -= DBBUFFER_SUPERBLOCK_PAGES;
 
 	/* Determine number of levels through search. */
 	state->levels = 1;	
@@ -159,7 +180,7 @@ void btreeRecover(btreeState *state)
 		{
 			state->levels++;
 			/* Get smallest child pointer */
-			nextId = *((id_t*) (buf + state->headerSize+state->keySize));		
+			nextId = *((id_t*) (buf + state->headerSize + state->keySize*state->maxInteriorRecordsPerPage));		
 		}
 		else
 			break;		
@@ -315,150 +336,139 @@ void btreePrint(btreeState *state)
 }
 
 /**
-@brief     	Puts a given key, data pair into structure.
+@brief     	Returns 1 if key is larger than all keys in leaf so record is added at end of leaf.
 @param     	state
                 btree algorithm state structure
+@param     	buf
+                In memory page buffer with leaf
 @param     	key
                 Key for record
-@param     	data
-                Data for record
-@return		Return 0 if success. Non-zero value if error.
 */
-int8_t btreePut(btreeState *state, void* key, void *data)
-{		
-	int8_t 	l;
-	void 	*buf, *ptr;	
-	id_t  	parent, nextId = state->activePath[0];	
-	int32_t pageNum, childNum;	
+static int8_t btreeIsAppend(btreeState *state, void *buf, void *key)
+{
+	count_t count = BTREE_GET_COUNT(buf);
+	return count > 0 && state->compareKey(key, buf + state->headerSize + state->recordSize * (count-1)) > 0;
+}
 
-	/* Find insert leaf */
-	/* Starting at root search for key */
-	for (l=0; l < state->levels-1; l++)
+/**
+@brief     	Searches from root for leaf where key belongs. Sets active path to leaf.
+@param     	state
+                btree algorithm state structure
+@param     	key
+                Key to search for
+@param     	bound
+                If not NULL, smallest key to right of leaf is copied into bound. Not copied if leaf is rightmost.
+@param     	rightmost
+                Set to 1 if leaf is rightmost leaf in tree, 0 otherwise
+@return		Return leaf page id or -1 if error.
+*/
+static id_t btreeFindLeaf(btreeState *state, void *key, void *bound, int8_t *rightmost)
+{
+	void 	*buf;
+	id_t 	childNum, nextId = state->activePath[0];
+
+	*rightmost = 1;
+	for (int8_t l=0; l < state->levels-1; l++)
 	{			
-		buf = readPage(state->buffer, nextId);		
+		buf = readPageLevel(state->buffer, nextId, state->levels-1-l);		
+		if (buf == NULL)
+			return -1;
 
 		/* Find the key within the node. Sorted by key. Use binary search. */
 		childNum = btreeSearchNode(state, buf, key, nextId, 1);
+		if (childNum != BTREE_GET_COUNT(buf))
+		{	/* Key after child bounds leaf. Deeper levels give a smaller bound. */
+			*rightmost = 0;
+			if (bound != NULL)
+				memcpy(bound, buf + state->headerSize + state->keySize * childNum, state->keySize);
+		}
 		nextId = getChildPageId(state, buf, nextId, l, childNum);		
-		if (nextId == -1)
+		if (nextId == (id_t) -1)
 			return -1;		
 					
 		state->activePath[l+1] = nextId;
 	}
+	return nextId;
+}
 
-	/* Read the leaf node */
-	buf = readPageBuffer(state->buffer, nextId, 0);	/* Note: Use readPageBuffer in buffer 0 to prevent any concurrency issues instead of readPage. */
-	int16_t count =  BTREE_GET_COUNT(buf); 
-
-	childNum = -1;
-	if (count > 0)
-		childNum = btreeSearchNode(state, buf, key, nextId, 1);
-				
-	if (count < state->maxRecordsPerPage)
-	{	/* Space for record on leaf node. */		
-		/* Insert record onto page in sorted order */					
-		ptr = buf + state->headerSize + state->recordSize * (childNum+1);	
-		/* Shift records down */
-		if (count-childNum-1 > 0)
-		{	/* memmove required as overlapping memory */
-			memmove(ptr + state->recordSize, ptr, state->recordSize*(count-childNum-1));					
-		}		
-			
-		/* Copy record onto page */			
-		memcpy(ptr, key, state->keySize);
-		memcpy(ptr + state->keySize, data, state->dataSize);
-
-		/* Update count */
-		BTREE_INC_COUNT(buf);	
-
-		/* Write updated page */
-		pageNum = overWritePage(state->buffer, buf, nextId);		
-		if (state->levels == 1)
-		{	/* Wrote to root */
-			state->activePath[0] = pageNum;
-		}
-		
-		return 0;
-	}
-
-	/* Current leaf page is full. Perform split. */
-	int8_t mid = count/2;
-	id_t left, right;
-	state->numNodes++;	
-
-	if (childNum < mid)
-	{	/* Insert key in page with smaller values */
-		/* Update count on page then write */
-		BTREE_SET_COUNT(buf, mid+1);	
-
-		/* Buffer key/data record at mid point so do not lose it */
-		ptr = buf + state->headerSize + state->recordSize * mid;
-		memcpy(state->tempKey, ptr, state->keySize);
-		memcpy(state->tempData, ptr + state->keySize, state->dataSize);
-
-		/* Shift records at and after insert point down one record */
-		ptr =  buf + state->headerSize + state->recordSize * (childNum+1);
-		if ((mid-childNum-1) > 0)
-			memmove(ptr + state->recordSize, ptr, state->recordSize*(mid-childNum-1));
-		
-		/* Copy record onto page */		
-		memcpy(ptr, key, state->keySize);
-		memcpy(ptr + state->keySize, data, state->dataSize);
-
-		left = overWritePage(state->buffer, buf, nextId);	
-
-		/* Copy buffered record to start of block */
-		memcpy(buf + state->headerSize, state->tempKey, state->keySize);
-		memcpy(buf + state->headerSize + state->keySize, state->tempData, state->dataSize);
-
-		/* Copy records after mid to start of page */	
-		memcpy(buf + state->headerSize + state->recordSize, buf + state->headerSize + state->recordSize * (mid+1), state->recordSize*(count-mid));		
-		
-		BTREE_SET_COUNT(buf, count-mid);
-		right = writePage(state->buffer, buf);
-	}
-	else
-	{	/* Insert key in page with larger values */
-		/* Update count on page then write */
-		BTREE_SET_COUNT(buf, mid+1);
-
-		left = overWritePage(state->buffer, buf, nextId);	
+/**
+@brief     	Returns buffer to build the right node of a split in once the left node is written.
+			A frame is taken from the buffer if one is not pinned. Otherwise the frame holding the left node is taken 
+			and the right node is built in place from the records of the left node.
+@param     	state
+                btree algorithm state structure
+@param     	left
+                Page id of left node. Node is pinned.
+@param     	buf
+                Frame holding left node
+@param     	frame
+                Returns frame to pass to btreeSplitWrite
+@return		Return pointer to buffer for right node or NULL if error.
+*/
+static void* btreeSplitFrame(btreeState *state, id_t left, void *buf, count_t *frame)
+{
+	void *rbuf = dbbufferTakeAnyFrame(state->buffer, frame);
 
-		/* Buffer key/data record at mid point so do not lose it */
-		if (childNum == mid)
-		{	/* Middle key to promote is this key. */
-			memcpy(state->tempKey, key, state->keySize);
-		}
-		else
-		{
-			ptr =  buf + state->headerSize + state->recordSize * (mid+1);
-			memcpy(state->tempKey, ptr, state->keySize);
-		}
-		
-		/* New split page starts off with original page in buffer. Copy records around as required. */
-		/* Copy records before insert point into front of block from current location in block */
-		if ((childNum-mid) > 0)
-			memcpy(buf + state->headerSize, ptr, state->recordSize*(childNum-mid));		
+	if (rbuf != NULL)
+		return rbuf;
+	*frame = dbbufferTakePage(state->buffer, left);
+	return *frame == 0 ? NULL : buf;
+}
 
-		/* Copy record onto page */
-		ptr = buf + state->headerSize + state->recordSize * (childNum-mid);
-		memcpy(ptr, key, state->keySize);
-		memcpy(ptr + state->keySize, data, state->dataSize);
+/**
+@brief     	Writes the right node of a split and releases the frames of the split. Left node is unpinned first 
+			so its frame may be used to read a free page.
+@param     	state
+                btree algorithm state structure
+@param     	left
+                Page id of left node
+@param     	buf
+                Frame holding left node
+@param     	rbuf
+                Buffer returned by btreeSplitFrame holding right node
+@param     	frame
+                Frame returned by btreeSplitFrame
+@return		Return page id of right node or -1 if error.
+*/
+static int32_t btreeSplitWrite(btreeState *state, id_t left, void *buf, void *rbuf, count_t frame)
+{
+	int32_t pageNum;
 
-		/* Copy records after insert point after value just inserted */
-		memcpy(buf + state->headerSize + state->recordSize * (childNum-mid+1), buf + state->headerSize + state->recordSize * (childNum+1), state->recordSize*(count-childNum-1));	
+	if (rbuf != buf)
+		dbbufferUnpin(state->buffer, left);
+	pageNum = writePage(state->buffer, rbuf);
+	dbbufferReleaseFrame(state->buffer, frame);
+	return pageNum;
+}
 
-		BTREE_SET_COUNT(buf, count-mid);
-		right = writePage(state->buffer, buf);		
-	}		
+/**
+@brief     	Adds key in tempKey and pointer to right node to parent of left node after a split.
+			Parent nodes are split as needed up to a new root. Active path must be set to left node.
+@param     	state
+                btree algorithm state structure
+@param     	left
+                Page id of left node of split
+@param     	right
+                Page id of right node of split
+@param     	append
+                1 if right node is new rightmost node so full parents are left full
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeInsertParent(btreeState *state, id_t left, id_t right, int8_t append)
+{
+	int8_t 	l, mid;
+	void 	*buf, *rbuf, *ptr, *rptr;	
+	id_t  	parent;	
+	int32_t pageNum, childNum;	
+	count_t frame;
 
 	/* Recursively add pointer to parent node. */
 	for (l=state->levels-2; l >=0; l--)
 	{		
 		parent = state->activePath[l];				
 
-		/* Read parent node */
-		buf = readPageBuffer(state->buffer, parent, 0);			/* Forcing read to buffer 0 even if buffered in another buffer as will modify this page. */
+		/* Read and pin parent node as will modify this page */
+		buf = dbbufferPin(state->buffer, parent, state->levels-1-l);
 		if (buf == NULL)
 			return -1;				
 
@@ -487,6 +497,7 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 			
 			/* Write page */			
 			pageNum = overWritePage(state->buffer, buf, parent);
+			dbbufferUnpin(state->buffer, parent);
 			
 			if (l == 0)
 			{	/* Update root */
@@ -496,7 +507,7 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 			return 0;
 		}
 
-		/* No space. Split interior node and promote key/pointer pair */
+		/* No space. Split interior node and promote key/pointer pair. Left node is built in place in the pinned frame. */
 		state->numNodes++;
 		
 		childNum = -1;
@@ -504,7 +515,32 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 			childNum = btreeSearchNode(state, buf, state->tempKey, parent, 1);
  		mid = count/2;
 
-		if (childNum < mid)
+		append = append && count > 1;	/* Node keeps at least one key */
+		if (!append)
+			state->rightLevels = 0;
+		if (append)
+		{	/* Rightmost node is left full except its last key moves up. Its last child and the new child start a new node to its right. */
+			memcpy(state->tempData, buf + state->headerSize + state->keySize * (count-1), state->keySize);
+			BTREE_SET_COUNT(buf, count-1);
+			BTREE_SET_INTERIOR(buf);
+			id_t tmpLeft = overWritePage(state->buffer, buf, parent);
+
+			if (btreeSplitFrame(state, parent, buf, &frame) == NULL)
+				return -1;
+			rbuf = initBufferPage(state->buffer, frame);
+			memcpy(rbuf + state->headerSize, state->tempKey, state->keySize);
+			rptr = rbuf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage;
+			memcpy(rptr, &left, sizeof(id_t));
+			memcpy(rptr + sizeof(id_t), &right, sizeof(id_t));
+			BTREE_SET_COUNT(rbuf, 1);
+			BTREE_SET_INTERIOR(rbuf);
+			right = btreeSplitWrite(state, parent, buf, rbuf, frame);
+
+			left = tmpLeft;
+			memcpy(state->tempKey, state->tempData, state->keySize);
+			state->rightPath[l] = right;
+		}
+		else if (childNum < mid)
 		{	/* Insert key/pointer in page with smaller values */
 			/* Update count on page then write */
 			if (count % 2 == 0)
@@ -538,19 +574,23 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 			memcpy(ptr + sizeof(id_t), &right, sizeof(id_t));
 
 			left = overWritePage(state->buffer, buf, parent);				
+			rbuf = btreeSplitFrame(state, parent, buf, &frame);
+			if (rbuf == NULL)
+				return -1;
 					
-			/* Copy buffered pointer to start of block */			
+			/* Copy buffered pointer to start of right node */			
 			ptr = buf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage;
-			memcpy(ptr, &tempPtr, sizeof(id_t));
+			rptr = rbuf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage;
+			memcpy(rptr, &tempPtr, sizeof(id_t));
 
-			/* Copy records after mid to start of page */	
-			memcpy(buf + state->headerSize, buf + state->headerSize + state->keySize * (mid+1), state->keySize*(count-mid-1));			
-			memcpy(ptr + sizeof(id_t), ptr + sizeof(id_t) * (mid+2), sizeof(id_t)*(count-mid-1));		
+			/* Copy records after mid to start of right node */	
+			memmove(rbuf + state->headerSize, buf + state->headerSize + state->keySize * (mid+1), state->keySize*(count-mid-1));			
+			memmove(rptr + sizeof(id_t), ptr + sizeof(id_t) * (mid+2), sizeof(id_t)*(count-mid-1));		
 			
-			BTREE_SET_COUNT(buf, count-mid-1);
-			BTREE_SET_INTERIOR(buf);
+			BTREE_SET_COUNT(rbuf, count-mid-1);
+			BTREE_SET_INTERIOR(rbuf);
 
-			right = writePage(state->buffer, buf);			
+			right = btreeSplitWrite(state, parent, buf, rbuf, frame);
 
 			/* Keep temporary key (move from temp data) */
 			memcpy(state->tempKey, state->tempData, state->keySize);
@@ -577,35 +617,38 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 			memcpy(&tempPtr, buf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage + sizeof(id_t) * (mid+1), sizeof(id_t));
 			
 			id_t tmpLeft = overWritePage(state->buffer, buf, parent);				
+			rbuf = btreeSplitFrame(state, parent, buf, &frame);
+			if (rbuf == NULL)
+				return -1;
+			rptr = rbuf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage;
 						
-			/* New split page starts off with original page in buffer. Copy records around as required. */
-			/* Copy records before insert point into front of block from current location in block */			
+			/* Copy records before insert point into front of right node */			
 			if ((childNum-mid-1) > 0)
 			{
-				memcpy(buf + state->headerSize, buf + state->headerSize + state->keySize * (mid+1), state->keySize*(childNum-mid-1));	
-				memcpy(ptr, ptr + sizeof(id_t) * (mid+1), sizeof(id_t)*(childNum-mid-1));		
+				memmove(rbuf + state->headerSize, buf + state->headerSize + state->keySize * (mid+1), state->keySize*(childNum-mid-1));	
+				memmove(rptr, ptr + sizeof(id_t) * (mid+1), sizeof(id_t)*(childNum-mid-1));		
 			}	  
 	 			
 			if (childNum > mid)
 			{
 				/* Copy record onto page */
-				memcpy(buf + state->headerSize + state->keySize * (childNum-mid-1), state->tempKey, state->keySize);
+				memcpy(rbuf + state->headerSize + state->keySize * (childNum-mid-1), state->tempKey, state->keySize);
 				/* Right pointer */
-				memcpy(ptr + sizeof(id_t) * (childNum-mid-1), &left, sizeof(id_t));
+				memcpy(rptr + sizeof(id_t) * (childNum-mid-1), &left, sizeof(id_t));
 			}
-			memcpy(ptr + sizeof(id_t) * (childNum-mid), &right, sizeof(id_t));
+			memcpy(rptr + sizeof(id_t) * (childNum-mid), &right, sizeof(id_t));
 
 			/* Copy records after insert point after value just inserted */
 			if (count-childNum > 0)
 			{
-				memcpy(buf + state->headerSize + state->keySize * (childNum-mid), buf + state->headerSize + state->keySize * (childNum), state->keySize*(count-childNum));	
-				memcpy(ptr + sizeof(id_t) * (childNum-mid+1), ptr + sizeof(id_t) * (childNum+1), sizeof(id_t)*(count-childNum));	
+				memmove(rbuf + state->headerSize + state->keySize * (childNum-mid), buf + state->headerSize + state->keySize * (childNum), state->keySize*(count-childNum));	
+				memmove(rptr + sizeof(id_t) * (childNum-mid+1), ptr + sizeof(id_t) * (childNum+1), sizeof(id_t)*(count-childNum));	
 			}
 	
-			BTREE_SET_COUNT(buf, count-mid);
-			BTREE_SET_INTERIOR(buf);
+			BTREE_SET_COUNT(rbuf, count-mid);
+			BTREE_SET_INTERIOR(rbuf);
 
-			right = writePage(state->buffer, buf);
+			right = btreeSplitWrite(state, parent, buf, rbuf, frame);
 
 			/* Keep temporary key (move from temp data) */
 			left = tmpLeft;
@@ -615,7 +658,9 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 	
 	/* Special case: Add new root node. */	
 	/* Create new root node with the two pointers */
-	buf = initBufferPage(state->buffer, 0);	
+	buf = dbbufferTakeAnyFrame(state->buffer, &frame);
+	if (buf == NULL)
+		return -1;
 	BTREE_SET_COUNT(buf, 1);
 	BTREE_SET_ROOT(buf);			
 	state->numNodes++;
@@ -627,101 +672,1133 @@ int8_t btreePut(btreeState *state, void* key, void *data)
 	memcpy(ptr + sizeof(id_t), &right, sizeof(id_t));
 
 	state->activePath[0] = writePage(state->buffer, buf);
+	dbbufferReleaseFrame(state->buffer, frame);
 	state->levels++;
+	state->rightLevels = 0;
 	// btreePrintNodeBuffer(state, state->activePath[0], 0, buf);
 	return 0;
 }
 
 /**
-@brief     	Given a key, searches the node for the key.
-			If interior node, returns child record number containing next page id to follow.
-			If leaf node, returns if of first record with that key or (<= key).
-			Returns -1 if key is not found.			
+@brief     	Inserts a given key, data pair into structure without committing.
 @param     	state
                 btree algorithm state structure
-@param     	buffer
-                Pointer to in-memory buffer holding node
 @param     	key
                 Key for record
-@param		pageId
-				Page if for page being searched
-@param		range
-				1 if range query so return pointer to first record <= key, 0 if exact query so much return first exact match record
+@param     	data
+                Data for record
+@return		Return 0 if success. Non-zero value if error.
 */
-int32_t btreeSearchNode(btreeState *state, void *buffer, void* key, id_t pageId, int8_t range)
-{
-	int16_t first, last, middle, count;
-	int8_t compare, interior;
-	void *mkey;
-	
-	count = BTREE_GET_COUNT(buffer);  
-	interior = BTREE_IS_INTERIOR(buffer) && state->levels != 1;
+static int8_t btreeInsert(btreeState *state, void* key, void *data)
+{		
+	int8_t 	append = 0, rightmost = 1;
+	void 	*buf, *rbuf, *ptr;	
+	id_t  	nextId;	
+	int32_t pageNum, childNum;	
+	count_t frame;
 
-	if (interior)
+	if (state->rightLevels == state->levels && state->rightPath[0] == state->activePath[0])
+	{	/* Last insert was on rightmost leaf. Key larger than all keys in tree is appended to it without search. */
+		nextId = state->rightPath[state->levels-1];
+		buf = dbbufferPin(state->buffer, nextId, 0);
+		if (buf == NULL)
+			return -1;
+		append = btreeIsAppend(state, buf, key);
+		if (append)
+			memcpy(state->activePath, state->rightPath, sizeof(id_t)*state->levels);
+		else
+			dbbufferUnpin(state->buffer, nextId);
+	}
+
+	if (!append)
 	{
-		if (count == 0)	/* Only one child pointer */
-			return 0;
-		if (count == 1)	/* One key and two children pointers */
-		{
-			mkey = buffer+state->headerSize;   /* Key at index 0 */
-			compare = state->compareKey(key, mkey);
-			if (compare < 0)
-				return 0;
-			return 1;		
-		}
-		
-		first = 0;	
-  		last =  count;
-		if (last > state->maxInteriorRecordsPerPage)
-			last = state->maxInteriorRecordsPerPage;
-  		middle = (first+last)/2;
-		while (first < last) 
-		{			
-			mkey = buffer+state->headerSize+state->keySize*middle;
-			compare = state->compareKey(key,mkey);
-			if (compare > 0)
-				first = middle + 1;
-			else if (compare == 0) 
-			{	last = middle+1; /* Return the child pointer just after */
-				break;
-			}				
-			else
-				last = middle;  /* Note: Not -1 as always want last pointer to be <= key so that will use it if necessary */
+		nextId = btreeFindLeaf(state, key, NULL, &rightmost);
+		if (nextId == (id_t) -1)
+			return -1;
 
-			middle = (first + last)/2;
-		}
-		return last;		
+		/* Read the leaf node. Pinned so it can be modified in place in the buffer frame holding it. */
+		buf = dbbufferPin(state->buffer, nextId, 0);
+		if (buf == NULL)
+			return -1;
+		append = rightmost && btreeIsAppend(state, buf, key);
 	}
-	else
+
+	/* Remember path to rightmost leaf so next key in order does not search */
+	state->rightLevels = 0;
+	if (rightmost)
 	{
-		first = 0;	
-  		last =  count - 1;
-  		middle = (first+last)/2;	
+		memcpy(state->rightPath, state->activePath, sizeof(id_t)*state->levels);
+		state->rightLevels = state->levels;
+	}
+	int16_t count =  BTREE_GET_COUNT(buf); 
 
-		while (first <= last) 
-		{			
-			mkey = buffer+state->headerSize+state->recordSize*middle;
-			compare = state->compareKey(mkey, key);
-			if (compare < 0)
-				first = middle + 1;
-			else if (compare == 0) 
-				return middle;							
-			else
-				last = middle - 1;
+	childNum = -1;
+	if (append)
+		childNum = count-1;
+	else if (count > 0)
+		childNum = btreeSearchNode(state, buf, key, nextId, 1);
+				
+	if (count < state->maxRecordsPerPage)
+	{	/* Space for record on leaf node. */		
+		/* Insert record onto page in sorted order */					
+		ptr = buf + state->headerSize + state->recordSize * (childNum+1);	
+		/* Shift records down */
+		if (count-childNum-1 > 0)
+		{	/* memmove required as overlapping memory */
+			memmove(ptr + state->recordSize, ptr, state->recordSize*(count-childNum-1));					
+		}		
+			
+		/* Copy record onto page */			
+		memcpy(ptr, key, state->keySize);
+		memcpy(ptr + state->keySize, data, state->dataSize);
 
-			middle = (first + last)/2;
-		}
-		if (range)			
-		{	
-			if (last == -1)
-				return -1;
-			return middle;
+		/* Update count */
+		BTREE_INC_COUNT(buf);	
+
+		/* Write updated page */
+		pageNum = overWritePage(state->buffer, buf, nextId);		
+		dbbufferUnpin(state->buffer, nextId);
+		if (state->levels == 1)
+		{	/* Wrote to root */
+			state->activePath[0] = pageNum;
 		}
-		return -1;
+		
+		return 0;
 	}
-}
 
-/**
+	/* Current leaf page is full. Perform split. */
+	/* Left node is built in place in the pinned frame and written before the right node is built. */
+	int8_t mid = count/2;
+	id_t left, right;
+	state->numNodes++;	
+
+	if (append)
+	{	/* Rightmost leaf is left full and key starts a new leaf to its right */
+		left = nextId;
+		if (state->levels == 1)
+		{	/* Leaf is no longer root */
+			BTREE_SET_COUNT(buf, count);
+			left = overWritePage(state->buffer, buf, nextId);
+		}
+
+		if (btreeSplitFrame(state, nextId, buf, &frame) == NULL)
+			return -1;
+		rbuf = initBufferPage(state->buffer, frame);
+		memcpy(rbuf + state->headerSize, key, state->keySize);
+		memcpy(rbuf + state->headerSize + state->keySize, data, state->dataSize);
+		BTREE_SET_COUNT(rbuf, 1);
+		memcpy(state->tempKey, key, state->keySize);
+		right = btreeSplitWrite(state, nextId, buf, rbuf, frame);
+
+		state->rightPath[state->levels-1] = right;
+	}
+	else if (childNum < mid)
+	{	/* Insert key in page with smaller values */
+		/* Update count on page then write */
+		BTREE_SET_COUNT(buf, mid+1);	
+
+		/* Buffer key/data record at mid point so do not lose it */
+		ptr = buf + state->headerSize + state->recordSize * mid;
+		memcpy(state->tempKey, ptr, state->keySize);
+		memcpy(state->tempData, ptr + state->keySize, state->dataSize);
+
+		/* Shift records at and after insert point down one record */
+		ptr =  buf + state->headerSize + state->recordSize * (childNum+1);
+		if ((mid-childNum-1) > 0)
+			memmove(ptr + state->recordSize, ptr, state->recordSize*(mid-childNum-1));
+		
+		/* Copy record onto page */		
+		memcpy(ptr, key, state->keySize);
+		memcpy(ptr + state->keySize, data, state->dataSize);
+
+		left = overWritePage(state->buffer, buf, nextId);	
+		rbuf = btreeSplitFrame(state, nextId, buf, &frame);
+		if (rbuf == NULL)
+			return -1;
+
+		/* Copy buffered record to start of right node */
+		memcpy(rbuf + state->headerSize, state->tempKey, state->keySize);
+		memcpy(rbuf + state->headerSize + state->keySize, state->tempData, state->dataSize);
+
+		/* Copy records after mid after it */	
+		memmove(rbuf + state->headerSize + state->recordSize, buf + state->headerSize + state->recordSize * (mid+1), state->recordSize*(count-mid-1));		
+		
+		BTREE_SET_COUNT(rbuf, count-mid);
+		right = btreeSplitWrite(state, nextId, buf, rbuf, frame);
+	}
+	else
+	{	/* Insert key in page with larger values */
+		/* Update count on page then write */
+		BTREE_SET_COUNT(buf, mid+1);
+
+		left = overWritePage(state->buffer, buf, nextId);	
+
+		/* Buffer key/data record at mid point so do not lose it */
+		ptr =  buf + state->headerSize + state->recordSize * (mid+1);
+		if (childNum == mid)
+		{	/* Middle key to promote is this key. */
+			memcpy(state->tempKey, key, state->keySize);
+		}
+		else
+		{
+			memcpy(state->tempKey, ptr, state->keySize);
+		}
+		
+		rbuf = btreeSplitFrame(state, nextId, buf, &frame);
+		if (rbuf == NULL)
+			return -1;
+
+		/* Copy records before insert point into front of right node */
+		if ((childNum-mid) > 0)
+			memmove(rbuf + state->headerSize, ptr, state->recordSize*(childNum-mid));		
+
+		/* Copy record onto page */
+		ptr = rbuf + state->headerSize + state->recordSize * (childNum-mid);
+		memcpy(ptr, key, state->keySize);
+		memcpy(ptr + state->keySize, data, state->dataSize);
+
+		/* Copy records after insert point after value just inserted */
+		memmove(rbuf + state->headerSize + state->recordSize * (childNum-mid+1), buf + state->headerSize + state->recordSize * (childNum+1), state->recordSize*(count-childNum-1));	
+
+		BTREE_SET_COUNT(rbuf, count-mid);
+		right = btreeSplitWrite(state, nextId, buf, rbuf, frame);		
+	}		
+	if (!append)
+		state->rightLevels = 0;		/* Rightmost leaf may have split */
+
+	return btreeInsertParent(state, left, right, append);
+}
+
+/**
+@brief     	Puts a given key, data pair into structure. Insert is synced according to sync policy of buffer.
+@param     	state
+                btree algorithm state structure
+@param     	key
+                Key for record
+@param     	data
+                Data for record
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t btreePut(btreeState *state, void* key, void *data)
+{
+	int8_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeInsert(state, key, data);
+	if (result == 0)
+		result = dbbufferCommit(state->buffer);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/* Bulk load state. The node being built at each interior level is kept in a buffer frame. */
+typedef struct {
+	count_t	frames[MAX_LEVEL];		/* Buffer frame holding node at each level (index 0 unused) */
+	uint8_t	numLevels;				/* Number of interior levels started */
+	count_t	capacity;				/* Number of keys put in an interior node */
+	uint8_t minKeys[MAX_LEVEL * BTREE_MAX_KEY_SIZE];	/* Smallest key under node being built at each level. Level 0 holds smallest key of last leaf. */
+} btreeLoad;
+
+/**
+@brief     	Returns 1 if adding another leaf to a bulk load needs a new interior level and there is no frame for it.
+@param     	state
+                BTree algorithm state structure
+@param     	ld
+                Bulk load state
+*/
+static int8_t btreeLoadFull(btreeState *state, btreeLoad *ld)
+{
+	for (uint8_t l=1; l <= ld->numLevels; l++)
+	{
+		if (BTREE_GET_COUNT(state->buffer->buffer + ld->frames[l]*state->buffer->pageSize) < ld->capacity)
+			return 0;
+	}
+	/* One level is kept in reserve for finishing the load and one for later root splits */
+	return ld->numLevels+1 >= state->buffer->numPages || ld->numLevels+1 >= MAX_LEVEL-2;
+}
+
+/**
+@brief     	Adds a child page to the node being built at a level of a bulk load.
+			If the node is full, it is written and added to the level above and a new node is started.
+			A new level is built in frame 0 if there is no other frame (only after the last leaf is written).
+@param     	state
+                BTree algorithm state structure
+@param     	ld
+                Bulk load state
+@param     	l
+                Level counted from leaves (1 = parents of leaves)
+@param     	key
+                Smallest key under child
+@param     	childId
+                Page id of child
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeLoadAdd(btreeState *state, btreeLoad *ld, uint8_t l, void *key, id_t childId)
+{
+	void 	*buf, *ptr;
+	count_t	count;
+	int32_t pageNum;
+
+	if (l > ld->numLevels)
+	{	/* Start new level */
+		if (l >= MAX_LEVEL-1)
+			return -1;
+		ld->frames[l] = l < state->buffer->numPages ? l : 0;
+		if (ld->frames[l] != 0 && dbbufferTakeFrame(state->buffer, l) == NULL)
+			return -1;
+		ld->numLevels = l;
+	}
+	else
+	{
+		buf = state->buffer->buffer + ld->frames[l]*state->buffer->pageSize;
+		count = BTREE_GET_COUNT(buf);
+		if (count < ld->capacity)
+		{	/* Key at position count is smallest key under child count+1 */
+			memcpy(buf + state->headerSize + state->keySize * count, key, state->keySize);
+			ptr = buf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage + sizeof(id_t) * (count+1);
+			memcpy(ptr, &childId, sizeof(id_t));
+			BTREE_SET_COUNT(buf, count+1);
+			return 0;
+		}
+
+		/* Node is full. Write it and add it to parent. */
+		BTREE_SET_INTERIOR(buf);
+		pageNum = writePage(state->buffer, buf);
+		if (pageNum == -1)
+			return -1;
+		state->numNodes++;
+		if (btreeLoadAdd(state, ld, l+1, ld->minKeys + state->keySize * l, pageNum) != 0)
+			return -1;
+	}
+
+	/* Child is first in new node */
+	buf = initBufferPage(state->buffer, ld->frames[l]);
+	memcpy(buf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage, &childId, sizeof(id_t));
+	memcpy(ld->minKeys + state->keySize * l, key, state->keySize);
+	return 0;
+}
+
+/**
+@brief     	Writes the leaf and interior nodes still being built by a bulk load. The top node becomes the root.
+@param     	state
+                BTree algorithm state structure
+@param     	ld
+                Bulk load state
+@param     	leaf
+                Leaf being built (in frame 0)
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeLoadFinish(btreeState *state, btreeLoad *ld, void *leaf)
+{
+	int32_t pageNum;
+	void 	*buf;
+
+	/* Smallest key of leaf is copied out as frame 0 is reused for a new level */
+	memcpy(ld->minKeys, leaf + state->headerSize, state->keySize);
+	if (ld->numLevels == 0)
+		BTREE_SET_ROOT(leaf);
+	pageNum = writePage(state->buffer, leaf);
+	if (pageNum == -1)
+		return -1;
+	state->numNodes++;
+	if (ld->numLevels > 0 && btreeLoadAdd(state, ld, 1, ld->minKeys, pageNum) != 0)
+		return -1;
+
+	/* Adding a node to its parent may start one more level so number of levels is checked each time */
+	for (uint8_t l=1; l <= ld->numLevels; l++)
+	{
+		buf = state->buffer->buffer + ld->frames[l]*state->buffer->pageSize;
+		if (l == ld->numLevels)
+			BTREE_SET_ROOT(buf);
+		else
+			BTREE_SET_INTERIOR(buf);
+		pageNum = writePage(state->buffer, buf);
+		if (pageNum == -1)
+			return -1;
+		state->numNodes++;
+		if (l < ld->numLevels && btreeLoadAdd(state, ld, l+1, ld->minKeys + state->keySize * l, pageNum) != 0)
+			return -1;
+	}
+
+	state->activePath[0] = pageNum;
+	state->levels = ld->numLevels+1;
+	return 0;
+}
+
+/**
+@brief     	Returns 1 if tree is empty and fill percentage is valid for a bulk load. Returns 0 otherwise.
+@param     	state
+                BTree algorithm state structure
+@param     	fillPercent
+                Percentage of each node filled
+*/
+static int8_t btreeLoadValid(btreeState *state, uint8_t fillPercent)
+{
+	if (fillPercent == 0 || fillPercent > 100 || state->levels != 1 || state->keySize > BTREE_MAX_KEY_SIZE)
+		return 0;
+	void *buf = readPage(state->buffer, state->activePath[0]);
+	return buf != NULL && BTREE_GET_COUNT(buf) == 0;
+}
+
+/**
+@brief     	Returns number of records put in a leaf and number of keys put in an interior node by a bulk load.
+@param     	state
+                BTree algorithm state structure
+@param     	fillPercent
+                Percentage of each node filled
+@param     	leafCapacity
+                Returns records per leaf
+@param     	interiorCapacity
+                Returns keys per interior node
+*/
+static void btreeLoadCapacity(btreeState *state, uint8_t fillPercent, count_t *leafCapacity, count_t *interiorCapacity)
+{
+	*leafCapacity = state->maxRecordsPerPage * fillPercent / 100;
+	if (*leafCapacity == 0)
+		*leafCapacity = 1;
+	*interiorCapacity = state->maxInteriorRecordsPerPage * fillPercent / 100;
+	if (*interiorCapacity == 0)
+		*interiorCapacity = 1;
+}
+
+/**
+@brief     	Builds BTree bottom-up from records in sorted order. Tree must be empty.
+@param     	state
+                BTree algorithm state structure
+@param     	next
+                Function that copies the next record from source into key and data.
+@param     	source
+                Record source passed to next
+@param     	fillPercent
+                Percentage of each node filled (1 to 100)
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeLoadSorted(btreeState *state, btreeNextRecord next, void *source, uint8_t fillPercent)
+{
+	dbbuffer *buffer = state->buffer;
+	btreeLoad ld;
+	void 	*leaf, *rec, *last = NULL;
+	count_t count = 0, leafCapacity;
+	id_t 	root = state->activePath[0], freeHead = buffer->freeHead, numFree = buffer->numFree;
+	int8_t	insert = 0, status = 0;
+
+	btreeLoadCapacity(state, fillPercent, &leafCapacity, &ld.capacity);
+	ld.numLevels = 0;
+
+	/* Taking a page from the free list reads it into a frame. Free pages are restored after load. */
+	buffer->freeHead = DBBUFFER_EMPTY;
+	buffer->numFree = 0;
+
+	/* Record is read into tempKey and tempData */
+	leaf = initBufferPage(buffer, 0);
+	while (next(source, state->tempKey, state->tempData) == 1)
+	{
+		if (last != NULL && state->compareKey(state->tempKey, last) < 0)
+		{
+			insert = 1;
+			break;
+		}
+
+		if (count == leafCapacity)
+		{	/* Leaf is full. Write it and add it to parent. */
+			if (btreeLoadFull(state, &ld))
+			{
+				insert = 1;
+				break;
+			}
+			int32_t pageNum = writePage(buffer, leaf);
+			if (pageNum == -1 || btreeLoadAdd(state, &ld, 1, leaf + state->headerSize, pageNum) != 0)
+			{
+				status = -1;
+				break;
+			}
+			state->numNodes++;
+			leaf = initBufferPage(buffer, 0);
+			count = 0;
+		}
+
+		last = leaf + state->headerSize + state->recordSize * count;
+		memcpy(last, state->tempKey, state->keySize);
+		memcpy(last + state->keySize, state->tempData, state->dataSize);
+		count++;
+		BTREE_SET_COUNT(leaf, count);
+	}
+
+	if (count > 0 && status == 0)
+		status = btreeLoadFinish(state, &ld, leaf);
+
+	for (uint8_t l=1; l <= ld.numLevels; l++)
+	{
+		if (ld.frames[l] != 0)
+			dbbufferReleaseFrame(buffer, ld.frames[l]);
+	}
+	state->rightLevels = 0;
+
+	/* Insert records not loaded bottom-up. Records are read into buffer 0 as inserts use tempKey and tempData.
+	   Free list is still not used so no write reads a free page into buffer 0. */
+	rec = buffer->buffer;
+	if (status == 0 && insert)
+	{
+		memcpy(rec, state->tempKey, state->keySize);
+		memcpy(rec + state->keySize, state->tempData, state->dataSize);
+		do
+		{
+			status = btreeInsert(state, rec, rec + state->keySize);
+		} while (status == 0 && next(source, rec, rec + state->keySize) == 1);
+	}
+	buffer->freeHead = freeHead;
+	buffer->numFree = numFree;
+	if (status != 0)
+		return -1;
+
+	if (count > 0)
+	{	/* Empty root is replaced. It is freed after new root is written so recovery finds one or the other.
+		   Page 0 is kept as a child id of 0 marks an empty child. */
+		if (root != 0 && dbbufferFreePage(buffer, root) != 0)
+			return -1;
+		state->numNodes--;
+	}
+	return dbbufferCommit(buffer);
+}
+
+/**
+@brief     	Builds BTree bottom-up from records in sorted order. Tree must be empty.
+			Leaves are filled to fillPercent and written in order followed by interior nodes as they fill.
+			The node being built at each interior level is kept in a buffer frame (frames 1 to numPages-1).
+			If records are out of order or the tree needs more levels than there are frames, the tree loaded 
+			so far is completed and the remaining records are inserted with btreePut.
+			Pages on the free list are not used during the load. Load is synced as one operation.
+@param     	state
+                BTree algorithm state structure
+@param     	next
+                Function that copies the next record from source into key and data. Returns 1 if a record was copied, 0 at end.
+@param     	source
+                Record source passed to next
+@param     	fillPercent
+                Percentage of each node filled (1 to 100)
+@return		Return 0 if success. Non-zero value if error or tree is not empty.
+*/
+int8_t btreeBulkLoad(btreeState *state, btreeNextRecord next, void *source, uint8_t fillPercent)
+{
+	int8_t result = -1;
+
+	dbbufferLock(state->buffer);
+	if (btreeLoadValid(state, fillPercent))
+		result = btreeLoadSorted(state, next, source, fillPercent);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/* State of a merge of sorted runs stored on scratch storage. Runs are consecutive and all but the last have runLength records. */
+typedef struct {
+	btreeState	*state;
+	dbstorage	*scratch;					/* Storage holding runs */
+	uint8_t		*pages;						/* Page buffer for each run being merged */
+	id_t		start;						/* First page of runs on scratch storage */
+	uint32_t	numRecords;					/* Number of records in all runs */
+	uint32_t	runLength;					/* Number of records in a run */
+	uint32_t	firstRun;					/* First run being merged */
+	count_t		numInputs;					/* Number of runs being merged */
+	count_t		recordsPerPage;				/* Number of records in a scratch page */
+	uint32_t	consumed[BTREE_SORT_MAX_FANIN];	/* Number of records taken from each run being merged */
+	int8_t		error;						/* 1 if a scratch page could not be read */
+} btreeSort;
+
+/**
+@brief     	Sorts records in memory by key using heapsort. Uses no memory other than the records.
+@param     	state
+                BTree algorithm state structure
+@param     	recs
+                Records
+@param     	size
+                Size of a record in bytes. Records start with key. Size of key sorts keys only.
+@param     	num
+                Number of records
+*/
+static void btreeSortRecords(btreeState *state, uint8_t *recs, uint8_t size, uint32_t num)
+{
+	uint8_t  tmp;
+	uint32_t i, end, root, child;
+
+	/* Build max heap then repeatedly move largest record to end */
+	for (i = num/2, end = num; end > 1; )
+	{
+		if (i > 0)
+			root = --i;
+		else
+		{	
+			end--;
+			for (uint8_t b = 0; b < size; b++)
+			{	tmp = recs[b];
+				recs[b] = recs[end*size+b];
+				recs[end*size+b] = tmp;
+			}
+			root = 0;
+		}
+
+		/* Sift record at root down */
+		while ((child = 2*root+1) < end)
+		{
+			if (child+1 < end && state->compareKey(recs + child*size, recs + (child+1)*size) < 0)
+				child++;
+			if (state->compareKey(recs + root*size, recs + child*size) >= 0)
+				break;
+			for (uint8_t b = 0; b < size; b++)
+			{	tmp = recs[root*size+b];
+				recs[root*size+b] = recs[child*size+b];
+				recs[child*size+b] = tmp;
+			}
+			root = child;
+		}
+	}
+}
+
+/**
+@brief     	Returns number of records in a run.
+@param     	s
+                Merge state
+@param     	run
+                Run number
+*/
+static uint32_t btreeSortRunRecords(btreeSort *s, uint32_t run)
+{
+	uint32_t first = run * s->runLength;
+	return s->numRecords - first < s->runLength ? s->numRecords - first : s->runLength;
+}
+
+/**
+@brief     	Reads the page of a run holding the next record to be merged from it.
+@param     	s
+                Merge state
+@param     	i
+                Input number
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeSortRead(btreeSort *s, count_t i)
+{
+	id_t pageNum = s->start + (s->firstRun + i) * (s->runLength / s->recordsPerPage) + s->consumed[i] / s->recordsPerPage;
+	return s->scratch->readPage(s->scratch, pageNum, s->pages + i * s->state->buffer->pageSize);
+}
+
+/**
+@brief     	Starts merge of runs. Reads first page of each run.
+@param     	s
+                Merge state
+@param     	firstRun
+                First run to merge
+@param     	numInputs
+                Number of runs to merge
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeSortStart(btreeSort *s, uint32_t firstRun, count_t numInputs)
+{
+	s->firstRun = firstRun;
+	s->numInputs = numInputs;
+	s->error = 0;
+	for (count_t i = 0; i < numInputs; i++)
+	{
+		s->consumed[i] = 0;
+		if (btreeSortRead(s, i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Copies the smallest record not yet merged into key and data. Used as record source for bulk load.
+@param     	source
+                Merge state
+@param     	key
+                Key for record
+@param     	data
+                Data for record
+@return		Return 1 if record copied. 0 if no more records or error.
+*/
+static int8_t btreeSortNext(void *source, void *key, void *data)
+{
+	btreeSort 	*s = (btreeSort*) source;
+	btreeState 	*state = s->state;
+	uint8_t 	*rec, *minRec = NULL;
+	count_t 	i, min = 0;
+
+	for (i = 0; i < s->numInputs; i++)
+	{
+		if (s->consumed[i] >= btreeSortRunRecords(s, s->firstRun + i))
+			continue;
+		rec = s->pages + i * state->buffer->pageSize + (s->consumed[i] % s->recordsPerPage) * state->recordSize;
+		if (minRec == NULL || state->compareKey(rec, minRec) < 0)
+		{
+			min = i;
+			minRec = rec;
+		}
+	}
+	if (minRec == NULL)
+		return 0;
+
+	memcpy(key, minRec, state->keySize);
+	memcpy(data, minRec + state->keySize, state->dataSize);
+	s->consumed[min]++;
+	if (s->consumed[min] % s->recordsPerPage == 0 && s->consumed[min] < btreeSortRunRecords(s, s->firstRun + min)
+		&& btreeSortRead(s, min) != 0)
+	{
+		s->error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+@brief     	Writes records in memory to scratch storage as pages. Frame 0 of buffer is used to build each page.
+@param     	state
+                BTree algorithm state structure
+@param     	s
+                Merge state
+@param     	recs
+                Records
+@param     	num
+                Number of records
+@param     	pageNum
+                First scratch page to write
+@return		Return 0 if success. Non-zero value if error.
+*/
+static int8_t btreeSortWrite(btreeState *state, btreeSort *s, uint8_t *recs, uint32_t num, id_t pageNum)
+{
+	void *buf = state->buffer->buffer;
+	for (uint32_t i = 0; i < num; i += s->recordsPerPage, pageNum++)
+	{
+		uint32_t n = num - i < s->recordsPerPage ? num - i : s->recordsPerPage;
+		memcpy(buf, recs + i * state->recordSize, n * state->recordSize);
+		if (s->scratch->writePage(s->scratch, pageNum, buf) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Builds BTree for btreeSortLoad with buffer locked.
+*/
+static int8_t btreeSortLoadLocked(btreeState *state, btreeNextRecord next, void *source, dbstorage *scratch, void *work, uint32_t workSize, uint8_t fillPercent)
+{
+	dbbuffer 	*buffer = state->buffer;
+	btreeSort 	s;
+	count_t		numWork, firstTaken = 1, numTaken = 0, numLevels = 0, leafCapacity, interiorCapacity, fanIn, finalFanIn, i;
+	uint32_t	count = 0, numRuns, n;
+	id_t		regionSize, from = 0;
+	int8_t		status = -1;
+
+	if (!btreeLoadValid(state, fillPercent))
+		return -1;
+
+	s.state = state;
+	s.scratch = scratch;
+	scratch->pageSize = buffer->pageSize;
+	s.recordsPerPage = buffer->pageSize / state->recordSize;
+	s.start = 0;
+	s.numRecords = 0;
+
+	if (work == NULL)
+	{	/* Use frames 1 to numPages-1. They are consecutive in memory. */
+		numWork = buffer->numPages - 1;
+		work = buffer->buffer + buffer->pageSize;
+		for (numTaken = 0; numTaken < numWork; numTaken++)
+		{
+			if (dbbufferTakeFrame(buffer, numTaken+1) == NULL)
+				goto done;
+		}
+	}
+	else
+		numWork = workSize / buffer->pageSize;
+	s.pages = (uint8_t*) work;
+	s.runLength = numWork * s.recordsPerPage;
+
+	/* Sort runs that fill work area and write them to scratch storage */
+	while (next(source, s.pages + count * state->recordSize, s.pages + count * state->recordSize + state->keySize) == 1)
+	{
+		count++;
+		s.numRecords++;
+		if (count == s.runLength)
+		{
+			btreeSortRecords(state, s.pages, state->recordSize, count);
+			if (btreeSortWrite(state, &s, s.pages, count, (s.numRecords - count) / s.recordsPerPage) != 0)
+				goto done;
+			count = 0;
+		}
+	}
+	if (count > 0)
+	{
+		btreeSortRecords(state, s.pages, state->recordSize, count);
+		if (btreeSortWrite(state, &s, s.pages, count, (s.numRecords - count) / s.recordsPerPage) != 0)
+			goto done;
+	}
+	numRuns = (s.numRecords + s.runLength - 1) / s.runLength;
+	regionSize = (s.numRecords + s.recordsPerPage - 1) / s.recordsPerPage;
+
+	/* Frames used by the bulk load for interior levels are not available for the last merge */
+	btreeLoadCapacity(state, fillPercent, &leafCapacity, &interiorCapacity);
+	for (n = (s.numRecords + leafCapacity - 1) / leafCapacity; n > 1; n = (n + interiorCapacity) / (interiorCapacity + 1))
+		numLevels++;
+	fanIn = numWork < BTREE_SORT_MAX_FANIN ? numWork : BTREE_SORT_MAX_FANIN;
+	finalFanIn = numTaken > 0 ? numWork - numLevels : numWork;
+	if (finalFanIn > fanIn)
+		finalFanIn = fanIn;
+	if ((numTaken > 0 && numWork <= numLevels) || (numRuns > finalFanIn && fanIn < 2))
+		goto done;
+
+	/* Merge runs into longer runs. Passes alternate between two regions of scratch storage. */
+	while (numRuns > finalFanIn)
+	{
+		id_t to = from == 0 ? regionSize : 0;
+		s.start = from;
+		for (uint32_t run = 0; run < numRuns; run += fanIn)
+		{
+			if (btreeSortStart(&s, run, numRuns - run < fanIn ? numRuns - run : fanIn) != 0)
+				goto done;
+			id_t pageNum = to + run * (s.runLength / s.recordsPerPage);
+			uint8_t *buf = buffer->buffer;
+			count = 0;
+			while (btreeSortNext(&s, buf + count * state->recordSize, buf + count * state->recordSize + state->keySize) == 1)
+			{
+				if (++count == s.recordsPerPage)
+				{
+					if (scratch->writePage(scratch, pageNum++, buf) != 0)
+						goto done;
+					count = 0;
+				}
+			}
+			if (s.error || (count > 0 && scratch->writePage(scratch, pageNum, buf) != 0))
+				goto done;
+		}
+		s.runLength *= fanIn;
+		numRuns = (numRuns + fanIn - 1) / fanIn;
+		from = to;
+	}
+
+	/* Last merge feeds bulk load. Frames of interior levels are returned to buffer. */
+	s.start = from;
+	if (numTaken > 0)
+	{
+		for (i = 1; i <= numLevels; i++)
+			dbbufferReleaseFrame(buffer, i);
+		s.pages += numLevels * buffer->pageSize;
+		firstTaken += numLevels;
+		numTaken -= numLevels;
+	}
+	if (btreeSortStart(&s, 0, numRuns) != 0)
+		goto done;
+	status = btreeLoadSorted(state, btreeSortNext, &s, fillPercent);
+	if (s.error)
+		status = -1;
+
+done:
+	for (i = 0; i < numTaken; i++)
+		dbbufferReleaseFrame(buffer, firstTaken + i);
+	return status;
+}
+
+/**
+@brief     	Builds BTree from records in any order using an external sort. Tree must be empty.
+			Records are sorted in runs that fill the work area and runs are written to scratch storage.
+			Runs are merged (up to BTREE_SORT_MAX_FANIN at a time) until few enough remain to merge in one pass that feeds 
+			btreeBulkLoad, so the tree is written in key order with leaves filled to fillPercent.
+			If work is NULL, the buffer frames are used as the work area and no other memory is used. The buffer then needs
+			two frames plus one frame for each interior level of the tree. A larger work area may be allocated by the caller.
+@param     	state
+                BTree algorithm state structure
+@param     	next
+                Function that copies the next record from source into key and data. Returns 1 if a record was copied, 0 at end.
+@param     	source
+                Record source passed to next
+@param     	scratch
+                Storage for sorted runs. Contents are overwritten. Uses up to two pages for each page of records.
+@param     	work
+                Work area for sorting or NULL to use buffer frames
+@param     	workSize
+                Size of work area in bytes (at least two pages)
+@param     	fillPercent
+                Percentage of each node filled (1 to 100)
+@return		Return 0 if success. Non-zero value if error or tree is not empty.
+*/
+int8_t btreeSortLoad(btreeState *state, btreeNextRecord next, void *source, dbstorage *scratch, void *work, uint32_t workSize, uint8_t fillPercent)
+{
+	int8_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeSortLoadLocked(state, next, source, scratch, work, workSize, fillPercent);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/**
+@brief     	Returns next record of a merge of leaf records and batch records taken from largest key to smallest.
+@param     	state
+                BTree algorithm state structure
+@param     	leaf
+                Leaf page
+@param     	a
+                Index of last leaf record not taken (-1 if none)
+@param     	batch
+                Batch records
+@param     	b
+                Index of last batch record not taken (-1 if none)
+*/
+static void* btreeBatchTake(btreeState *state, uint8_t *leaf, int32_t *a, uint8_t *batch, int32_t *b)
+{
+	if (*a >= 0 && (*b < 0 || state->compareKey(leaf + state->headerSize + state->recordSize * (*a), batch + state->recordSize * (*b)) > 0))
+		return leaf + state->headerSize + state->recordSize * (*a)--;
+	return batch + state->recordSize * (*b)--;
+}
+
+/**
+@brief     	Returns next record of a merge of leaf records and batch records taken from smallest key to largest.
+@param     	state
+                BTree algorithm state structure
+@param     	leaf
+                Leaf page
+@param     	a
+                Index of first leaf record not taken
+@param     	count
+                Number of leaf records
+@param     	batch
+                Batch records
+@param     	b
+                Index of first batch record not taken
+@param     	g
+                Number of batch records
+*/
+static void* btreeBatchNext(btreeState *state, uint8_t *leaf, int32_t *a, count_t count, uint8_t *batch, int32_t *b, count_t g)
+{
+	if (*a < count && (*b >= g || state->compareKey(leaf + state->headerSize + state->recordSize * (*a), batch + state->recordSize * (*b)) <= 0))
+		return leaf + state->headerSize + state->recordSize * (*a)++;
+	return batch + state->recordSize * (*b)++;
+}
+
+/**
+@brief     	Returns number of records in leaf m when total records are split into k leaves.
+			Leaves are filled in order if records are appended to the rightmost leaf. Otherwise records are spread evenly.
+*/
+static count_t btreeBatchSize(count_t total, count_t k, count_t max, count_t m, int8_t append)
+{
+	if (append)
+		return m < k-1 ? max : total - max*(k-1);
+	return total/k + (m < total%k);
+}
+
+/**
+@brief     	Puts batch of records for btreePutBatch with buffer locked.
+*/
+static int8_t btreePutBatchLocked(btreeState *state, void *records, count_t num)
+{
+	dbbuffer *buffer = state->buffer;
+	uint8_t *recs = records, *leaf, *out;
+	uint8_t seps[BTREE_BATCH_MAX_SPLIT * BTREE_MAX_KEY_SIZE];
+	id_t 	pages[BTREE_BATCH_MAX_SPLIT];
+	count_t i = 0, m, max = state->maxRecordsPerPage;
+	int8_t 	rightmost, status = 0;
+
+	if (state->keySize > BTREE_MAX_KEY_SIZE)
+		return -1;
+
+	btreeSortRecords(state, recs, state->recordSize, num);
+	state->rightLevels = 0;
+
+	while (i < num)
+	{
+		uint8_t *batch = recs + state->recordSize * i;
+		/* Smallest key to right of leaf is kept in tempKey until records for leaf are found */
+		id_t leafId = btreeFindLeaf(state, batch, state->tempKey, &rightmost);
+		if (leafId == (id_t) -1)
+			return -1;
+		leaf = dbbufferPin(buffer, leafId, 0);
+		if (leaf == NULL)
+			return -1;
+		count_t count = BTREE_GET_COUNT(leaf);
+
+		/* Records before bound belong in leaf. Leaf is split into at most BTREE_BATCH_MAX_SPLIT leaves at a time. */
+		count_t g = 0;
+		while (i + g < num && count + g < max * BTREE_BATCH_MAX_SPLIT
+			&& (rightmost || state->compareKey(batch + state->recordSize * g, state->tempKey) < 0))
+			g++;
+		i += g;
+
+		count_t total = count + g, k = (total + max - 1) / max;
+		int8_t append = rightmost && (count == 0 || state->compareKey(batch, leaf + state->headerSize + state->recordSize * (count-1)) > 0);
+		int32_t a = count-1, b = g-1, r;
+
+		if (k == 1)
+		{	/* Merge records into leaf in place starting from end */
+			for (r = total-1; b >= 0; r--)
+				memcpy(leaf + state->headerSize + state->recordSize * r, btreeBatchTake(state, leaf, &a, batch, &b), state->recordSize);
+			BTREE_SET_COUNT(leaf, total);
+			if (state->levels == 1)
+				BTREE_SET_ROOT(leaf);
+			r = overWritePage(buffer, leaf, leafId);
+			dbbufferUnpin(buffer, leafId);
+			if (r == -1)
+				return -1;
+			continue;
+		}
+
+		/* Leaf is split into k leaves. Smallest records stay in leaf. New leaves are written in key order while leaf is pinned 
+		   so they get increasing page ids, and leaf is overwritten last. 
+		   Taking a page from the free list reads it into a frame so free pages are not used while leaf is pinned. */
+		count_t size = btreeBatchSize(total, k, max, 0, append);
+		for (a = 0, b = 0, r = 0; r < size; r++)
+			btreeBatchNext(state, leaf, &a, count, batch, &b, g);	/* Skip records that stay in leaf */
+
+		id_t freeHead = buffer->freeHead, numFree = buffer->numFree;
+		buffer->freeHead = DBBUFFER_EMPTY;
+		buffer->numFree = 0;
+		for (m = 1; m < k && status == 0; m++)
+		{
+			count_t mSize = btreeBatchSize(total, k, max, m, append);
+			out = initBufferPage(buffer, 0);
+			for (r = 0; r < mSize; r++)
+				memcpy(out + state->headerSize + state->recordSize * r, btreeBatchNext(state, leaf, &a, count, batch, &b, g), state->recordSize);
+			BTREE_SET_COUNT(out, mSize);
+			memcpy(seps + state->keySize * m, out + state->headerSize, state->keySize);
+			pages[m] = writePage(buffer, out);
+			if (pages[m] == (id_t) -1)
+				status = -1;
+			else
+				state->numNodes++;
+		}
+		buffer->freeHead = freeHead;
+		buffer->numFree = numFree;
+
+		out = initBufferPage(buffer, 0);
+		for (a = 0, b = 0, r = 0; r < size; r++)
+			memcpy(out + state->headerSize + state->recordSize * r, btreeBatchNext(state, leaf, &a, count, batch, &b, g), state->recordSize);
+		BTREE_SET_COUNT(out, size);
+		dbbufferUnpin(buffer, leafId);
+		if (status != 0 || overWritePage(buffer, out, leafId) == -1)
+			return -1;
+
+		/* Add new leaves to parents from left to right. Searching for first key of new leaf finds path to leaf before it. */
+		for (m = 1; m < k; m++)
+		{
+			if (btreeFindLeaf(state, seps + state->keySize * m, NULL, &rightmost) == (id_t) -1)
+				return -1;
+			memcpy(state->tempKey, seps + state->keySize * m, state->keySize);
+			if (btreeInsertParent(state, m == 1 ? leafId : pages[m-1], pages[m], append) != 0)
+				return -1;
+		}
+	}
+	state->rightLevels = 0;
+	return dbbufferCommit(buffer);
+}
+
+/**
+@brief     	Puts a batch of records into structure. Batch is synced as one operation.
+			Records are sorted by key and each leaf is searched for once. All records for a leaf are merged 
+			into it with one write. A leaf that overflows is split into as many leaves as needed.
+@param     	state
+                BTree algorithm state structure
+@param     	records
+                Array of num records (key followed by data). Records are sorted in place.
+@param     	num
+                Number of records
+@return		Return 0 if success. Non-zero value if error or key is larger than BTREE_MAX_KEY_SIZE.
+*/
+int8_t btreePutBatch(btreeState *state, void *records, count_t num)
+{
+	int8_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreePutBatchLocked(state, records, num);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/**
+@brief     	Given a key, searches the node for the key.
+			If interior node, returns child record number containing next page id to follow.
+			If leaf node, returns if of first record with that key or (<= key).
+			Returns -1 if key is not found.			
+@param     	state
+                btree algorithm state structure
+@param     	buffer
+                Pointer to in-memory buffer holding node
+@param     	key
+                Key for record
+@param		pageId
+				Page if for page being searched
+@param		range
+				1 if range query so return pointer to first record <= key, 0 if exact query so much return first exact match record
+*/
+int32_t btreeSearchNode(btreeState *state, void *buffer, void* key, id_t pageId, int8_t range)
+{
+	int16_t first, last, middle, count;
+	int8_t compare, interior;
+	void *mkey;
+	
+	count = BTREE_GET_COUNT(buffer);  
+	interior = BTREE_IS_INTERIOR(buffer) && state->levels != 1;
+
+	if (interior)
+	{
+		if (count == 0)	/* Only one child pointer */
+			return 0;
+		if (count == 1)	/* One key and two children pointers */
+		{
+			mkey = buffer+state->headerSize;   /* Key at index 0 */
+			compare = state->compareKey(key, mkey);
+			if (compare < 0)
+				return 0;
+			return 1;		
+		}
+		
+		first = 0;	
+  		last =  count;
+		if (last > state->maxInteriorRecordsPerPage)
+			last = state->maxInteriorRecordsPerPage;
+  		middle = (first+last)/2;
+		while (first < last) 
+		{			
+			mkey = buffer+state->headerSize+state->keySize*middle;
+			compare = state->compareKey(key,mkey);
+			if (compare > 0)
+				first = middle + 1;
+			else if (compare == 0) 
+			{	last = middle+1; /* Return the child pointer just after */
+				break;
+			}				
+			else
+				last = middle;  /* Note: Not -1 as always want last pointer to be <= key so that will use it if necessary */
+
+			middle = (first + last)/2;
+		}
+		return last;		
+	}
+	else
+	{
+		first = 0;	
+  		last =  count - 1;
+  		middle = (first+last)/2;	
+
+		while (first <= last) 
+		{			
+			mkey = buffer+state->headerSize+state->recordSize*middle;
+			compare = state->compareKey(mkey, key);
+			if (compare < 0)
+				first = middle + 1;
+			else if (compare == 0) 
+				return middle;							
+			else
+				last = middle - 1;
+
+			middle = (first + last)/2;
+		}
+		if (range)			
+		{	
+			if (last == -1)
+				return -1;
+			return middle;
+		}
+		return -1;
+	}
+}
+
+/**
 @brief     	Given a child link, returns the proper physical page id.
 			This method handles the mapping of the active path where the pointer in the
 			node is not actually pointing to the most up to date block.			
@@ -748,18 +1825,9 @@ id_t getChildPageId(btreeState *state, void *buf, id_t pageId, int8_t level, id_
 }
 
 /**
-@brief     	Given a key, returns data associated with key.
-			Note: Space for data must be already allocated.
-			Data is copied from database into data buffer.
-@param     	state
-                btree algorithm state structure
-@param     	key
-                Key for record
-@param     	data
-                Pre-allocated memory to copy data for record
-@return		Return 0 if success. Non-zero value if error.
+@brief     	Looks up key for btreeGet with buffer locked.
 */
-int8_t btreeGet(btreeState *state, void* key, void *data)
+static int8_t btreeGetLocked(btreeState *state, void* key, void *data)
 {
 	/* Starting at root search for key */
 	int8_t l;
@@ -768,7 +1836,7 @@ int8_t btreeGet(btreeState *state, void* key, void *data)
 	
 	for (l=0; l < state->levels-1; l++)
 	{		
-		buf = readPage(state->buffer, nextId);		
+		buf = readPageLevel(state->buffer, nextId, state->levels-1-l);		
 
 		/* Find the key within the node. Sorted by key. Use binary search. */
 		childNum = btreeSearchNode(state, buf, key, nextId, 0);
@@ -778,7 +1846,7 @@ int8_t btreeGet(btreeState *state, void* key, void *data)
 	}
 
 	/* Search the leaf node and return search result */
-	buf = readPage(state->buffer, nextId);
+	buf = readPageLevel(state->buffer, nextId, 0);
 	if (buf == NULL)
 		return -1;
 	nextId = btreeSearchNode(state, buf, key, nextId, 0);
@@ -791,13 +1859,255 @@ int8_t btreeGet(btreeState *state, void* key, void *data)
 }
 
 /**
-@brief     	Initialize iterator on btree structure.
+@brief     	Given a key, returns data associated with key.
+			Note: Space for data must be already allocated.
+			Data is copied from database into data buffer.
 @param     	state
                 btree algorithm state structure
-@param     	it
-                btree iterator state structure
+@param     	key
+                Key for record
+@param     	data
+                Pre-allocated memory to copy data for record
+@return		Return 0 if success. Non-zero value if error.
 */
-void btreeInitIterator(btreeState *state, btreeIterator *it)
+int8_t btreeGet(btreeState *state, void* key, void *data)
+{
+	int8_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeGetLocked(state, key, data);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/**
+@brief     	Looks up keys for btreeMultiGet with buffer locked.
+*/
+static int32_t btreeMultiGetLocked(btreeState *state, void *keys, void *data, int8_t *results, id_t *pageIds, count_t num)
+{
+	int8_t l;
+	void *buf, *key;
+	id_t childNum;
+	count_t i, start;
+	int32_t n, numFound = 0;
+	
+	/* All lookups start at root */
+	for (i=0; i < num; i++)
+	{
+		pageIds[i] = state->activePath[0];
+		results[i] = -1;
+	}
+
+	for (l=0; l < state->levels; l++)
+	{
+		for (start=0; start < num; start += n)
+		{
+			/* Read pages for as many lookups as fit in buffer as one batch */
+			n = dbbufferReadBatch(state->buffer, pageIds+start, num-start, state->levels-1-l);
+			if (n <= 0)
+				return -1;
+
+			/* Advance lookups to next level. Pages are all buffered. */
+			for (i=start; i < start+n; i++)
+			{	
+				if (pageIds[i] == DBBUFFER_EMPTY)
+					continue;		/* Key not in tree */
+
+				key = keys + i*state->keySize;
+				buf = readPageLevel(state->buffer, pageIds[i], state->levels-1-l);
+				if (buf == NULL)
+					return -1;
+				
+				childNum = btreeSearchNode(state, buf, key, pageIds[i], 0);
+				if (l < state->levels-1)
+				{
+					pageIds[i] = getChildPageId(state, buf, pageIds[i], l, childNum);		/* -1 is DBBUFFER_EMPTY */	
+				}
+				else if (childNum != (id_t) -1)
+				{	/* Key found */
+					memcpy(data + i*state->dataSize, (void*) (buf+state->headerSize+state->recordSize*childNum+state->keySize), state->dataSize);
+					results[i] = 0;
+					numFound++;
+				}
+			}
+		}
+	}
+	return numFound;
+}
+
+/**
+@brief     	Given a list of keys, returns data associated with each key.
+			Lookups advance together one level at a time and the pages they need at each level
+			are read from storage as one batch. Sorted keys need fewer pages per batch.
+			Note: Space for data, results, and page ids must be already allocated.
+@param     	state
+                btree algorithm state structure
+@param     	keys
+                Array of num keys
+@param     	data
+                Pre-allocated memory for num data values. Data for key i is copied to position i.
+@param     	results
+                Pre-allocated array of num results. Result i is 0 if key i was found, -1 otherwise.
+@param     	pageIds
+                Pre-allocated work array of num page ids
+@param     	num
+                Number of keys
+@return		Return number of keys found or -1 if error.
+*/
+int32_t btreeMultiGet(btreeState *state, void *keys, void *data, int8_t *results, id_t *pageIds, count_t num)
+{
+	int32_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeMultiGetLocked(state, keys, data, results, pageIds, num);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/**
+@brief     	Looks up sorted keys for btreeGetBatch with buffer locked.
+*/
+static int32_t btreeGetBatchLocked(btreeState *state, void *keys, void *data, int8_t *results, count_t num)
+{
+	id_t 	path[MAX_LEVEL], childNum;
+	uint8_t bounds[MAX_LEVEL * BTREE_MAX_KEY_SIZE];	/* Smallest key to right of node on path at each level */
+	int8_t 	hasBound[MAX_LEVEL], l = 0;
+	void 	*buf, *key;
+	count_t i = 0, last, lo, hi, mid;
+	int32_t numFound = 0;
+
+	if (state->keySize > BTREE_MAX_KEY_SIZE)
+		return -1;
+
+	/* Keys are often requested in order. Sort only if not. */
+	for (i = 1; i < num && state->compareKey(keys + (i-1)*state->keySize, keys + i*state->keySize) <= 0; i++);
+	if (i < num)
+		btreeSortRecords(state, keys, state->keySize, num);
+
+	i = 0;
+	path[0] = state->activePath[0];
+	hasBound[0] = 0;
+	while (i < num)
+	{
+		key = keys + i*state->keySize;
+
+		/* Go up path to node that holds key */
+		while (l > 0 && hasBound[l] && state->compareKey(key, bounds + l*state->keySize) >= 0)
+			l--;
+
+		/* Search down to leaf */
+		for ( ; l < state->levels-1; l++)
+		{
+			buf = readPageLevel(state->buffer, path[l], state->levels-1-l);
+			if (buf == NULL)
+				return -1;
+
+			childNum = btreeSearchNode(state, buf, key, path[l], 0);
+			path[l+1] = getChildPageId(state, buf, path[l], l, childNum);
+			if (path[l+1] == (id_t) -1)
+				break;
+			
+			/* Bound of child is key after it or bound of node */
+			hasBound[l+1] = hasBound[l];
+			if (childNum != BTREE_GET_COUNT(buf))
+			{
+				memcpy(bounds + (l+1)*state->keySize, buf + state->headerSize + state->keySize*childNum, state->keySize);
+				hasBound[l+1] = 1;
+			}
+			else if (hasBound[l])
+				memcpy(bounds + (l+1)*state->keySize, bounds + l*state->keySize, state->keySize);
+		}
+		if (l < state->levels-1)
+		{	/* Key not in tree */
+			results[i++] = -1;
+			continue;
+		}
+
+		/* Keys before bound of leaf are in leaf. Binary search sorted keys for first key not in leaf. */
+		last = num;
+		if (hasBound[l])
+		{
+			for (lo = i, hi = num; lo < hi; )
+			{
+				mid = (lo+hi)/2;
+				if (state->compareKey(keys + mid*state->keySize, bounds + l*state->keySize) < 0)
+					lo = mid+1;
+				else
+					hi = mid;
+			}
+			last = lo;
+		}
+
+		buf = readPageLevel(state->buffer, path[l], 0);
+		if (buf == NULL)
+			return -1;
+		for ( ; i < last; i++)
+		{
+			childNum = btreeSearchNode(state, buf, keys + i*state->keySize, path[l], 0);
+			results[i] = -1;
+			if (childNum != (id_t) -1)
+			{	/* Key found */
+				memcpy(data + i*state->dataSize, (void*) (buf+state->headerSize+state->recordSize*childNum+state->keySize), state->dataSize);
+				results[i] = 0;
+				numFound++;
+			}
+		}
+	}
+	return numFound;
+}
+
+/**
+@brief     	Given a list of keys, returns data associated with each key.
+			Keys are sorted (if not already) and looked up in order with one pass through the tree. Each leaf holding keys is
+			read once and all of its keys are found together. Only the part of the path to the previous leaf
+			that does not hold the next key is searched again.
+			Note: Space for data and results must be already allocated.
+@param     	state
+                BTree algorithm state structure
+@param     	keys
+                Array of num keys. Keys are sorted in place.
+@param     	data
+                Pre-allocated memory for num data values. Data for key i (after sorting) is copied to position i.
+@param     	results
+                Pre-allocated array of num results. Result i is 0 if key i (after sorting) was found, -1 otherwise.
+@param     	num
+                Number of keys
+@return		Return number of keys found or -1 if error or key is larger than BTREE_MAX_KEY_SIZE.
+*/
+int32_t btreeGetBatch(btreeState *state, void *keys, void *data, int8_t *results, count_t num)
+{
+	int32_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeGetBatchLocked(state, keys, data, results, num);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
+/**
+@brief     	Reads ahead leaf pages following a child of a parent node into the buffer frames reserved for read-ahead.
+@param     	state
+                btree algorithm state structure
+@param     	buf
+                Parent node of leaf pages
+@param     	childNum
+                Child number of next leaf to be read
+*/
+void btreeReadAhead(btreeState *state, void *buf, id_t childNum)
+{
+	count_t count = BTREE_GET_COUNT(buf);
+	id_t *children = (id_t*) (buf + state->headerSize + state->keySize*state->maxInteriorRecordsPerPage);
+	count_t num = count + 1 - childNum;
+
+	if (children[count] == 0 && num > 0)		/* Last child which is empty */
+		num--;
+	dbbufferPrefetch(state->buffer, children + childNum, num);
+}
+
+/**
+@brief     	Initializes iterator for btreeInitIterator with buffer locked.
+*/
+static void btreeInitIteratorLocked(btreeState *state, btreeIterator *it)
 {	
 	/* Find start location */
 	/* Starting at root search for key */
@@ -809,7 +2119,7 @@ void btreeInitIterator(btreeState *state, btreeIterator *it)
 	for (l=0; l < state->levels-1; l++)
 	{		
 		it->activeIteratorPath[l] = nextId;		
-		buf = readPage(state->buffer, nextId);		
+		buf = readPageLevel(state->buffer, nextId, state->levels-1-l);		
 
 		/* Find the key within the node. Sorted by key. Use binary search. */
 		childNum = btreeSearchNode(state, buf, it->minKey, nextId, 1);
@@ -820,27 +2130,36 @@ void btreeInitIterator(btreeState *state, btreeIterator *it)
 		it->lastIterRec[l] = childNum;
 	}
 
-	/* Search the leaf node and return search result */
+	if (l > 0 && state->buffer->numPrefetch > 0)
+		btreeReadAhead(state, buf, it->lastIterRec[l-1]);
+
+	/* Search the leaf node and return search result. Leaves are read as a scan so they do not replace pages used by lookups. */
 	it->activeIteratorPath[l] = nextId;	
-	buf = readPage(state->buffer, nextId);
+	buf = dbbufferReadScan(state->buffer, nextId);
 	it->currentBuffer = buf;
 	childNum = btreeSearchNode(state, buf, it->minKey, nextId, 1);		
 	it->lastIterRec[l] = childNum;
 }
 
-
 /**
-@brief     	Requests next key, data pair from iterator.
+@brief     	Initialize iterator on btree structure.
 @param     	state
                 btree algorithm state structure
 @param     	it
                 btree iterator state structure
-@param     	key
-                Key for record (pointer returned)
-@param     	data
-                Data for record (pointer returned)
 */
-int8_t btreeNext(btreeState *state, btreeIterator *it, void **key, void **data)
+void btreeInitIterator(btreeState *state, btreeIterator *it)
+{
+	dbbufferLock(state->buffer);
+	btreeInitIteratorLocked(state, it);
+	dbbufferUnlock(state->buffer);
+}
+
+
+/**
+@brief     	Returns next record for btreeNext with buffer locked.
+*/
+static int8_t btreeNextLocked(btreeState *state, btreeIterator *it, void **key, void **data)
 {	
 	void *buf = it->currentBuffer;
 	int8_t l=state->levels-1;
@@ -862,7 +2181,7 @@ int8_t btreeNext(btreeState *state, btreeIterator *it, void **key, void **data)
 				/* Advance to next page. Requires examining active path. */
 				for (l=state->levels-2; l >= 0; l--)
 				{	
-					buf = readPage(state->buffer, it->activeIteratorPath[l]);
+					buf = readPageLevel(state->buffer, it->activeIteratorPath[l], state->levels-1-l);
 					if (buf == NULL)
 						return 0;						
 
@@ -887,7 +2206,12 @@ int8_t btreeNext(btreeState *state, btreeIterator *it, void **key, void **data)
 						return 0;	
 					
 					it->activeIteratorPath[l+1] = nextPage;
-					buf = readPage(state->buffer, nextPage);
+					if (l == state->levels-2 && state->buffer->numPrefetch > 0)
+						btreeReadAhead(state, buf, it->lastIterRec[l]);
+					if (l == state->levels-2)
+						buf = dbbufferReadScan(state->buffer, nextPage);
+					else
+						buf = readPageLevel(state->buffer, nextPage, state->levels-2-l);
 					if (buf == NULL)
 						return 0;	
 				}
@@ -910,6 +2234,27 @@ int8_t btreeNext(btreeState *state, btreeIterator *it, void **key, void **data)
 	}
 }
 
+/**
+@brief     	Requests next key, data pair from iterator.
+@param     	state
+                btree algorithm state structure
+@param     	it
+                btree iterator state structure
+@param     	key
+                Key for record (pointer returned)
+@param     	data
+                Data for record (pointer returned)
+*/
+int8_t btreeNext(btreeState *state, btreeIterator *it, void **key, void **data)
+{
+	int8_t result;
+
+	dbbufferLock(state->buffer);
+	result = btreeNextLocked(state, it, key, data);
+	dbbufferUnlock(state->buffer);
+	return result;
+}
+
 
 /**
 @brief     	Clears statistics.
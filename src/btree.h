@@ -33,13 +33,13 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 /******************************************************************************/
+#ifndef BTREE_H
+#define BTREE_H
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
-#ifndef BTREE_H
-#define BTREE_H
-
 #if defined(ARDUINO)
 #include "file/serial_c_iface.h"
 #endif
@@ -76,6 +76,21 @@ typedef uint16_t count_t;
 
 #define MAX_LEVEL 8
 
+/* Maximum key size in bytes for bulk loading and batch operations that keep a key per level or per new leaf */
+#ifndef BTREE_MAX_KEY_SIZE
+#define BTREE_MAX_KEY_SIZE 16
+#endif
+
+/* Maximum number of sorted runs merged at once by btreeSortLoad */
+#ifndef BTREE_SORT_MAX_FANIN
+#define BTREE_SORT_MAX_FANIN 16
+#endif
+
+/* Maximum number of leaves one leaf is split into at once by btreePutBatch */
+#ifndef BTREE_BATCH_MAX_SPLIT
+#define BTREE_BATCH_MAX_SPLIT 8
+#endif
+
 typedef struct {			
 	uint8_t keySize;							/* Size of key in bytes (fixed-size records) */
 	uint8_t dataSize;							/* Size of data in bytes (fixed-size records) */
@@ -87,6 +102,8 @@ typedef struct {
     int8_t (*compareKey)(void *a, void *b);		/* Function that compares two arbitrary keys passed as parameters */	
 	uint8_t levels;								/* Number of levels in tree */
 	id_t 	activePath[MAX_LEVEL];				/* Active path of page indexes from root (in position 0) to node just above leaf */
+	id_t 	rightPath[MAX_LEVEL];				/* Path of page indexes from root to rightmost leaf (in position levels-1). Used to append keys in order without search. */
+	uint8_t rightLevels;						/* Levels in rightPath. 0 if last insert was not on rightmost leaf. */
 	id_t 	nextPageWriteId;					/* Physical page id of next page to write. */
 	void 	*tempKey;							/* Used to temporarily store a key value. Space must be preallocated. */
 	void 	*tempData;							/* Used to temporarily store a data value. Space must be preallocated. */
@@ -102,6 +119,9 @@ typedef struct {
 	void*   currentBuffer;						/* Current buffer used by iterator */
 } btreeIterator;
 
+/* Record source for bulk load. Copies next record into key and data. Returns 1 if a record was copied, 0 if no more records. */
+typedef int8_t (*btreeNextRecord)(void *source, void *key, void *data);
+
 /**
 @brief     	Initialize a BTree structure.
 @param     	state
@@ -117,7 +137,9 @@ void btreeInit(btreeState *state);
 void btreeRecover(btreeState *state);
 
 /**
-@brief     	Puts a given key, data pair into structure.
+@brief     	Puts a given key, data pair into structure. Insert is synced according to sync policy of buffer.
+			Keys inserted in increasing order are appended to the rightmost leaf without searching from root.
+			A full rightmost node is not split in half. A new node is started to its right so nodes are left full.
 @param     	state
                 BTree algorithm state structure
 @param     	key
@@ -128,6 +150,20 @@ void btreeRecover(btreeState *state);
 */
 int8_t btreePut(btreeState *state, void* key, void *data);
 
+/**
+@brief     	Puts a batch of records into structure. Batch is synced as one operation.
+			Records are sorted by key and each leaf is searched for once. All records for a leaf are merged 
+			into it with one write. A leaf that overflows is split into as many leaves as needed.
+@param     	state
+                BTree algorithm state structure
+@param     	records
+                Array of num records (key followed by data). Records are sorted in place.
+@param     	num
+                Number of records
+@return		Return 0 if success. Non-zero value if error or key is larger than BTREE_MAX_KEY_SIZE.
+*/
+int8_t btreePutBatch(btreeState *state, void *records, count_t num);
+
 /**
 @brief     	Given a key, returns data associated with key.
 			Note: Space for data must be already allocated.
@@ -142,6 +178,91 @@ int8_t btreePut(btreeState *state, void* key, void *data);
 */
 int8_t btreeGet(btreeState *state, void* key, void *data);
 
+/**
+@brief     	Given a list of keys, returns data associated with each key.
+			Lookups advance together one level at a time and the pages they need at each level
+			are read from storage as one batch. Sorted keys need fewer pages per batch.
+			Note: Space for data, results, and page ids must be already allocated.
+@param     	state
+                BTree algorithm state structure
+@param     	keys
+                Array of num keys
+@param     	data
+                Pre-allocated memory for num data values. Data for key i is copied to position i.
+@param     	results
+                Pre-allocated array of num results. Result i is 0 if key i was found, -1 otherwise.
+@param     	pageIds
+                Pre-allocated work array of num page ids
+@param     	num
+                Number of keys
+@return		Return number of keys found or -1 if error.
+*/
+int32_t btreeMultiGet(btreeState *state, void *keys, void *data, int8_t *results, id_t *pageIds, count_t num);
+
+/**
+@brief     	Given a list of keys, returns data associated with each key.
+			Keys are sorted (if not already) and looked up in order with one pass through the tree. Each leaf holding keys is
+			read once and all of its keys are found together. Only the part of the path to the previous leaf
+			that does not hold the next key is searched again.
+			Note: Space for data and results must be already allocated.
+@param     	state
+                BTree algorithm state structure
+@param     	keys
+                Array of num keys. Keys are sorted in place.
+@param     	data
+                Pre-allocated memory for num data values. Data for key i (after sorting) is copied to position i.
+@param     	results
+                Pre-allocated array of num results. Result i is 0 if key i (after sorting) was found, -1 otherwise.
+@param     	num
+                Number of keys
+@return		Return number of keys found or -1 if error or key is larger than BTREE_MAX_KEY_SIZE.
+*/
+int32_t btreeGetBatch(btreeState *state, void *keys, void *data, int8_t *results, count_t num);
+
+/**
+@brief     	Builds BTree bottom-up from records in sorted order. Tree must be empty.
+			Leaves are filled to fillPercent and written in order followed by interior nodes as they fill.
+			The node being built at each interior level is kept in a buffer frame (frames 1 to numPages-1).
+			If records are out of order or the tree needs more levels than there are frames, the tree loaded 
+			so far is completed and the remaining records are inserted with btreePut.
+			Pages on the free list are not used during the load. Load is synced as one operation.
+@param     	state
+                BTree algorithm state structure
+@param     	next
+                Function that copies the next record from source into key and data. Returns 1 if a record was copied, 0 at end.
+@param     	source
+                Record source passed to next
+@param     	fillPercent
+                Percentage of each node filled (1 to 100)
+@return		Return 0 if success. Non-zero value if error or tree is not empty.
+*/
+int8_t btreeBulkLoad(btreeState *state, btreeNextRecord next, void *source, uint8_t fillPercent);
+
+/**
+@brief     	Builds BTree from records in any order using an external sort. Tree must be empty.
+			Records are sorted in runs that fill the work area and runs are written to scratch storage.
+			Runs are merged (up to BTREE_SORT_MAX_FANIN at a time) until few enough remain to merge in one pass that feeds 
+			btreeBulkLoad, so the tree is written in key order with leaves filled to fillPercent.
+			If work is NULL, the buffer frames are used as the work area and no other memory is used. The buffer then needs
+			two frames plus one frame for each interior level of the tree. A larger work area may be allocated by the caller.
+@param     	state
+                BTree algorithm state structure
+@param     	next
+                Function that copies the next record from source into key and data. Returns 1 if a record was copied, 0 at end.
+@param     	source
+                Record source passed to next
+@param     	scratch
+                Storage for sorted runs. Contents are overwritten. Uses up to two pages for each page of records.
+@param     	work
+                Work area for sorting or NULL to use buffer frames
+@param     	workSize
+                Size of work area in bytes (at least two pages)
+@param     	fillPercent
+                Percentage of each node filled (1 to 100)
+@return		Return 0 if success. Non-zero value if error or tree is not empty.
+*/
+int8_t btreeSortLoad(btreeState *state, btreeNextRecord next, void *source, dbstorage *scratch, void *work, uint32_t workSize, uint8_t fillPercent);
+
 /**
 @brief     	Initialize iterator on BTree structure.
 @param     	state
@@ -210,6 +331,17 @@ int32_t btreeSearchNode(btreeState *state, void *buffer, void* key, id_t pageId,
 */
 id_t getChildPageId(btreeState *state, void *buf, id_t pageId, int8_t level, id_t childNum);
 
+/**
+@brief     	Reads ahead leaf pages following a child of a parent node into the buffer frames reserved for read-ahead.
+@param     	state
+                BTree algorithm state structure
+@param     	buf
+                Parent node of leaf pages
+@param     	childNum
+                Child number of next leaf to be read
+*/
+void btreeReadAhead(btreeState *state, void *buf, id_t childNum);
+
 
 /**
 @brief     	Print a node in an in-memory buffer.
@@ -35,16 +35,45 @@
 /******************************************************************************/
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#if !defined(ARDUINO)
+#include <time.h>
+#endif
 
 #include "dbbuffer.h"
 #include "btree.h"
 
 /**
-@brief     	Initializes buffer given page size and number of pages.
+@brief     	Returns time in milliseconds used for sync intervals.
+*/
+static uint32_t dbbufferMillis(void)
+{
+#if defined(ARDUINO)
+	return millis();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+/**
+@brief     	Returns number of frames used by replacement policy. Frames reserved for scans and read-ahead follow them.
 @param     	state
                 DBbuffer state structure
 */
-void dbbufferInit(dbbuffer *state)
+static count_t dbbufferNumFrames(dbbuffer *state)
+{
+	return state->numPages - state->numPrefetch - state->numScan;
+}
+
+/**
+@brief     	Clears buffer state.
+@param     	state
+                DBbuffer state structure
+*/
+static void dbbufferClear(dbbuffer *state)
 {
 	printf("Initializing buffer.\n");
 	printf("Buffer size: %d  Page size: %d\n", state->numPages, state->pageSize);			
@@ -56,46 +85,380 @@ void dbbufferInit(dbbuffer *state)
 	state->numWrites = 0;
 	state->numOverWrites = 0;
 	state->bufferHits = 0;
-	state->lastHit = 0;
+	state->lastHit = DBBUFFER_EMPTY;
+	state->accessCount = 0;
 	state->nextBufferPage = 1;
+
+	state->storage->pageSize = state->pageSize;
 	
 	/* Clear buffer status flags */
 	for (count_t l=0; l < state->numPages; l++)
-		state->status[l] = 0;	
+	{
+		state->status[l] = DBBUFFER_EMPTY;	
+		state->frames[l].flags = 0;
+		state->frames[l].level = 0;
+		state->frames[l].pin = 0;
+		state->frames[l].lastUse = 0;
+	}
+	state->numDirty = 0;
+	state->nextPrefetch = state->numPages - state->numPrefetch;
+	state->nextScan = dbbufferNumFrames(state);
+	state->numAppend = 0;
+	state->freeHead = DBBUFFER_EMPTY;
+	state->numFree = 0;
+	state->reserveEnd = 0;
+	state->numUnsynced = 0;
+	state->lastSync = dbbufferMillis();
+	state->numSyncs = 0;
+	state->flusher = NULL;
+
+	if (state->hashTable != NULL)
+	{
+		for (count_t l=0; l < state->hashSize; l++)
+			state->hashTable[l] = 0;
+	}
+
+	if (state->superblock != NULL)
+	{	/* First pages of storage hold superblock */
+		state->nextPageId = DBBUFFER_SUPERBLOCK_PAGES;
+		state->nextPageWriteId = DBBUFFER_SUPERBLOCK_PAGES;
+	}
+}
+
+static count_t dbbufferFindFrame(dbbuffer *state, id_t pageNum);
+static void dbbufferSetFrame(dbbuffer *state, count_t frame, id_t pageNum);
+static void dbbufferAccess(dbbuffer *state, count_t frame, uint8_t level, int8_t loaded);
+
+/* Size of entry in list of buffered pages following superblock (page id and level) */
+#define DBBUFFER_WARM_ENTRY		(sizeof(id_t)+1)
+
+/**
+@brief     	Computes checksum of superblock.
+@param     	page
+                Superblock followed by list of numWarm buffered pages
+@return		Returns checksum of all fields before checksum and list of buffered pages.
+*/
+static uint32_t dbbufferChecksum(void *page)
+{
+	uint32_t sum = 2166136261u;
+	uint8_t *bytes = (uint8_t*) page;
+	count_t i, end = sizeof(dbsuperblock) + ((dbsuperblock*) page)->numWarm * DBBUFFER_WARM_ENTRY;
+
+	for (i=0; i < offsetof(dbsuperblock, checksum); i++)
+		sum = (sum ^ bytes[i]) * 16777619u;
+	for (i=sizeof(dbsuperblock); i < end; i++)
+		sum = (sum ^ bytes[i]) * 16777619u;
+	return sum;
+}
+
+/**
+@brief     	Lists buffered pages after superblock in buffer 0. Pages at higher tree levels are listed first 
+			so they are kept if the buffer is smaller on recovery.
+@param     	state
+                DBbuffer state structure
+@return		Returns number of pages listed.
+*/
+static count_t dbbufferListWarm(dbbuffer *state)
+{
+	count_t i, num = 0, numFrames = dbbufferNumFrames(state);
+	count_t max = (state->pageSize - sizeof(dbsuperblock)) / DBBUFFER_WARM_ENTRY;
+	id_t *ids = (id_t*) (state->buffer + sizeof(dbsuperblock));
+	uint8_t level = 0;
+
+	if (max > numFrames-1)
+		max = numFrames-1;
+	for (i=1; i < numFrames; i++)
+	{
+		if (state->status[i] != DBBUFFER_EMPTY && state->frames[i].level > level)
+			level = state->frames[i].level;
+	}
+
+	/* Levels are stored after ids of first max pages then moved to follow the ids of the listed pages */
+	uint8_t *levels = (uint8_t*) (ids + max);
+	while (1)
+	{
+		for (i=1; i < numFrames && num < max; i++)
+		{
+			if (state->status[i] != DBBUFFER_EMPTY && state->frames[i].level == level)
+			{
+				ids[num] = state->status[i];
+				levels[num++] = level;
+			}
+		}
+		if (level == 0)
+			break;
+		level--;
+	}
+	memmove(ids + num, levels, num);
+	return num;
+}
+
+/**
+@brief     	Reads pages listed after superblock in buffer 0 into buffer. Pages are sorted so that they are read 
+			in one pass and consecutive pages are read in one I/O if the storage supports it.
+@param     	state
+                DBbuffer state structure
+@param     	num
+                Number of pages listed
+@return		Returns number of pages read.
+*/
+static count_t dbbufferWarm(dbbuffer *state, count_t num)
+{
+	id_t *ids = (id_t*) (state->buffer + sizeof(dbsuperblock));
+	uint8_t *levels = (uint8_t*) (ids + num);
+	count_t i, j, numFrames = dbbufferNumFrames(state);
+
+	if (num > numFrames-1)
+		num = numFrames-1;		/* Keep pages at higher levels listed first */
+
+	/* Insertion sort by page id */
+	for (i=1; i < num; i++)
+	{
+		id_t id = ids[i];
+		uint8_t level = levels[i];
+		for (j=i; j > 0 && ids[j-1] > id; j--)
+		{
+			ids[j] = ids[j-1];
+			levels[j] = levels[j-1];
+		}
+		ids[j] = id;
+		levels[j] = level;
+	}
+
+	/* Page i is read into frame i+1 so consecutive pages are read into consecutive frames */
+	for (i=0; i < num; i = j)
+	{
+		void *buf = state->buffer + (i+1)*state->pageSize;
+		int8_t err = 0;
+
+		for (j=i+1; j < num && ids[j] == ids[j-1]+1; j++);
+		if (state->storage->readPages != NULL)
+			err = state->storage->readPages(state->storage, ids[i], j-i, buf);
+		else
+		{
+			for (count_t k=i; k < j && err == 0; k++)
+				err = state->storage->readPage(state->storage, ids[k], buf + (k-i)*state->pageSize);
+		}
+		if (err != 0)
+			return i;
+
+		for (count_t k=i; k < j; k++)
+		{
+			dbbufferSetFrame(state, k+1, ids[k]);
+			dbbufferAccess(state, k+1, levels[k], 1);
+		}
+		state->numReads += j-i;
+	}
+	return num;
+}
+
+/**
+@brief     	Writes superblock to the copy not holding the current superblock and syncs storage.
+@param     	state
+                DBbuffer state structure
+@param     	clean
+                1 if storage is consistent with superblock (written at flush). 0 if storage is about to be modified.
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferWriteSuperblock(dbbuffer *state, uint8_t clean)
+{
+	dbsuperblock *sb = state->superblock;
+
+	sb->id = DBBUFFER_SUPERBLOCK;
+	sb->count = 0;
+	sb->version = DBBUFFER_SUPERBLOCK_VERSION;
+	sb->seq++;
+	sb->clean = clean;
+	sb->numWarm = 0;
+	if (clean)
+	{
+		btreeState *tree = (btreeState*) state->state;
+		sb->levels = tree->levels;
+		sb->keySize = tree->keySize;
+		sb->dataSize = tree->dataSize;
+		sb->root = tree->activePath[0];
+		sb->numNodes = tree->numNodes;
+		sb->nextPageId = state->nextPageId;
+		sb->nextPageWriteId = state->nextPageWriteId;
+		sb->freeHead = state->freeHead;
+		sb->numFree = state->numFree;
+
+		/* Superblock and list of buffered pages are written from buffer 0 */
+		sb->numWarm = dbbufferListWarm(state);
+		memcpy(state->buffer, sb, sizeof(dbsuperblock));
+		sb->checksum = dbbufferChecksum(state->buffer);
+		memcpy(state->buffer, sb, sizeof(dbsuperblock));
+		if (state->storage->writeBytes(state->storage, sb->seq % DBBUFFER_SUPERBLOCK_PAGES, 0, 
+				sizeof(dbsuperblock) + sb->numWarm * DBBUFFER_WARM_ENTRY, state->buffer) != 0)
+			return -1;
+		return state->storage->sync(state->storage);
+	}
+	sb->checksum = dbbufferChecksum(sb);
+
+	if (state->storage->writeBytes(state->storage, sb->seq % DBBUFFER_SUPERBLOCK_PAGES, 0, sizeof(dbsuperblock), sb) != 0)
+		return -1;
+	return state->storage->sync(state->storage);
+}
+
+/**
+@brief     	Marks superblock as not current before storage is first modified after a flush.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferModify(dbbuffer *state)
+{
+	if (state->superblock == NULL || !state->superblock->clean)
+		return 0;
+	return dbbufferWriteSuperblock(state, 0);
+}
+
+/**
+@brief     	Writes empty superblock pages at start of storage.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferFormat(dbbuffer *state)
+{
+	void *buf = initBufferPage(state, 0);
+	for (id_t p=0; p < DBBUFFER_SUPERBLOCK_PAGES; p++)
+	{
+		if (state->storage->writePage(state->storage, p, buf) != 0)
+			return -1;
+	}
+	memset(state->superblock, 0, sizeof(dbsuperblock));
+	return dbbufferWriteSuperblock(state, 0);
+}
+
+/**
+@brief     	Reads current superblock from storage. Superblock page is left in buffer 0.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if superblock found. -1 if storage has no valid superblock.
+*/
+static int8_t dbbufferReadSuperblock(dbbuffer *state)
+{
+	dbsuperblock sb;
+	id_t found = DBBUFFER_EMPTY;
+
+	/* Copy p is read into buffer p */
+	for (id_t p=0; p < DBBUFFER_SUPERBLOCK_PAGES && p < state->nextPageWriteId; p++)
+	{
+		void *buf = state->buffer + p*state->pageSize;
+		if (state->storage->readPage(state->storage, p, buf) != 0)
+			break;
+		state->numReads++;
+		memcpy(&sb, buf, sizeof(dbsuperblock));
+		if (sb.id != DBBUFFER_SUPERBLOCK || sb.version != DBBUFFER_SUPERBLOCK_VERSION 
+				|| sb.numWarm > (state->pageSize - sizeof(dbsuperblock)) / DBBUFFER_WARM_ENTRY || sb.checksum != dbbufferChecksum(buf))
+			continue;
+		if (found == DBBUFFER_EMPTY || sb.seq > state->superblock->seq)
+		{
+			memcpy(state->superblock, &sb, sizeof(dbsuperblock));
+			found = p;
+		}
+	}
+	if (found == DBBUFFER_EMPTY)
+		return -1;
+	if (found != 0)
+		memcpy(state->buffer, state->buffer + found*state->pageSize, state->pageSize);
+	return 0;
+}
+
+/**
+@brief     	Initializes buffer given page size and number of pages.
+@param     	state
+                DBbuffer state structure
+*/
+void dbbufferInit(dbbuffer *state)
+{
+	dbbufferClear(state);
+
+	if (state->superblock != NULL)
+		dbbufferFormat(state);
 }
 
 /**
 @brief     	Initializes buffer and recovers previous state from storage.
+			Storage is scanned from the end for the root unless the superblock is clean.
 @param     	state
                 DBbuffer state structure
 */
-void dbbufferRecover(dbbuffer *state)
+int8_t dbbufferRecover(dbbuffer *state)
 {
-	dbbufferInit(state);
+	id_t firstPage = 0;
+
+	dbbufferClear(state);
 
 	printf("Recovering from storage.\n");	
 	
-	/* Scan file from end to determine the page with root */
-	SD_FILE* fp = state->file;
-      
-	fseek(fp, 0, SEEK_END); 
-
-	uint32_t loc = ftell(fp);
-
 	/* Set next buffer page to write */
-	state->nextPageWriteId = loc / state->pageSize;	
+	state->nextPageWriteId = state->storage->size(state->storage);
 	state->nextPageId = state->nextPageWriteId;
-	
-	for (id_t p = state->nextPageWriteId-1; p >= 0; p--)
+	state->reserveEnd = state->nextPageWriteId;
+
+	if (state->superblock != NULL)
+	{
+		if (dbbufferReadSuperblock(state) == 0)
+		{
+			dbsuperblock *sb = state->superblock;
+			if (sb->clean && sb->nextPageWriteId <= state->nextPageWriteId)
+			{
+				printf("Recovered from superblock. Root at: %lu\n", sb->root);
+				state->activePath[0] = sb->root;
+				state->nextPageId = sb->nextPageId;
+				state->nextPageWriteId = sb->nextPageWriteId;
+				state->freeHead = sb->freeHead;
+				state->numFree = sb->numFree;
+				if (sb->numWarm > 0 && state->storage->mapPage == NULL)
+					printf("Preloaded pages: %d\n", dbbufferWarm(state, sb->numWarm));
+				return 1;
+			}
+			firstPage = DBBUFFER_SUPERBLOCK_PAGES;
+
+			/* Free page list of last sync. Pages taken from it since then are no longer marked free and end the list when writePage reaches them. */
+			if (sb->numFree > 0)
+			{
+				state->freeHead = sb->freeHead;
+				state->numFree = sb->numFree;
+			}
+		}
+		else if (state->nextPageWriteId > 0)
+		{	/* Storage was created without superblock. Its first pages are tree pages. */
+			printf("No superblock in storage.\n");
+			state->superblock = NULL;
+		}
+	}
+
+	/* Scan storage from end to determine the page with root */
+	id_t used = state->nextPageWriteId;
+	for (id_t p = state->nextPageWriteId; p > firstPage; p--)
 	{		
-		void *buf = readPage(state, p);
+		void *buf = readPage(state, p-1);
 		if (buf == NULL)
 			break;
+		if (used == p && BTREE_GET_ID(buf) == 0 && *((count_t*) (buf+BTREE_COUNT_OFFSET)) == 0)
+		{	/* Pages reserved but not written at end of storage are all zeros. Drop buffered copy as page is written directly when reused. */
+			count_t i = dbbufferFindFrame(state, p-1);
+			if (i != 0)
+				dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+			used = p-1;
+			continue;
+		}
 		if (BTREE_IS_ROOT(buf))
 		{
-			printf("Found root at: %lu\n", p);
-			state->activePath[0] = p;
-			return;
+			printf("Found root at: %lu\n", p-1);
+			state->activePath[0] = p-1;
+			if (used < state->nextPageWriteId)
+			{	/* Reuse reserved pages at end of storage */
+				printf("Reserved pages: %lu\n", state->nextPageWriteId - used);
+				state->nextPageWriteId = used;
+				state->nextPageId = used;
+			}
+			if (state->numFree > 0)
+				printf("Free pages: %lu\n", state->numFree);
+			return 0;
 		}
 	}
 
@@ -104,13 +467,63 @@ void dbbufferRecover(dbbuffer *state)
 	/* Otherwise assume no root. Create new file. */
 	state->nextPageId = 0;
 	state->nextPageWriteId = 0;	
+	state->freeHead = DBBUFFER_EMPTY;
+	state->numFree = 0;
+	if (state->superblock != NULL)
+	{
+		state->nextPageId = DBBUFFER_SUPERBLOCK_PAGES;
+		state->nextPageWriteId = DBBUFFER_SUPERBLOCK_PAGES;
+		dbbufferFormat(state);
+	}
 
 	/* Create and write empty root node */	
-	void *buf = initBufferPage(state->buffer, 0);	
+	void *buf = initBufferPage(state, 0);	
 	BTREE_SET_ROOT(buf);		
-	state->activePath[0] = writePage(state->buffer, buf);		/* Store root location */				
+	state->activePath[0] = writePage(state, buf);		/* Store root location */				
+	return 0;
+}
+
+
+/**
+@brief      Returns location of page in append staging area or NULL if page is not staged.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns pointer to staged page or NULL.
+*/
+static void* dbbufferStagedPage(dbbuffer *state, id_t pageNum)
+{
+	if (state->numAppend == 0 || pageNum < state->appendStart || pageNum >= state->appendStart + state->numAppend)
+		return NULL;
+	return state->appendBuffer + (pageNum - state->appendStart)*state->pageSize;
 }
 
+/**
+@brief      Writes pages in append staging area to storage as one contiguous write.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferWriteAppend(dbbuffer *state)
+{
+	int8_t err = 0;
+
+	if (state->numAppend == 0)
+		return 0;
+
+	if (state->storage->writePages != NULL)
+		err = state->storage->writePages(state->storage, state->appendStart, state->numAppend, state->appendBuffer);
+	else
+	{
+		for (count_t i=0; i < state->numAppend && err == 0; i++)
+			err = state->storage->writePage(state->storage, state->appendStart+i, state->appendBuffer + i*state->pageSize);
+	}
+	if (err != 0)
+		return -1;
+	state->numAppend = 0;
+	return 0;
+}
 
 /**
 @brief      Reads page to a particular buffer number. Returns pointer to buffer if success.
@@ -125,13 +538,17 @@ void dbbufferRecover(dbbuffer *state)
 void* readPageBufferInternal(dbbuffer *state, id_t pageNum, count_t bufferNum)
 {
 	void *buf = state->buffer + bufferNum * state->pageSize;		
-	SD_FILE* fp = state->file;
-  
-    /* Seek to page location in file */
-    fseek(fp, pageNum*state->pageSize, SEEK_SET);
+	void *staged = dbbufferStagedPage(state, pageNum);
 
-    /* Read page into start of buffer 1 */   
-    if (0 ==  fread(buf, state->pageSize, 1, fp))
+	if (staged != NULL)
+	{	/* Page not written to storage yet */
+		memcpy(buf, staged, state->pageSize);
+		state->bufferHits++;
+		return buf;
+	}
+  
+    /* Read page into buffer */   
+    if (state->storage->readPage(state->storage, pageNum, buf) != 0)
     	return NULL;       
     
     state->numReads++;
@@ -140,120 +557,816 @@ void* readPageBufferInternal(dbbuffer *state, id_t pageNum, count_t bufferNum)
 }
 
 /**
-@brief      Reads page to a particular buffer number. Returns pointer to buffer if success.
+@brief      Returns start position in hash table for page.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns hash table slot.
+*/
+static count_t dbbufferHash(dbbuffer *state, id_t pageNum)
+{
+	uint32_t h = pageNum;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h & (state->hashSize-1);
+}
+
+/**
+@brief      Returns buffer frame containing page or 0 if page is not in buffer.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns buffer frame or 0 if not found.
+*/
+static count_t dbbufferFindFrame(dbbuffer *state, id_t pageNum)
+{
+	if (state->hashTable == NULL)
+	{	/* Small buffer. Scan status. */
+		for (count_t i=1; i < state->numPages; i++)
+		{
+			if (state->status[i] == pageNum)
+				return i;
+		}
+		return 0;
+	}
+
+	/* Linear probe until empty slot. Frame 0 is never buffered so marks empty slot. */
+	for (count_t h = dbbufferHash(state, pageNum); state->hashTable[h] != 0; h = (h+1) & (state->hashSize-1))
+	{
+		if (state->status[state->hashTable[h]] == pageNum)
+			return state->hashTable[h];
+	}
+	return 0;
+}
+
+/**
+@brief      Changes the page stored in a buffer frame and updates hash table.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame
+@param     	pageNum
+                Physical page id (number) or DBBUFFER_EMPTY
+*/
+static void dbbufferSetFrame(dbbuffer *state, count_t frame, id_t pageNum)
+{
+	if (state->hashTable != NULL && state->status[frame] != DBBUFFER_EMPTY)
+	{	/* Remove frame from hash table */
+		count_t mask = state->hashSize-1;
+		count_t h = dbbufferHash(state, state->status[frame]);
+		while (state->hashTable[h] != frame)
+			h = (h+1) & mask;
+
+		/* Shift back entries in probe sequence so there are no gaps */
+		count_t j = h;
+		while (1)
+		{
+			j = (j+1) & mask;
+			if (state->hashTable[j] == 0)
+				break;
+			count_t k = dbbufferHash(state, state->status[state->hashTable[j]]);
+			/* Move entry if its home slot is not cyclically in (h, j] */
+			if ((j > h && (k <= h || k > j)) || (j < h && (k <= h && k > j)))
+			{
+				state->hashTable[h] = state->hashTable[j];
+				h = j;
+			}
+		}
+		state->hashTable[h] = 0;
+	}
+
+	state->status[frame] = pageNum;
+
+	if (state->hashTable != NULL && pageNum != DBBUFFER_EMPTY)
+	{
+		count_t h = dbbufferHash(state, pageNum);
+		while (state->hashTable[h] != 0)
+			h = (h+1) & (state->hashSize-1);
+		state->hashTable[h] = frame;
+	}
+}
+
+/**
+@brief      Writes buffer frame to storage if it is dirty.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferWriteBack(dbbuffer *state, count_t frame)
+{
+	if (!(state->frames[frame].flags & DBBUFFER_DIRTY))
+		return 0;
+
+	if (state->storage->writePage(state->storage, state->status[frame], state->buffer + frame*state->pageSize) != 0)
+		return -1;
+
+	state->frames[frame].flags &= ~DBBUFFER_DIRTY;
+	state->numDirty--;
+	state->numOverWrites++;
+	return 0;
+}
+
+/**
+@brief      Records an access to a buffer frame for the replacement policy.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN
+@param     	loaded
+                1 if page was just loaded into frame, 0 if buffer hit
+*/
+static void dbbufferAccess(dbbuffer *state, count_t frame, uint8_t level, int8_t loaded)
+{
+	dbframe *f = &state->frames[frame];
+
+	if (loaded)
+	{	/* New page starts in probationary queue for 2Q */
+		f->flags &= ~DBBUFFER_HOT;
+		f->level = level == DBBUFFER_LEVEL_UNKNOWN ? 0 : level;
+		f->lastUse = ++state->accessCount;
+	}
+	else
+	{
+		if (level != DBBUFFER_LEVEL_UNKNOWN)
+			f->level = level;
+		if (state->policy == DBBUFFER_POLICY_2Q)
+			f->flags |= DBBUFFER_HOT;		/* Re-referenced so promote to hot queue */
+		f->lastUse = ++state->accessCount;
+	}
+	f->flags |= DBBUFFER_REF;
+}
+
+/**
+@brief      Selects victim frame using CLOCK, LRU, or 2Q replacement policy.
+			Only frames holding pages at the lowest tree level are considered so that upper levels stay buffered.
+@param     	state
+                DBbuffer state structure
+@return		Returns buffer frame or 0 if all frames are pinned.
+*/
+static count_t dbbufferChooseVictim(dbbuffer *state)
+{
+	/* Frames reserved for scans and read-ahead are not used for other pages */
+	count_t numFrames = dbbufferNumFrames(state);
+	count_t i, victim = 0, numProbation = 0;
+	uint8_t minLevel = 0xFF;
+
+	for (i=1; i < numFrames; i++)
+	{
+		if (state->frames[i].pin > 0)
+			continue;
+		if (state->status[i] == DBBUFFER_EMPTY)
+			return i;
+		if (state->frames[i].level < minLevel)
+			minLevel = state->frames[i].level;
+		if (!(state->frames[i].flags & DBBUFFER_HOT))
+			numProbation++;
+	}
+
+	if (minLevel == 0xFF)
+		return 0;			/* All frames pinned */
+
+	if (state->policy == DBBUFFER_POLICY_CLOCK)
+	{	/* Advance hand clearing reference bits until find an unreferenced frame. Stops within two passes. */
+		i = state->nextBufferPage;
+		while (1)
+		{
+			if (i >= numFrames || i == 0)
+				i = 1;
+			if (state->frames[i].level == minLevel && state->frames[i].pin == 0)
+			{
+				if (!(state->frames[i].flags & DBBUFFER_REF))
+					break;
+				state->frames[i].flags &= ~DBBUFFER_REF;
+			}
+			i++;
+		}
+		state->nextBufferPage = i+1;
+		return i;
+	}
+
+	/* 2Q: Evict oldest probationary page if probationary queue is over its share (1/4 of buffer). Otherwise least recently used hot page. */
+	int8_t hot = 0;
+	if (state->policy == DBBUFFER_POLICY_2Q && numProbation <= (numFrames-1)/4)
+		hot = 1;
+
+	for (i=1; i < numFrames; i++)
+	{
+		if (state->frames[i].level != minLevel || state->frames[i].pin > 0)
+			continue;
+		if (state->policy == DBBUFFER_POLICY_2Q && victim != 0)
+		{	/* Prefer frames in the queue being evicted from */
+			int8_t inQueue = (state->frames[i].flags & DBBUFFER_HOT) ? hot : !hot;
+			int8_t victimInQueue = (state->frames[victim].flags & DBBUFFER_HOT) ? hot : !hot;
+			if (inQueue != victimInQueue)
+			{
+				if (inQueue)
+					victim = i;
+				continue;
+			}
+		}
+		if (victim == 0 || state->frames[i].lastUse < state->frames[victim].lastUse)
+			victim = i;
+	}
+	return victim;
+}
+
+/**
+@brief      Selects buffer frame to store a page that is not currently in buffer.
+			Any dirty page in the frame is written back first.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns buffer frame or 0 if frame could not be made available.
+*/
+static count_t dbbufferChooseFrame(dbbuffer *state, id_t pageNum)
+{
+	/* Frames reserved for scans and read-ahead are not used for other pages */
+	count_t numFrames = dbbufferNumFrames(state);
+	count_t i;
+
+	if (state->policy != DBBUFFER_POLICY_ROUNDROBIN)
+	{
+		i = dbbufferChooseVictim(state);
+	}
+	else if (numFrames == 2)
+	{	
+		i = 1;
+	}
+	else
+	{	
+		/* Reserve page #1 for root if have at least 3 buffers. */
+		if (state->activePath[0] == pageNum)
+		{	/* Request for root. */			
+			i = 1;
+		}
+		else
+		{
+			if (numFrames == 3)
+			{	/* With 3 pages and not the root, always reusing the 3rd buffer for reading. */
+				i = 2;
+			}
+			else
+			{
+				/* More than minimum pages. Some basic memory management using round robin buffer. */		
+				/* Determine buffer location for page */
+				for (i=2; i < numFrames; i++)
+				{
+					if (state->status[i] == DBBUFFER_EMPTY)	/* Empty page */
+						break;
+				}
+
+				/* Pick the next page */
+				if (i == numFrames)
+				{
+					i = state->nextBufferPage;
+					state->nextBufferPage++;
+					while (1)
+					{
+						if (i > numFrames-1)
+						{	i = 2;
+							state->nextBufferPage = 2;
+						}
+
+						if (state->status[i] != state->lastHit)						
+							break;					
+
+						i++;
+					}		
+				}
+			}
+		}
+	}
+
+	if (i != 0 && state->frames[i].pin > 0)
+	{	/* Frame is pinned. Use first unpinned frame. */
+		for (i=1; i < numFrames && state->frames[i].pin > 0; i++);
+		if (i == numFrames)
+			return 0;
+	}
+
+	if (i == 0 || dbbufferWriteBack(state, i) != 0)
+		return 0;
+	return i;
+}
+
+/**
+@brief      Returns 1 if page is buffered or memory-mapped or there is an unpinned frame to read it into. Returns 0 otherwise.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+*/
+static int8_t dbbufferCanFetch(dbbuffer *state, id_t pageNum)
+{
+	count_t i, numFrames = dbbufferNumFrames(state);
+
+	if (state->storage->mapPage != NULL || dbbufferFindFrame(state, pageNum) != 0)
+		return 1;
+	for (i=1; i < numFrames && state->frames[i].pin > 0; i++);
+	return i < numFrames;
+}
+
+/**
+@brief      Returns buffer frame holding page, reading page from storage into a frame if not buffered.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN
+@return		Returns buffer frame or 0 if error.
+*/
+static count_t dbbufferFetch(dbbuffer *state, id_t pageNum, uint8_t level)
+{
+	/* Check to see if page is currently in buffer */
+	count_t i = dbbufferFindFrame(state, pageNum);
+	if (i != 0)
+	{
+		state->bufferHits++;
+		state->lastHit = state->status[i];			
+		dbbufferAccess(state, i, level, 0);
+		return i;
+	}
+
+	i = dbbufferChooseFrame(state, pageNum);
+	if (i == 0)
+		return 0;
+	    
+	dbbufferSetFrame(state, i, pageNum);
+	if (readPageBufferInternal(state, pageNum, i) == NULL)
+	{
+		dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+		return 0;
+	}
+	dbbufferAccess(state, i, level, 1);
+	return i;
+}
+
+/**
+@brief      Reads page to a particular buffer number. Returns pointer to buffer if success.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param		bufferNum
+				Buffer to read into
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* readPageBuffer(dbbuffer *state, id_t pageNum, count_t bufferNum)
+{
+	/* Check to see if page is currently in buffer */
+	count_t i = dbbufferFindFrame(state, pageNum);
+	if (i != 0)
+	{
+		state->bufferHits++;
+		void* buf = state->buffer + state->pageSize*i;
+		state->lastHit = state->status[i];
+		dbbufferAccess(state, i, DBBUFFER_LEVEL_UNKNOWN, 0);
+		if (i != bufferNum)
+		{	memcpy(state->buffer + bufferNum*state->pageSize, buf, state->pageSize);
+			return state->buffer + bufferNum*state->pageSize;
+		}
+		return buf;
+	}
+
+	if (bufferNum != 0)
+	{	/* Frame no longer holds its buffered page */
+		if (state->frames[bufferNum].pin > 0)
+			return NULL;
+		if (dbbufferWriteBack(state, bufferNum) != 0)
+			return NULL;
+		dbbufferSetFrame(state, bufferNum, DBBUFFER_EMPTY);
+	}
+	return readPageBufferInternal(state, pageNum, bufferNum);	
+}
+
+
+/**
+@brief      Reads page either from buffer or from storage. Returns pointer to buffer if success.
+			If storage is memory-mapped, returns pointer into the mapping. Page must not be modified through this pointer.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+				Used by replacement policy to keep upper levels buffered.
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* readPageLevel(dbbuffer *state, id_t pageNum, uint8_t level)
+{    
+	/* Memory-mapped storage returns the page without copying into buffer */
+	if (state->storage->mapPage != NULL)
+	{
+		void *buf = state->storage->mapPage(state->storage, pageNum);
+		if (buf != NULL)
+		{
+			state->numReads++;
+			return buf;
+		}
+	}
+
+	count_t i = dbbufferFetch(state, pageNum, level);
+	if (i == 0)
+		return NULL;
+	return state->buffer + state->pageSize*i;
+}
+
+/**
+@brief      Reads page into a buffer frame and pins it so that it is not evicted until unpinned.
+			Page may be modified in place through the returned pointer and written using overWritePage.
+			Memory-mapped storage is read into a buffer frame so the mapping is not modified directly.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+@return		Returns pointer to buffer page or NULL if error or all frames are pinned.
+*/
+void* dbbufferPin(dbbuffer *state, id_t pageNum, uint8_t level)
+{
+	count_t i = dbbufferFetch(state, pageNum, level);
+	if (i == 0)
+		return NULL;
+	state->frames[i].pin++;
+	return state->buffer + state->pageSize*i;
+}
+
+/**
+@brief      Reads page for a sequential scan. Returns pointer to buffer if success.
+			Scanned pages are read into the frames reserved for scans so they do not replace pages used by lookups.
+			Page stays buffered until numScan more pages are read by scans. Without scan frames, page is placed
+			at the cold end of the replacement order so it is replaced before other pages.
+			A buffer hit does not count as a use of the page by the replacement policy.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* dbbufferReadScan(dbbuffer *state, id_t pageNum)
+{
+	count_t i;
+
+	if (state->storage->mapPage != NULL)
+		return readPage(state, pageNum);
+
+	i = dbbufferFindFrame(state, pageNum);
+	if (i != 0)
+	{
+		state->bufferHits++;
+		state->lastHit = pageNum;
+		return state->buffer + state->pageSize*i;
+	}
+
+	if (state->numScan == 0)
+	{	/* Read into frame chosen by replacement policy then make it next to be replaced */
+		i = dbbufferFetch(state, pageNum, 0);
+		if (i == 0)
+			return NULL;
+		state->frames[i].flags &= ~(DBBUFFER_REF | DBBUFFER_HOT);
+		state->frames[i].lastUse = 0;
+		if (state->policy == DBBUFFER_POLICY_CLOCK || (state->policy == DBBUFFER_POLICY_ROUNDROBIN && i >= 2))
+			state->nextBufferPage = i;		/* Hand points to page */
+		return state->buffer + state->pageSize*i;
+	}
+
+	/* Next unpinned frame in scan ring */
+	count_t start = dbbufferNumFrames(state), end = start + state->numScan;
+	for (count_t n=0; n < state->numScan; n++)
+	{
+		i = state->nextScan;
+		if (i < start || i >= end)
+			i = start;
+		state->nextScan = i+1;
+		if (state->frames[i].pin == 0)
+			break;
+	}
+	if (state->frames[i].pin > 0)
+		return readPageLevel(state, pageNum, 0);
+	if (dbbufferWriteBack(state, i) != 0)
+		return NULL;
+
+	dbbufferSetFrame(state, i, pageNum);
+	if (readPageBufferInternal(state, pageNum, i) == NULL)
+	{
+		dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+		return NULL;
+	}
+	dbbufferAccess(state, i, 0, 1);
+	return state->buffer + state->pageSize*i;
+}
+
+/**
+@brief      Releases a pin on a buffered page.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns 0 if success. -1 if page is not pinned.
+*/
+int8_t dbbufferUnpin(dbbuffer *state, id_t pageNum)
+{
+	count_t i = dbbufferFindFrame(state, pageNum);
+	if (i == 0 || state->frames[i].pin == 0)
+		return -1;
+	state->frames[i].pin--;
+	return 0;
+}
+
+/**
+@brief      Takes a buffer frame out of use for buffering pages so the caller can build a page in it.
+			Any dirty page in the frame is written back. Frame is emptied, zeroed, and pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame (1 to numPages-1)
+@return		Returns pointer to frame or NULL if frame is pinned or write fails.
+*/
+void* dbbufferTakeFrame(dbbuffer *state, count_t frame)
+{
+	if (frame == 0 || frame >= state->numPages || state->frames[frame].pin > 0)
+		return NULL;
+	if (dbbufferWriteBack(state, frame) != 0)
+		return NULL;
+
+	dbbufferSetFrame(state, frame, DBBUFFER_EMPTY);
+	state->frames[frame].pin++;
+	return initBufferPage(state, frame);
+}
+
+/**
+@brief      Takes the buffer frame chosen by the replacement policy out of use for buffering pages so the caller 
+			can build a page in it. Frame is emptied, zeroed, and pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Returns buffer frame taken
+@return		Returns pointer to frame or NULL if all frames are pinned or write fails.
+*/
+void* dbbufferTakeAnyFrame(dbbuffer *state, count_t *frame)
+{
+	*frame = dbbufferChooseFrame(state, DBBUFFER_EMPTY);
+	if (*frame == 0)
+		return NULL;
+	return dbbufferTakeFrame(state, *frame);
+}
+
+/**
+@brief      Takes the frame holding a pinned page out of use for buffering pages so the caller can build another page 
+			in it from the page contents. Page is written back if dirty and is no longer buffered. Frame contents are kept
+			and frame stays pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number) of pinned page
+@return		Returns buffer frame or 0 if page is not pinned or write fails.
+*/
+count_t dbbufferTakePage(dbbuffer *state, id_t pageNum)
+{
+	count_t i = dbbufferFindFrame(state, pageNum);
+	if (i == 0 || state->frames[i].pin == 0 || dbbufferWriteBack(state, i) != 0)
+		return 0;
+	dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+	return i;
+}
+
+/**
+@brief      Returns a frame taken by dbbufferTakeFrame, dbbufferTakeAnyFrame, or dbbufferTakePage to use for buffering pages.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame
+*/
+void dbbufferReleaseFrame(dbbuffer *state, count_t frame)
+{
+	if (state->frames[frame].pin > 0)
+		state->frames[frame].pin--;
+}
+
+/**
+@brief      Reads page either from buffer or from storage. Returns pointer to buffer if success.
+			If storage is memory-mapped, returns pointer into the mapping. Page must not be modified through this pointer.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* readPage(dbbuffer *state, id_t pageNum)
+{
+	return readPageLevel(state, pageNum, DBBUFFER_LEVEL_UNKNOWN);
+}
+
+
+
+/**
+@brief      Reads a run of consecutive pages into consecutive read-ahead frames with one I/O if storage supports it.
 @param     	state
                 DBbuffer state structure
 @param     	pageNum
-                Physical page id (number)
-@param		bufferNum
-				Buffer to read into
-@return		Returns pointer to buffer page or NULL if error.
+                Physical page id of first page in run
+@param     	start
+                First frame of run. Frames are already assigned to the pages.
+@param     	num
+                Number of pages in run
+@return		Returns 0 if success and -1 if error.
 */
-void* readPageBuffer(dbbuffer *state, id_t pageNum, count_t bufferNum)
+static int8_t dbbufferPrefetchRun(dbbuffer *state, id_t pageNum, count_t start, count_t num)
 {
-	/* Check to see if page is currently in buffer */
-	for (count_t i=1; i < state->numPages; i++)
+	void *buf = state->buffer + start*state->pageSize;
+	count_t j;
+	int8_t err;
+
+	if (state->storage->readPages != NULL)
+		err = state->storage->readPages(state->storage, pageNum, num, buf);
+	else
+	{	
+		for (j=0, err=0; j < num && err == 0; j++)
+			err = state->storage->readPage(state->storage, pageNum+j, buf + j*state->pageSize);
+	}
+	for (j=0; j < num; j++)
 	{
-		if (state->status[i] == pageNum && pageNum != 0)
-		{
-			state->bufferHits++;
-			void* buf = state->buffer + state->pageSize*i;
-			state->lastHit = state->status[i];
-			if (i != bufferNum)
-			{	memcpy(state->buffer + bufferNum*state->pageSize, buf, state->pageSize);
-				return state->buffer + bufferNum*state->pageSize;
-			}
-			return buf;
-		}
+		if (err != 0)
+			dbbufferSetFrame(state, start+j, DBBUFFER_EMPTY);
+		else
+			dbbufferAccess(state, start+j, 0, 1);
 	}
-	return readPageBufferInternal(state, pageNum, bufferNum);	
+	if (err != 0)
+		return -1;
+	state->numReads += num;
+	return 0;
 }
 
-
 /**
-@brief      Reads page either from buffer or from storage. Returns pointer to buffer if success.
+@brief      Reads pages ahead into the frames reserved for read-ahead. Pages that are consecutive on storage
+			are read in one I/O if the storage supports it. Nothing is read if the first page is already buffered
+			as it was read ahead by a previous call and its frames are not yet used.
 @param     	state
                 DBbuffer state structure
-@param     	pageNum
-                Physical page id (number)
-@return		Returns pointer to buffer page or NULL if error.
+@param     	pageNums
+                Physical page ids in the order they will be read
+@param     	num
+                Number of pages. At most numPrefetch pages are read.
+@return		Returns number of pages read or -1 if error.
 */
-void* readPage(dbbuffer *state, id_t pageNum)
-{    
-	void *buf;
-	count_t i;	
+int16_t dbbufferPrefetch(dbbuffer *state, id_t *pageNums, count_t num)
+{
+	count_t i, frame = 0, start = 0, runStart = 0, runLength = 0;
+	int16_t numRead = 0;
 
-	/* Check to see if page is currently in buffer */
-	for (i=1; i < state->numPages; i++)
-	{
-		if (state->status[i] == pageNum && pageNum != 0)
+	/* No read-ahead if disabled, storage is memory-mapped, or first page was read ahead by previous call */
+	if (state->numPrefetch == 0 || state->storage->mapPage != NULL || num == 0 || dbbufferFindFrame(state, pageNums[0]) != 0)
+		return 0;
+
+	if (num > state->numPrefetch)
+		num = state->numPrefetch;
+
+	for (i=0; i < num; i++)
+	{	
+		if (dbbufferFindFrame(state, pageNums[i]) != 0 || dbbufferStagedPage(state, pageNums[i]) != NULL)
+			continue;		/* Already buffered or staged to be written */
+
+		/* Next read-ahead frame in ring */
+		frame = state->nextPrefetch;
+		if (frame >= state->numPages || frame < state->numPages - state->numPrefetch)
+			frame = state->numPages - state->numPrefetch;
+		
+		if (state->frames[frame].pin > 0)
+			break;			/* Stop at pinned frame */
+
+		if (runLength > 0 && (pageNums[i] != pageNums[runStart] + runLength || frame != start + runLength))
+		{	/* Page or frame does not follow last page of run. Read current run and start new run. */
+			if (dbbufferPrefetchRun(state, pageNums[runStart], start, runLength) != 0)
+				return -1;
+			numRead += runLength;
+			runLength = 0;
+		}
+		if (runLength == 0)
 		{
-			state->bufferHits++;
-			buf = state->buffer + state->pageSize*i;
-			state->lastHit = state->status[i];			
-			return buf;
+			start = frame;
+			runStart = i;
 		}
+
+		if (dbbufferWriteBack(state, frame) != 0)
+			return -1;
+		dbbufferSetFrame(state, frame, pageNums[i]);
+		state->nextPrefetch = frame+1;
+		runLength++;
 	}
 
-	if (state->numPages == 2)
-	{	buf = state->buffer + state->pageSize;
-		i = 1;
+	if (runLength > 0)
+	{
+		if (dbbufferPrefetchRun(state, pageNums[runStart], start, runLength) != 0)
+			return -1;
+		numRead += runLength;
 	}
-	else
-	{	
-		/* Reserve page #1 for root if have at least 3 buffers. */
-		if (state->activePath[0] == pageNum)
-		{	/* Request for root. */			
-			i = 1;
-		}
-		else
+	return numRead;
+}
+
+/**
+@brief      Reads pages into buffer with one batch of I/O. Pages are read for entries from the start of the list
+			until the buffer has no unpinned frame left. All pages of the processed entries remain buffered
+			until the next page is read or written. The batch is built in buffer 0.
+@param     	state
+                DBbuffer state structure
+@param     	pageNums
+                Physical page ids. Entries that are DBBUFFER_EMPTY are skipped. May contain duplicates.
+@param     	num
+                Number of entries
+@param     	level
+                Tree level of pages counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+@return		Returns number of entries processed or -1 if error.
+*/
+int32_t dbbufferReadBatch(dbbuffer *state, id_t *pageNums, count_t num, uint8_t level)
+{
+	/* Pages and frames to read are listed in buffer 0 */
+	count_t maxBatch = state->pageSize / (sizeof(id_t) + sizeof(count_t));
+	id_t *batchPages = (id_t*) state->buffer;
+	count_t *batchFrames = (count_t*) (state->buffer + maxBatch*sizeof(id_t));
+	count_t i, j, n = 0, frame;
+	int8_t err = 0;
+
+	/* Memory-mapped pages are always available */
+	if (state->storage->mapPage != NULL)
+		return num;
+
+	/* Pin frame of each page so no page of the batch is replaced by another */
+	for (i=0; i < num; i++)
+	{
+		if (pageNums[i] == DBBUFFER_EMPTY)
+			continue;
+
+		frame = dbbufferFindFrame(state, pageNums[i]);
+		if (frame == 0)
 		{
-			if (state->numPages == 3)
-			{	/* With 3 pages and not the root, always reusing the 3rd buffer for reading. */
-				buf = state->buffer + state->pageSize*2;
-				i = 2;
+			if (n == maxBatch)
+				break;
+			frame = dbbufferChooseFrame(state, pageNums[i]);
+			if (frame == 0)
+				break;		/* All frames pinned */
+			dbbufferSetFrame(state, frame, pageNums[i]);
+
+			void *staged = dbbufferStagedPage(state, pageNums[i]);
+			if (staged != NULL)
+			{	/* Page not written to storage yet */
+				memcpy(state->buffer + frame*state->pageSize, staged, state->pageSize);
+				dbbufferAccess(state, frame, level, 1);
 			}
 			else
 			{
-				/* More than minimum pages. Some basic memory management using round robin buffer. */		
-				buf = NULL;
-				/* Determine buffer location for page */
-				/* TODO: This needs to be improved and may also consider locking pages */
-				for (i=2; i < state->numPages; i++)
-				{
-					if (state->status[i] == 0)	/* Empty page */
-					{	buf = state->buffer + state->pageSize*i;			
-						break;
-					}
-				}
+				batchPages[n] = pageNums[i];
+				batchFrames[n++] = frame;
+			}
+		}
 
-				/* Pick the next page */
-				if (buf == NULL)
-				{
-					i = state->nextBufferPage;
-					state->nextBufferPage++;
-					while (1)
-					{
-						if (i > state->numPages-1)
-						{	i = 2;
-							state->nextBufferPage = 2;
-						}
+		if (!(state->frames[frame].flags & DBBUFFER_BATCH))
+		{
+			state->frames[frame].flags |= DBBUFFER_BATCH;
+			state->frames[frame].pin++;
+		}
+	}
 
-						if (state->status[i] != state->lastHit)						
-							break;					
+	if (n > 0)
+	{
+		if (state->storage->readPageBatch != NULL)
+			err = state->storage->readPageBatch(state->storage, batchPages, batchFrames, n, state->buffer);
+		else
+		{
+			for (j=0; j < n && err == 0; j++)
+				err = state->storage->readPage(state->storage, batchPages[j], state->buffer + batchFrames[j]*state->pageSize);
+		}
 
-						i++;
-					}		
-				}
-			}
+		for (j=0; j < n; j++)
+		{
+			if (err != 0)
+				dbbufferSetFrame(state, batchFrames[j], DBBUFFER_EMPTY);
+			else
+				dbbufferAccess(state, batchFrames[j], level, 1);
 		}
+		if (err == 0)
+			state->numReads += n;
 	}
-	    
-	state->status[i] = pageNum;
-	return readPageBufferInternal(state, pageNum, i);
-}
-
 
+	for (j=1; j < state->numPages; j++)
+	{
+		if (state->frames[j].flags & DBBUFFER_BATCH)
+		{
+			state->frames[j].flags &= ~DBBUFFER_BATCH;
+			state->frames[j].pin--;
+		}
+	}
+	return err != 0 ? -1 : i;
+}
 
 /**
 @brief      Writes page to storage. Returns physical page id if success. -1 if failure.
@@ -268,10 +1381,18 @@ void* readPage(dbbuffer *state, id_t pageNum)
 */
 int32_t writeBytes(dbbuffer *state, void* buffer, count_t size, int32_t pageNum, int32_t offset)
 {			
-	/* Seek to page location in file */
-    fseek(state->file, pageNum*state->pageSize+offset, SEEK_SET);
+	if (dbbufferModify(state) != 0)
+		return -1;
+
+	void *staged = dbbufferStagedPage(state, pageNum);
+	if (staged != NULL)
+	{
+		memcpy(staged + offset, buffer, size);
+		return pageNum;
+	}
 
-	fwrite(buffer, size, 1, state->file);
+	if (state->storage->writeBytes(state->storage, pageNum, offset, size, buffer) != 0)
+		return -1;
 	#ifdef DEBUG_WRITE
             printf("Wrote block. Idx: %d Cnt: %d\n", *((int32_t*) buffer), SBTREE_GET_COUNT(state->buffer));
 			printf("BM: "BYTE_TO_BINARY_PATTERN"\n", BYTE_TO_BINARY( *((uint8_t*) (state->buffer+state->bmOffset))));
@@ -299,14 +1420,15 @@ int32_t writeBytes(dbbuffer *state, void* buffer, count_t size, int32_t pageNum,
 */
 int32_t writePageDirect(dbbuffer *state, void* buffer, int32_t pageNum)
 {
+	if (dbbufferModify(state) != 0)
+		return -1;
+
 	/* Setup page number in header */	
 	memcpy(buffer, &(state->nextPageId), sizeof(id_t));
 	state->nextPageId++;
 		
-	/* Seek to page location in file */
-    fseek(state->file, pageNum*state->pageSize, SEEK_SET);
-
-	fwrite(buffer, state->pageSize, 1, state->file);
+	if (state->storage->writePage(state->storage, pageNum, buffer) != 0)
+		return -1;
 	#ifdef DEBUG_WRITE
             printf("Wrote block. Idx: %d Cnt: %d\n", *((int32_t*) buffer), SBTREE_GET_COUNT(state->buffer));
 			printf("BM: "BYTE_TO_BINARY_PATTERN"\n", BYTE_TO_BINARY( *((uint8_t*) (state->buffer+state->bmOffset))));
@@ -323,9 +1445,44 @@ int32_t writePageDirect(dbbuffer *state, void* buffer, int32_t pageNum)
 	return pageNum;
 }
 
+/**
+@brief      Selects dirty frame to write back when there are more than maxDirty dirty pages. 
+			The frame the replacement policy would evict first is chosen: the first unreferenced frame 
+			from the clock hand for CLOCK and the least recently used frame otherwise. Pinned frames are skipped.
+@param     	state
+                DBbuffer state structure
+@param     	skip
+                Frame not to choose (page just modified)
+@return		Returns buffer frame or 0 if every other dirty frame is pinned.
+*/
+static count_t dbbufferChooseDirty(dbbuffer *state, count_t skip)
+{
+	count_t i, j, victim = 0;
+
+	for (j=0; j < state->numPages-1; j++)
+	{
+		i = j+1;
+		if (state->policy == DBBUFFER_POLICY_CLOCK)
+			i = (state->nextBufferPage-1 + j) % (state->numPages-1) + 1;		/* Clock order starting at hand */
+		if (i == skip || !(state->frames[i].flags & DBBUFFER_DIRTY) || state->frames[i].pin > 0)
+			continue;
+		if (state->policy == DBBUFFER_POLICY_CLOCK)
+		{
+			if (!(state->frames[i].flags & DBBUFFER_REF))
+				return i;
+			if (victim == 0)
+				victim = i;
+		}
+		else if (victim == 0 || state->frames[i].lastUse < state->frames[victim].lastUse)
+			victim = i;
+	}
+	return victim;
+}
+
 /**
 @brief      Overwrites page to storage at same physical address. -1 if failure.
 			Caller is responsible for knowing that overwrite is possible given page contents.
+			If maxDirty is not 0, page is kept dirty in buffer and written on eviction or flush.
 @param     	state
                 DBbuffer state structure
 @param     	buffer
@@ -334,11 +1491,29 @@ int32_t writePageDirect(dbbuffer *state, void* buffer, int32_t pageNum)
 */
 int32_t overWritePage(dbbuffer *state, void* buffer, int32_t pageNum)
 {			
-	/* Seek to page location in file */
-    fseek(state->file, pageNum*state->pageSize, SEEK_SET);
+	if (dbbufferModify(state) != 0)
+		return -1;
 
-	fwrite(buffer, state->pageSize, 1, state->file);
-	#ifdef DEBUG_WRITE
+	/* Check if buffer contains this page */
+	count_t i = dbbufferFindFrame(state, pageNum);
+
+	void *staged = dbbufferStagedPage(state, pageNum);
+	if (staged != NULL)
+	{	/* Page not written to storage yet. Update staged copy. */
+		memcpy(staged, buffer, state->pageSize);
+		if (i != 0 && state->buffer + i*state->pageSize != buffer)
+			memcpy(state->buffer + i*state->pageSize, buffer, state->pageSize);
+		state->numOverWrites++;
+		return pageNum;
+	}
+
+	/* Write-through if write-back disabled or the minimum two buffers leave no spare frame to hold dirty pages. 
+	   Memory-mapped reads do not use buffer so must see every write. */
+	if (state->maxDirty == 0 || state->numPages < 3 || state->storage->mapPage != NULL)
+	{
+		if (state->storage->writePage(state->storage, pageNum, buffer) != 0)
+			return -1;
+		#ifdef DEBUG_WRITE
             printf("Wrote block. Idx: %d Cnt: %d\n", *((int32_t*) buffer), SBTREE_GET_COUNT(state->buffer));
 			printf("BM: "BYTE_TO_BINARY_PATTERN"\n", BYTE_TO_BINARY( *((uint8_t*) (state->buffer+state->bmOffset))));
             for (int k = 0; k < SBTREE_GET_COUNT(buffer); k++)
@@ -346,22 +1521,43 @@ int32_t overWritePage(dbbuffer *state, void* buffer, int32_t pageNum)
                 test_record_t *buf = (void *)(buffer + state->headerSize + k * state->recordSize);
                 printf("%d: Output Record: %d\n", k, buf->key);
             }
-	#endif
+		#endif
 
-	state->numOverWrites++;		
+		state->numOverWrites++;		
 	
-	/* Check if buffer contains this page */
-	for (count_t i=1; i < state->numPages; i++)
-	{				
-		if (state->status[i] == pageNum && pageNum != 0)
+		if (i != 0 && state->buffer + i*state->pageSize != buffer)
 		{	/* Copy over page */
-			if (state->buffer + i*state->pageSize == buffer)
-				break;
-			
 			memcpy(state->buffer + i*state->pageSize, buffer, state->pageSize);
-			/* Other choice is to clear the buffer: state->status[i] = 0; */
-			break;
+			/* Other choice is to clear the buffer: dbbufferSetFrame(state, i, DBBUFFER_EMPTY); */
 		}
+		return pageNum;
+	}
+
+	/* Write-back. Page is kept in buffer and written to storage on eviction or flush. */
+	if (i == 0)
+	{
+		i = dbbufferChooseFrame(state, pageNum);
+		if (i == 0)
+			return -1;
+		dbbufferSetFrame(state, i, pageNum);
+		dbbufferAccess(state, i, DBBUFFER_LEVEL_UNKNOWN, 1);
+	}
+
+	if (state->buffer + i*state->pageSize != buffer)
+		memcpy(state->buffer + i*state->pageSize, buffer, state->pageSize);
+
+	if (!(state->frames[i].flags & DBBUFFER_DIRTY))
+	{
+		state->frames[i].flags |= DBBUFFER_DIRTY;
+		state->numDirty++;
+	}
+
+	/* Enforce limit on dirty pages by writing back another dirty page */
+	if (state->numDirty > state->maxDirty)
+	{
+		count_t j = dbbufferChooseDirty(state, i);
+		if (j != 0 && dbbufferWriteBack(state, j) != 0)
+			return -1;
 	}
 
 	// printf("\nWrite page: %d Id: %d Key: %d\n", pageNum, (state->nextPageId-1), *((int32_t*) (buffer+10)));
@@ -370,6 +1566,11 @@ int32_t overWritePage(dbbuffer *state, void* buffer, int32_t pageNum)
 
 /**
 @brief      Writes page to storage. Returns physical page id if success. -1 if failure.
+			Page is written to a free page if there is one. Otherwise storage is extended.
+			Buffer must not be a buffer frame that could be replaced when the free page list is read.
+			If every frame is pinned, the free page is read into buffer 0 or, if buffer is buffer 0, storage is extended instead.
+			If appendSize is not 0, page is staged and written together with the following appended pages
+			when the staging area is full or on flush.
 @param     	state
                	DBbuffer state structure
 @param     	buffer
@@ -380,9 +1581,70 @@ int32_t writePage(dbbuffer *state, void* buffer)
 {    		
 	int32_t pageNum;
 	
-	/* TODO: Handle when get to end of file? */
-	pageNum = state->nextPageWriteId++;
-	return writePageDirect(state, buffer, pageNum);	
+	if (dbbufferModify(state) != 0)
+		return -1;
+
+	pageNum = -1;
+	if (state->freeHead != DBBUFFER_EMPTY && (buffer != state->buffer || dbbufferCanFetch(state, state->freeHead)))
+	{	/* Reuse first free page. Page is read into buffer 0 if every frame is pinned. */
+		void *buf = dbbufferCanFetch(state, state->freeHead) ? readPage(state, state->freeHead) 
+					: readPageBufferInternal(state, state->freeHead, 0);
+		if (buf != NULL && BTREE_GET_ID(buf) == DBBUFFER_FREE)
+		{
+			pageNum = state->freeHead;
+			memcpy(&state->freeHead, buf + DBBUFFER_FREE_NEXT_OFFSET, sizeof(id_t));
+			state->numFree--;
+			if (state->freeHead == DBBUFFER_EMPTY)
+				state->numFree = 0;		/* Count of list recovered from last sync may include pages taken since */
+
+			/* Buffered copy of free page is replaced by page being written */
+			count_t i = dbbufferFindFrame(state, pageNum);
+			if (i != 0)
+				dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+		}
+		else
+		{	/* Free page list is not valid. Stop using it. */
+			state->freeHead = DBBUFFER_EMPTY;
+			state->numFree = 0;
+		}
+	}
+
+	if (pageNum == -1)
+	{	/* No free page. Extend storage. */
+		pageNum = state->nextPageWriteId;
+		if (state->reserveSize > 0 && (id_t) pageNum >= state->reserveEnd && state->storage->reserve != NULL)
+		{	/* Extend storage ahead of writes so following pages are written to allocated space. Page id is not used if reserve fails. */
+			if (state->storage->reserve(state->storage, pageNum + state->reserveSize) != 0)
+				return -1;
+			state->reserveEnd = pageNum + state->reserveSize;
+		}
+		state->nextPageWriteId++;
+	}
+	if (state->appendSize == 0)
+	{
+		if (writePageDirect(state, buffer, pageNum) == pageNum)
+			return pageNum;
+		if ((id_t) pageNum == state->nextPageWriteId - 1)
+			state->nextPageWriteId--;		/* Storage is full. Page id is not used so storage does not get a hole. */
+		return -1;
+	}
+
+	/* Stage page. Staged pages are consecutive and are written together when staging area is full or on flush. */
+	if (state->numAppend > 0 && (id_t) pageNum != state->appendStart + state->numAppend && dbbufferWriteAppend(state) != 0)
+		return -1;
+	if (state->numAppend == 0)
+		state->appendStart = pageNum;
+
+	/* Setup page number in header */	
+	memcpy(buffer, &(state->nextPageId), sizeof(id_t));
+	state->nextPageId++;
+	memcpy(state->appendBuffer + state->numAppend*state->pageSize, buffer, state->pageSize);
+	state->numAppend++;
+	state->numWrites++;
+
+	if (state->numAppend == state->appendSize && dbbufferWriteAppend(state) != 0)
+		return -1;
+	return pageNum;
 }
 
 
@@ -407,15 +1669,292 @@ void* initBufferPage(dbbuffer *state, int pageNum)
 	return buf;		
 }
 
+/**
+@brief     	Returns page to free page list for reuse by writePage. Page must not be pinned.
+			Buffered copy of page is discarded.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferFreePage(dbbuffer *state, id_t pageNum)
+{
+	uint8_t header[DBBUFFER_FREE_NEXT_OFFSET + sizeof(id_t)];
+	id_t id = DBBUFFER_FREE;
+
+	count_t i = dbbufferFindFrame(state, pageNum);
+	if (i != 0)
+	{
+		if (state->frames[i].pin > 0)
+			return -1;
+		if (state->frames[i].flags & DBBUFFER_DIRTY)
+		{	/* Page contents no longer needed */
+			state->frames[i].flags &= ~DBBUFFER_DIRTY;
+			state->numDirty--;
+		}
+		dbbufferSetFrame(state, i, DBBUFFER_EMPTY);
+	}
+
+	/* Write header marking page free with link to next free page. Count of 0 means a free page is never taken as root. */
+	memset(header, 0, sizeof(header));
+	memcpy(header, &id, sizeof(id_t));
+	memcpy(header + DBBUFFER_FREE_NEXT_OFFSET, &state->freeHead, sizeof(id_t));
+	if (writeBytes(state, header, sizeof(header), pageNum, 0) == -1)
+		return -1;
+
+	state->freeHead = pageNum;
+	state->numFree++;
+	return 0;
+}
+
+/**
+@brief     	Writes staged appended pages and all dirty pages in buffer to storage.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+static int8_t dbbufferWriteDirty(dbbuffer *state)
+{
+	if (dbbufferWriteAppend(state) != 0)
+		return -1;
+
+	for (count_t i=1; i < state->numPages; i++)
+	{
+		if (dbbufferWriteBack(state, i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Writes all dirty pages in buffer to storage and syncs storage.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferFlush(dbbuffer *state)
+{
+	if (dbbufferWriteDirty(state) != 0)
+		return -1;
+	if (state->storage->sync(state->storage) != 0)
+		return -1;
+
+	state->numUnsynced = 0;
+	state->lastSync = dbbufferMillis();
+	state->numSyncs++;
+
+	if (state->superblock != NULL)
+		return dbbufferWriteSuperblock(state, 1);
+	return 0;
+}
+
+/**
+@brief     	Marks end of an operation that modified storage. Syncs according to sync policy.
+			If a flusher is running, caller holds the buffer lock.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferCommit(dbbuffer *state)
+{
+	state->numUnsynced++;
+	switch (state->syncPolicy)
+	{
+		case DBBUFFER_SYNC_ALWAYS:
+			return dbbufferFlush(state);
+		case DBBUFFER_SYNC_COUNT:
+			if (state->numUnsynced >= state->syncInterval)
+				return dbbufferFlush(state);
+			return 0;
+		case DBBUFFER_SYNC_TIME:
+			break;
+		default:
+			return 0;
+	}
+
+#if !defined(ARDUINO)
+	dbflusher *flusher = (dbflusher*) state->flusher;
+	if (flusher != NULL)
+	{	/* Flusher thread writes dirty pages and syncs once per interval. Caller holds the buffer lock. */
+		flusher->pending = 1;
+		state->numUnsynced = 0;
+		return flusher->error ? -1 : 0;
+	}
+#endif
+	if (dbbufferMillis() - state->lastSync >= state->syncInterval)
+		return dbbufferFlush(state);
+	return 0;
+}
+
+#if !defined(ARDUINO)
+/**
+@brief     	Flusher thread. Every sync interval, writes dirty and staged pages and syncs storage if pages were written 
+			since the last sync. Pages are written while holding the buffer lock so no operation is using the buffer.
+@param     	arg
+                Flusher structure
+*/
+static void* dbbufferFlusher(void *arg)
+{
+	dbflusher *flusher = (dbflusher*) arg;
+	dbbuffer *state = flusher->buffer;
+	dbstorage *storage = state->storage;
+	uint32_t interval = state->syncInterval;
+
+	pthread_mutex_lock(&flusher->lock);
+	while (!flusher->stop)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (long) (interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&flusher->cond, &flusher->lock, &ts);
+		if (flusher->stop)
+			break;			/* Remaining pages are written by closeBuffer */
+
+		if (state->numDirty > 0 || state->numAppend > 0)
+		{	/* Last operations may be followed by no others so their pages are written here */
+			if (dbbufferWriteDirty(state) != 0)
+				flusher->error = 1;
+			flusher->pending = 1;
+		}
+		if (flusher->pending)
+		{	/* Sync without holding lock so operations are not blocked */
+			flusher->pending = 0;
+			pthread_mutex_unlock(&flusher->lock);
+			int8_t result = storage->sync(storage);
+			pthread_mutex_lock(&flusher->lock);
+			if (result != 0)
+				flusher->error = 1;
+			flusher->numSyncs++;
+		}
+	}
+	pthread_mutex_unlock(&flusher->lock);
+	return NULL;
+}
+
+/**
+@brief     	Starts background flusher thread. Call after buffer is initialized. Sync policy must be DBBUFFER_SYNC_TIME.
+			Every syncInterval ms, the thread writes dirty pages and syncs them even if no operation follows.
+@param     	state
+                DBbuffer state structure
+@param     	flusher
+                Flusher structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferStartFlusher(dbbuffer *state, dbflusher *flusher)
+{
+	if (state->syncPolicy != DBBUFFER_SYNC_TIME || state->syncInterval == 0 || state->flusher != NULL)
+		return -1;
+
+	flusher->buffer = state;
+	flusher->pending = 0;
+	flusher->stop = 0;
+	flusher->error = 0;
+	flusher->numSyncs = 0;
+	pthread_mutex_init(&flusher->lock, NULL);
+	pthread_cond_init(&flusher->cond, NULL);
+	if (pthread_create(&flusher->thread, NULL, dbbufferFlusher, flusher) != 0)
+	{
+		pthread_cond_destroy(&flusher->cond);
+		pthread_mutex_destroy(&flusher->lock);
+		return -1;
+	}
+	state->flusher = flusher;
+	return 0;
+}
+
+/**
+@brief     	Stops background flusher thread. Syncs storage if any pages were written since last sync.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if any sync failed.
+*/
+int8_t dbbufferStopFlusher(dbbuffer *state)
+{
+	dbflusher *flusher = (dbflusher*) state->flusher;
+
+	if (flusher == NULL)
+		return 0;
+
+	pthread_mutex_lock(&flusher->lock);
+	flusher->stop = 1;
+	pthread_cond_signal(&flusher->cond);
+	pthread_mutex_unlock(&flusher->lock);
+	pthread_join(flusher->thread, NULL);
+
+	if (flusher->pending)
+	{
+		if (state->storage->sync(state->storage) != 0)
+			flusher->error = 1;
+		flusher->numSyncs++;
+	}
+	state->numSyncs += flusher->numSyncs;
+	pthread_cond_destroy(&flusher->cond);
+	pthread_mutex_destroy(&flusher->lock);
+	state->flusher = NULL;
+	return flusher->error ? -1 : 0;
+}
+#endif
+
+/**
+@brief     	Locks buffer so the flusher thread does not write pages while an operation uses the buffer. 
+			Does nothing if no flusher is running.
+@param     	state
+                DBbuffer state structure
+*/
+void dbbufferLock(dbbuffer *state)
+{
+#if !defined(ARDUINO)
+	if (state->flusher != NULL)
+		pthread_mutex_lock(&((dbflusher*) state->flusher)->lock);
+#else
+	(void) state;
+#endif
+}
+
+/**
+@brief     	Unlocks buffer locked by dbbufferLock.
+@param     	state
+                DBbuffer state structure
+*/
+void dbbufferUnlock(dbbuffer *state)
+{
+#if !defined(ARDUINO)
+	if (state->flusher != NULL)
+		pthread_mutex_unlock(&((dbflusher*) state->flusher)->lock);
+#else
+	(void) state;
+#endif
+}
+
 /**
 @brief     	Closes buffer.
 @param     	state
                 DBbuffer state structure
+@return		Returns 0 if success. -1 if pages may not have reached storage.
 */
-void closeBuffer(dbbuffer *state)
+int8_t closeBuffer(dbbuffer *state)
 {
+	int8_t result = 0;
+
+#if !defined(ARDUINO)
+	result = dbbufferStopFlusher(state);
+#endif
+	if (result == 0)
+		result = dbbufferFlush(state);
+	else if (dbbufferWriteDirty(state) == 0)
+		state->storage->sync(state->storage);	/* Flusher sync failed. Superblock is not written so it stays dirty. */
+	if (result != 0)
+		printf("Failed to write buffer to storage on close.\n");
 	printStats(state);	
-	fclose(state->file);
+	state->storage->close(state->storage);
+	return result;
 }
 
 /**
@@ -33,18 +33,21 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 /******************************************************************************/
+#ifndef DBBUFFER_H
+#define DBBUFFER_H
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
-#ifndef DBBUFFER_H
-#define DBBUFFER_H
-
 #include <stdint.h>
 #include <stdio.h>
 
 #if defined(ARDUINO)
 #include "file/sd_stdio_c_iface.h"
+#else
+#include <pthread.h>
+typedef FILE SD_FILE;
 #endif
 
 /* Define type for page ids (physical and logical). */
@@ -53,21 +56,129 @@ typedef uint32_t id_t;
 /* Define type for page record count. */
 typedef uint16_t count_t;
 
+typedef struct dbstorage dbstorage;
+
+/* Storage device interface used for all page I/O. Built-in implementations are in dbstorage.h. */
+struct dbstorage {
+	int8_t 	(*readPage)(dbstorage *storage, id_t pageNum, void *buffer);		/* Reads page into buffer. Returns 0 if success. */
+	int8_t 	(*writePage)(dbstorage *storage, id_t pageNum, void *buffer);		/* Writes page from buffer. Returns 0 if success. */
+	int8_t 	(*writeBytes)(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer);		/* Writes part of a page. Returns 0 if success. */
+	int8_t 	(*writePages)(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer);		/* Optional (may be NULL). Writes consecutive pages in one I/O. Returns 0 if success. */
+	id_t 	(*size)(dbstorage *storage);		/* Returns number of pages on storage */
+	int8_t 	(*sync)(dbstorage *storage);		/* Forces written pages to storage. Returns 0 if success. */
+	void 	(*close)(dbstorage *storage);		/* Releases storage */
+	void*	(*mapPage)(dbstorage *storage, id_t pageNum);		/* Optional (may be NULL). Returns pointer to page in memory-mapped storage or NULL if not mapped. */
+	int8_t 	(*readPages)(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer);		/* Optional (may be NULL). Reads consecutive pages in one I/O. Returns 0 if success. */
+	int8_t 	(*readPageBatch)(dbstorage *storage, id_t *pageNums, count_t *frames, count_t num, void *buffer);		/* Optional (may be NULL). Reads page pageNums[i] into buffer + frames[i]*pageSize for each i as one batch of I/O. Returns 0 if success. */
+	int8_t 	(*erase)(dbstorage *storage, id_t pageNum, count_t numPages);		/* Optional (may be NULL). Erases pages of flash erase blocks before they are rewritten. Returns 0 if success. */
+	int8_t 	(*reserve)(dbstorage *storage, id_t numPages);		/* Optional (may be NULL). Extends storage with zero pages to at least numPages pages so later writes do not allocate space. Returns 0 if success. */
+	count_t	pageSize;				/* Size of storage page. Set by dbbufferInit(). */
+};
+
+/* Status of buffer frame that does not contain a page */
+#define DBBUFFER_EMPTY		((id_t) -1)
+
+/* Buffer frame flags */
+#define DBBUFFER_DIRTY		1		/* Page in frame has been modified and not written to storage */
+#define DBBUFFER_REF		2		/* Page referenced since last pass of CLOCK hand */
+#define DBBUFFER_HOT		4		/* Page re-referenced so in hot queue of 2Q */
+#define DBBUFFER_BATCH		8		/* Frame pinned by current batch read */
+
+/* Buffer replacement policies */
+#define DBBUFFER_POLICY_ROUNDROBIN	0	/* Round robin with root page reserved */
+#define DBBUFFER_POLICY_CLOCK		1	/* CLOCK (second chance) */
+#define DBBUFFER_POLICY_LRU			2	/* Least recently used */
+#define DBBUFFER_POLICY_2Q			3	/* Simplified 2Q with probationary FIFO and hot LRU queue */
+
+/* Page id stored in header of a free page. Free pages are chained by the id of the next free page stored at DBBUFFER_FREE_NEXT_OFFSET. */
+#define DBBUFFER_FREE				((id_t) -2)
+#define DBBUFFER_FREE_NEXT_OFFSET	8
+
+/* Superblock. Two copies are written alternately to the first two pages of storage so one copy is intact if a write is interrupted. 
+   Page id in header of superblock pages means they are never taken as tree or free pages. 
+   Superblock written at flush is followed by page ids (id_t) then tree levels (uint8_t) of numWarm buffered pages. */
+#define DBBUFFER_SUPERBLOCK			((id_t) -3)
+#define DBBUFFER_SUPERBLOCK_PAGES	2
+#define DBBUFFER_SUPERBLOCK_VERSION	1
+
 typedef struct {
-	id_t  	*status;				/* Contents of buffer (physical page id)  */    
+	id_t	id;						/* DBBUFFER_SUPERBLOCK */
+	count_t	count;					/* Always 0 */
+	uint16_t version;				/* DBBUFFER_SUPERBLOCK_VERSION */
+	uint32_t seq;					/* Write sequence number. Valid copy with highest sequence number is current. */
+	uint8_t	clean;					/* 1 if storage is unchanged since superblock was written at flush. 0 if it has been modified since. */
+	uint8_t	levels;					/* Number of levels in tree */
+	uint8_t	keySize;				/* Size of key in bytes */
+	uint8_t	dataSize;				/* Size of data in bytes */
+	id_t	root;					/* Physical page id of root */
+	id_t	numNodes;				/* Number of nodes in tree */
+	id_t	nextPageId;				/* Next logical page id */
+	id_t	nextPageWriteId;		/* Physical page id of next page to write */
+	id_t	freeHead;				/* First page in list of free pages or DBBUFFER_EMPTY */
+	id_t	numFree;				/* Number of free pages */
+	count_t	numWarm;				/* Number of buffered pages listed after superblock to preload on recovery */
+	uint16_t reserved;
+	uint32_t checksum;				/* Checksum of all previous fields and list of buffered pages */
+} dbsuperblock;
+
+/* Sync policies. A sync writes dirty pages to storage and forces storage to durable media. */
+#define DBBUFFER_SYNC_NONE			0	/* Sync only on dbbufferFlush() and closeBuffer() */
+#define DBBUFFER_SYNC_ALWAYS		1	/* Sync after every operation */
+#define DBBUFFER_SYNC_TIME			2	/* Sync after an operation if syncInterval ms have passed since last sync */
+#define DBBUFFER_SYNC_COUNT			3	/* Sync after every syncInterval operations */
+
+/* Level hint when tree level of a page is not known */
+#define DBBUFFER_LEVEL_UNKNOWN		0xFF
+
+/* State of a buffer frame */
+typedef struct {
+	uint8_t	flags;					/* Frame flags (DBBUFFER_DIRTY, DBBUFFER_REF, DBBUFFER_HOT) */
+	uint8_t	level;					/* Tree level of page counted from leaves (0 = leaf). CLOCK, LRU, and 2Q evict lowest level first. */
+	uint8_t	pin;					/* Pin count. Pinned frames are never evicted. */
+	id_t	lastUse;				/* Access counter value at last use (LRU) or load (2Q probationary) */
+} dbframe;
+
+typedef struct {
+	id_t  	*status;				/* Contents of buffer (physical page id or DBBUFFER_EMPTY)  */    
+	count_t	*hashTable;				/* Open addressing table mapping page id to buffer frame. NULL to scan status instead. */
+	count_t	hashSize;				/* Number of hash table entries. Power of 2 and larger than numPages. */
 	void  	*buffer;				/* Allocated memory for buffer */
 	count_t	pageSize;				/* Size of buffer page */
 	count_t	numPages;				/* Number of buffer pages */    
-	SD_FILE *file;					/* File for storing data records. */		
+	dbstorage *storage;				/* Storage device for storing data records. */
 	id_t 	nextPageId;				/* Next logical page id. Page id is an incrementing value and may not always be same as physical page id. */
 	id_t 	nextPageWriteId;		/* Physical page id of next page to write. */	
 	id_t 	numWrites;				/* Number of page writes */
 	id_t 	numOverWrites;			/* Number of page overwrites */
 	id_t 	numReads;				/* Number of page reads */
 	id_t 	bufferHits;				/* Number of pages returned from buffer rather than storage */
-	count_t lastHit;				/* Buffer id of last buffer page hit */
-	count_t nextBufferPage;			/* Next page buffer id to use. Round robin */
+	id_t 	lastHit;				/* Page id of last buffer page hit */
+	count_t nextBufferPage;			/* Next page buffer id to use. Round robin and CLOCK hand. */
+	uint8_t	policy;					/* Buffer replacement policy (DBBUFFER_POLICY_*) */
+	id_t	accessCount;			/* Number of buffer accesses. Used as time for LRU and 2Q. */
 	id_t 	*activePath;			/* Active path on insert. Also contains root. Helps to prioritize. */
+	dbframe	*frames;				/* State of each buffer frame. Allocated with numPages entries. */
+	count_t	maxDirty;				/* Maximum number of dirty pages in buffer. 0 writes through on every overwrite. Requires at least 3 buffer pages. */
+	count_t	numDirty;				/* Number of dirty pages in buffer */
+	count_t	numPrefetch;			/* Number of frames at end of buffer reserved for read-ahead. 0 disables read-ahead. At most numPages-2-numScan. */
+	count_t	nextPrefetch;			/* Next read-ahead frame to use */
+	count_t	numScan;				/* Number of frames before read-ahead frames reserved for pages read by scans. 0 inserts scanned pages at cold end of replacement order. */
+	count_t	nextScan;				/* Next scan frame to use */
+	void	*appendBuffer;			/* Staging area for appended pages. Allocated with appendSize pages. */
+	count_t	appendSize;				/* Number of pages in staging area. 0 writes each appended page immediately. */
+	count_t	numAppend;				/* Number of pages in staging area */
+	id_t	appendStart;			/* Physical page id of first page in staging area */
+	id_t	freeHead;				/* First page in list of free pages or DBBUFFER_EMPTY */
+	id_t	numFree;				/* Number of free pages */
+	count_t	reserveSize;			/* Number of pages reserved on storage ahead of next page to write when storage is extended. 0 disables. */
+	id_t	reserveEnd;				/* Page after last reserved page */
+	dbsuperblock *superblock;		/* Superblock stored in first two pages so recovery does not scan storage. NULL disables. */
+	uint8_t	syncPolicy;				/* When operations are made durable (DBBUFFER_SYNC_*) */
+	uint32_t syncInterval;			/* Milliseconds (DBBUFFER_SYNC_TIME) or operations (DBBUFFER_SYNC_COUNT) between syncs */
+	uint32_t numUnsynced;			/* Number of operations since last sync */
+	uint32_t lastSync;				/* Time of last sync in ms */
+	id_t	numSyncs;				/* Number of syncs */
+	void	*flusher;				/* Background flusher (dbflusher) or NULL. Set by dbbufferStartFlusher(). */
 	void	*state;					/* Tree state */	
 } dbbuffer;
 
@@ -80,13 +191,19 @@ void dbbufferInit(dbbuffer *state);
 
 /**
 @brief     	Initializes buffer and recovers previous state from storage.
+			State is read from the superblock if it was written by a flush after the last change to storage
+			and the pages buffered at that flush are read back into the buffer in page order.
+			Otherwise storage is scanned from the end for the root. The free page list saved in the superblock at the last flush 
+			is reused. Without a superblock, free pages are not recovered.
 @param     	state
                 DBbuffer state structure
+@return		Returns 1 if state was recovered from superblock. 0 otherwise.
 */
-void dbbufferRecover(dbbuffer *state);
+int8_t dbbufferRecover(dbbuffer *state);
 
 /**
 @brief      Reads page either from buffer or from storage. Returns pointer to buffer if success.
+			If storage is memory-mapped, returns pointer into the mapping. Page must not be modified through this pointer.
 @param     	state
                 DBbuffer state structure
 @param     	pageNum
@@ -95,6 +212,131 @@ void dbbufferRecover(dbbuffer *state);
 */
 void* readPage(dbbuffer *state, id_t pageNum);
 
+/**
+@brief      Reads page either from buffer or from storage. Returns pointer to buffer if success.
+			If storage is memory-mapped, returns pointer into the mapping. Page must not be modified through this pointer.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+				Used by replacement policy to keep upper levels buffered.
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* readPageLevel(dbbuffer *state, id_t pageNum, uint8_t level);
+
+/**
+@brief      Reads page into a buffer frame and pins it so that it is not evicted until unpinned.
+			Page may be modified in place through the returned pointer and written using overWritePage.
+			Memory-mapped storage is read into a buffer frame so the mapping is not modified directly.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@param     	level
+                Tree level of page counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+@return		Returns pointer to buffer page or NULL if error or all frames are pinned.
+*/
+void* dbbufferPin(dbbuffer *state, id_t pageNum, uint8_t level);
+
+/**
+@brief      Reads page for a sequential scan. Returns pointer to buffer if success.
+			Scanned pages are read into the frames reserved for scans so they do not replace pages used by lookups.
+			Page stays buffered until numScan more pages are read by scans. Without scan frames, page is placed
+			at the cold end of the replacement order so it is replaced before other pages.
+			A buffer hit does not count as a use of the page by the replacement policy.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns pointer to buffer page or NULL if error.
+*/
+void* dbbufferReadScan(dbbuffer *state, id_t pageNum);
+
+/**
+@brief      Releases a pin on a buffered page.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns 0 if success. -1 if page is not pinned.
+*/
+int8_t dbbufferUnpin(dbbuffer *state, id_t pageNum);
+
+/**
+@brief      Takes a buffer frame out of use for buffering pages so the caller can build a page in it.
+			Any dirty page in the frame is written back. Frame is emptied, zeroed, and pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame (1 to numPages-1)
+@return		Returns pointer to frame or NULL if frame is pinned or write fails.
+*/
+void* dbbufferTakeFrame(dbbuffer *state, count_t frame);
+
+/**
+@brief      Takes the buffer frame chosen by the replacement policy out of use for buffering pages so the caller 
+			can build a page in it. Frame is emptied, zeroed, and pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Returns buffer frame taken
+@return		Returns pointer to frame or NULL if all frames are pinned or write fails.
+*/
+void* dbbufferTakeAnyFrame(dbbuffer *state, count_t *frame);
+
+/**
+@brief      Takes the frame holding a pinned page out of use for buffering pages so the caller can build another page 
+			in it from the page contents. Page is written back if dirty and is no longer buffered. Frame contents are kept
+			and frame stays pinned until released.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number) of pinned page
+@return		Returns buffer frame or 0 if page is not pinned or write fails.
+*/
+count_t dbbufferTakePage(dbbuffer *state, id_t pageNum);
+
+/**
+@brief      Returns a frame taken by dbbufferTakeFrame, dbbufferTakeAnyFrame, or dbbufferTakePage to use for buffering pages.
+@param     	state
+                DBbuffer state structure
+@param     	frame
+                Buffer frame
+*/
+void dbbufferReleaseFrame(dbbuffer *state, count_t frame);
+
+/**
+@brief      Reads pages ahead into the frames reserved for read-ahead. Pages that are consecutive on storage
+			are read in one I/O if the storage supports it. Nothing is read if the first page is already buffered
+			as it was read ahead by a previous call and its frames are not yet used.
+@param     	state
+                DBbuffer state structure
+@param     	pageNums
+                Physical page ids in the order they will be read
+@param     	num
+                Number of pages. At most numPrefetch pages are read.
+@return		Returns number of pages read or -1 if error.
+*/
+int16_t dbbufferPrefetch(dbbuffer *state, id_t *pageNums, count_t num);
+
+/**
+@brief      Reads pages into buffer with one batch of I/O. Pages are read for entries from the start of the list
+			until the buffer has no unpinned frame left. All pages of the processed entries remain buffered
+			until the next page is read or written. The batch is built in buffer 0.
+@param     	state
+                DBbuffer state structure
+@param     	pageNums
+                Physical page ids. Entries that are DBBUFFER_EMPTY are skipped. May contain duplicates.
+@param     	num
+                Number of entries
+@param     	level
+                Tree level of pages counted from leaves (0 = leaf) or DBBUFFER_LEVEL_UNKNOWN.
+@return		Returns number of entries processed or -1 if error.
+*/
+int32_t dbbufferReadBatch(dbbuffer *state, id_t *pageNums, count_t num, uint8_t level);
+
 /**
 @brief      Reads page to a particular buffer number. Returns pointer to buffer if success.
 @param     	state
@@ -109,6 +351,11 @@ void* readPageBuffer(dbbuffer *state, id_t pageNum, count_t bufferNum);
 
 /**
 @brief      Writes page to storage. Returns physical page id if success. -1 if failure.
+			Page is written to a free page if there is one. Otherwise storage is extended.
+			Buffer must not be a buffer frame that could be replaced when the free page list is read.
+			If every frame is pinned, the free page is read into buffer 0 or, if buffer is buffer 0, storage is extended instead.
+			If appendSize is not 0, page is staged and written together with the following appended pages
+			when the staging area is full or on flush.
 @param     	state
                 DBbuffer state structure
 @param     	buffer
@@ -120,6 +367,7 @@ int32_t writePage(dbbuffer *state, void* buffer);
 /**
 @brief      Overwrites page to storage at same physical address. -1 if failure.
 			Caller is responsible for knowing that overwrite is possible given page contents.
+			If maxDirty is not 0, page is kept dirty in buffer and written on eviction or flush.
 @param     	state
                 DBbuffer state structure
 @param     	buffer
@@ -152,11 +400,94 @@ int32_t writeBytes(dbbuffer *state, void* buffer, count_t size, int32_t pageNum,
 void* initBufferPage(dbbuffer *state, int pageNum);
 
 /**
-@brief     	Closes buffer.
+@brief     	Writes all dirty pages in buffer to storage and syncs storage.
+			Superblock is then written and synced with the ids of buffered pages to preload on recovery.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferFlush(dbbuffer *state);
+
+/**
+@brief     	Marks end of an operation that modified storage. Syncs according to sync policy.
+			If a flusher is running, caller holds the buffer lock.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferCommit(dbbuffer *state);
+
+#if !defined(ARDUINO)
+/* Background thread that writes dirty pages and syncs storage every syncInterval ms for DBBUFFER_SYNC_TIME (group commit). 
+   One sync by the thread makes all operations committed since the previous sync durable, even if no operation follows. 
+   Operations hold lock (dbbufferLock()) while they use the buffer. The thread holds it while it writes pages but not while it syncs.
+   Storage sync must be safe to call while pages are written (POSIX, direct, and memory-mapped storage). 
+   Superblock stays dirty while the thread runs. It is written clean by dbbufferFlush() and closeBuffer(). */
+typedef struct {
+	dbbuffer	*buffer;			/* Buffer being flushed */
+	pthread_t	thread;
+	pthread_mutex_t lock;			/* Buffer lock (dbbufferLock()) */
+	pthread_cond_t cond;
+	int8_t		pending;			/* 1 if pages have been written since last sync */
+	int8_t		stop;				/* 1 to stop thread */
+	int8_t		error;				/* 1 if a write or sync by thread has failed */
+	id_t		numSyncs;			/* Number of syncs by thread */
+} dbflusher;
+
+/**
+@brief     	Starts background flusher thread. Call after buffer is initialized. Sync policy must be DBBUFFER_SYNC_TIME.
+			Every syncInterval ms, the thread writes dirty pages and syncs them even if no operation follows.
+@param     	state
+                DBbuffer state structure
+@param     	flusher
+                Flusher structure
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferStartFlusher(dbbuffer *state, dbflusher *flusher);
+
+/**
+@brief     	Stops background flusher thread. Syncs storage if any pages were written since last sync.
+@param     	state
+                DBbuffer state structure
+@return		Returns 0 if success. -1 if any sync failed.
+*/
+int8_t dbbufferStopFlusher(dbbuffer *state);
+#endif
+
+/**
+@brief     	Locks buffer so the flusher thread does not write pages while an operation uses the buffer. 
+			Does nothing if no flusher is running. B-tree operations lock the buffer themselves.
+@param     	state
+                DBbuffer state structure
+*/
+void dbbufferLock(dbbuffer *state);
+
+/**
+@brief     	Unlocks buffer locked by dbbufferLock.
+@param     	state
+                DBbuffer state structure
+*/
+void dbbufferUnlock(dbbuffer *state);
+
+/**
+@brief     	Returns page to free page list for reuse by writePage. Page must not be pinned.
+			Buffered copy of page is discarded.
+@param     	state
+                DBbuffer state structure
+@param     	pageNum
+                Physical page id (number)
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t dbbufferFreePage(dbbuffer *state, id_t pageNum);
+
+/**
+@brief     	Closes buffer. Stops flusher, writes dirty pages, syncs storage, and writes a clean superblock, then closes storage.
+			If a write or sync fails (including a sync by the flusher), superblock is left dirty so recovery scans storage.
 @param     	state
                 DBbuffer state structure
+@return		Returns 0 if success. -1 if pages may not have reached storage.
 */
-void closeBuffer(dbbuffer *state);
+int8_t closeBuffer(dbbuffer *state);
 
 /**
 @brief     	Prints statistics.
@@ -0,0 +1,1731 @@
+/******************************************************************************/
+/**
+@file		dbstorage.c
+@author		Ramon Lawrence
+@brief		Storage device implementations for buffer page I/O.
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(ARDUINO)
+/* Use 64-bit file offsets on 32-bit hosts */
+#define _FILE_OFFSET_BITS 64
+/* O_DIRECT and statx */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#if !defined(ARDUINO)
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "dbstorage.h"
+
+/*
+File storage. Uses stdio functions which are mapped to SD card functions on Arduino.
+*/
+static int8_t fileReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	/* Seek to page location in file */
+	fseek(fp, pageNum*storage->pageSize, SEEK_SET);
+
+	if (numPages != fread(buffer, storage->pageSize, numPages, fp))
+		return -1;
+	return 0;
+}
+
+static int8_t fileReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return fileReadPages(storage, pageNum, 1, buffer);
+}
+
+static int8_t fileWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	/* Seek to page location in file */
+	fseek(fp, pageNum*storage->pageSize, SEEK_SET);
+
+	if (0 == fwrite(buffer, storage->pageSize, 1, fp))
+		return -1;
+	return 0;
+}
+
+static int8_t fileWritePages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	/* Seek to page location in file */
+	fseek(fp, pageNum*storage->pageSize, SEEK_SET);
+
+	if (numPages != fwrite(buffer, storage->pageSize, numPages, fp))
+		return -1;
+	return 0;
+}
+
+static int8_t fileWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	/* Seek to page location in file */
+	fseek(fp, pageNum*storage->pageSize+offset, SEEK_SET);
+
+	if (0 == fwrite(buffer, size, 1, fp))
+		return -1;
+	return 0;
+}
+
+static id_t fileSize(dbstorage *storage)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	fseek(fp, 0, SEEK_END);
+	return ftell(fp) / storage->pageSize;
+}
+
+static int8_t fileReserve(dbstorage *storage, id_t numPages)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+	uint32_t size = (uint32_t) numPages*storage->pageSize;
+
+#if defined(ARDUINO)
+	return sd_fpreallocate(fp, size) == 0 ? 0 : -1;
+#else
+	/* Writing last byte extends file with zeros */
+	uint8_t zero = 0;
+	fseek(fp, 0, SEEK_END);
+	if (ftell(fp) >= (long) size)
+		return 0;
+	fseek(fp, size-1, SEEK_SET);
+	if (0 == fwrite(&zero, 1, 1, fp))
+		return -1;
+	return 0;
+#endif
+}
+
+static int8_t fileSync(dbstorage *storage)
+{
+	SD_FILE *fp = ((fileStorage*) storage)->file;
+
+	if (fflush(fp) != 0)
+		return -1;
+#if !defined(ARDUINO)
+	/* fflush only moves stdio buffer to the OS. fsync makes written pages durable. */
+	if (fsync(fileno(fp)) != 0)
+		return -1;
+#endif
+	return 0;
+}
+
+static void fileClose(dbstorage *storage)
+{
+	fclose(((fileStorage*) storage)->file);
+}
+
+/**
+@brief     	Initializes storage on an open stdio file.
+@param     	fs
+                File storage structure
+@param     	file
+                File opened for reading and writing
+@return		Returns pointer to storage interface.
+*/
+dbstorage* fileStorageInit(fileStorage *fs, SD_FILE *file)
+{
+	fs->file = file;
+	fs->storage.readPage = fileReadPage;
+	fs->storage.writePage = fileWritePage;
+	fs->storage.writeBytes = fileWriteBytes;
+	fs->storage.size = fileSize;
+	fs->storage.sync = fileSync;
+	fs->storage.close = fileClose;
+	fs->storage.mapPage = NULL;
+	fs->storage.readPages = fileReadPages;
+	fs->storage.readPageBatch = NULL;
+	fs->storage.writePages = fileWritePages;
+	fs->storage.erase = NULL;
+	fs->storage.reserve = fileReserve;
+	fs->storage.pageSize = 0;
+	return &fs->storage;
+}
+
+/*
+RAM storage. Pages are stored at their offset in the memory region.
+*/
+static int8_t ramReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	ramStorage *rs = (ramStorage*) storage;
+
+	if (pageNum + numPages > rs->numPages)
+		return -1;
+	memcpy(buffer, rs->memory + pageNum*storage->pageSize, (uint32_t) numPages*storage->pageSize);
+	return 0;
+}
+
+static int8_t ramReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return ramReadPages(storage, pageNum, 1, buffer);
+}
+
+static int8_t ramWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	ramStorage *rs = (ramStorage*) storage;
+
+	if ((uint32_t) (pageNum+1)*storage->pageSize > rs->memorySize)
+		return -1;		/* Out of space */
+
+	/* Pages skipped over are zero like a file extended past its end. */
+	if (pageNum > rs->numPages)
+		memset(rs->memory + rs->numPages*storage->pageSize, 0, (pageNum-rs->numPages)*storage->pageSize);
+	if (pageNum >= rs->numPages)
+	{
+		memset(rs->memory + pageNum*storage->pageSize, 0, storage->pageSize);
+		rs->numPages = pageNum+1;
+	}
+	memcpy(rs->memory + pageNum*storage->pageSize + offset, buffer, size);
+	return 0;
+}
+
+static int8_t ramWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return ramWriteBytes(storage, pageNum, 0, storage->pageSize, buffer);
+}
+
+static id_t ramSize(dbstorage *storage)
+{
+	return ((ramStorage*) storage)->numPages;
+}
+
+static int8_t ramSync(dbstorage *storage)
+{
+	(void) storage;
+	return 0;
+}
+
+static void ramClose(dbstorage *storage)
+{
+	(void) storage;
+}
+
+/**
+@brief     	Initializes storage on a pre-allocated memory region. Memory is not freed on close.
+@param     	rs
+                RAM storage structure
+@param     	memory
+                Pre-allocated memory
+@param     	size
+                Size of memory in bytes
+@return		Returns pointer to storage interface.
+*/
+dbstorage* ramStorageInit(ramStorage *rs, void *memory, uint32_t size)
+{
+	rs->memory = memory;
+	rs->memorySize = size;
+	rs->numPages = 0;
+	rs->storage.readPage = ramReadPage;
+	rs->storage.writePage = ramWritePage;
+	rs->storage.writeBytes = ramWriteBytes;
+	rs->storage.size = ramSize;
+	rs->storage.sync = ramSync;
+	rs->storage.close = ramClose;
+	rs->storage.mapPage = NULL;
+	rs->storage.readPages = ramReadPages;
+	rs->storage.readPageBatch = NULL;
+	rs->storage.writePages = NULL;		/* Copying pages one at a time costs the same */
+	rs->storage.erase = NULL;
+	rs->storage.reserve = NULL;
+	rs->storage.pageSize = 0;
+	return &rs->storage;
+}
+
+/*
+Flash storage. Logical pages are mapped to physical pages on a flash device. Each write goes to the next 
+free physical page in the current erase block so the device is only written sequentially. 
+Device layout: two checkpoint areas of checkpointBlocks blocks each followed by data blocks.
+A checkpoint is a header page followed by the map. Header is written last so an incomplete checkpoint is never used.
+*/
+#define FLASH_CHECKPOINT_MAGIC		0x4C465442
+
+/* Block valid count has a flag set if block had valid pages at last checkpoint. Block must not be erased until a new checkpoint is written. */
+#define FLASH_BLOCK_CHECKPOINT		0x8000
+#define FLASH_VALID(x)				((x) & ~FLASH_BLOCK_CHECKPOINT)
+
+static uint32_t flashChecksum(flashStorage *fs)
+{
+	uint32_t sum = fs->numLogical;
+
+	for (id_t i=0; i < fs->numLogical; i++)
+		sum = sum*31 + fs->map[i];
+	return sum;
+}
+
+static int8_t flashCheckpoint(flashStorage *fs)
+{
+	dbstorage *dev = fs->device;
+	count_t pageSize = fs->storage.pageSize;
+	uint32_t seq = fs->checkpointSeq + 1;
+	uint32_t mapBytes = fs->numLogical*sizeof(id_t);
+	uint32_t header[4];
+	id_t start = (seq % 2)*fs->checkpointBlocks*fs->pagesPerBlock;
+	id_t p;
+
+	/* Overwrite older checkpoint. Newest checkpoint is in other area. */
+	if (dev->erase != NULL && dev->erase(dev, start, fs->checkpointBlocks*fs->pagesPerBlock) != 0)
+		return -1;
+
+	for (p=0; p*pageSize < mapBytes; p++)
+	{
+		void *page = ((void*) fs->map) + p*pageSize;
+		if ((p+1)*pageSize > mapBytes)
+		{	/* Last partial page of map */
+			memset(fs->buffer, 0, pageSize);
+			memcpy(fs->buffer, page, mapBytes - p*pageSize);
+			page = fs->buffer;
+		}
+		if (dev->writePage(dev, start+1+p, page) != 0)
+			return -1;
+	}
+	if (dev->sync(dev) != 0)
+		return -1;
+
+	header[0] = FLASH_CHECKPOINT_MAGIC;
+	header[1] = seq;
+	header[2] = fs->numLogical;
+	header[3] = flashChecksum(fs);
+	memset(fs->buffer, 0, pageSize);
+	memcpy(fs->buffer, header, sizeof(header));
+	if (dev->writePage(dev, start, fs->buffer) != 0 || dev->sync(dev) != 0)
+		return -1;
+
+	for (count_t b=0; b < fs->numBlocks; b++)
+		fs->blockValid[b] = FLASH_VALID(fs->blockValid[b]) > 0 ? fs->blockValid[b] | FLASH_BLOCK_CHECKPOINT : 0;
+	fs->checkpointSeq = seq;
+	fs->mapChanged = 0;
+	fs->numCheckpoints++;
+	return 0;
+}
+
+static int8_t flashReadCheckpointHeader(flashStorage *fs, int8_t area, uint32_t *header)
+{
+	if (fs->device->readPage(fs->device, area*fs->checkpointBlocks*fs->pagesPerBlock, fs->buffer) != 0)
+		return -1;
+	memcpy(header, fs->buffer, 4*sizeof(uint32_t));
+	if (header[0] != FLASH_CHECKPOINT_MAGIC || header[2] != fs->numLogical)
+		return -1;
+	return 0;
+}
+
+static int8_t flashLoadCheckpoint(flashStorage *fs, int8_t area, uint32_t *header)
+{
+	dbstorage *dev = fs->device;
+	count_t pageSize = fs->storage.pageSize;
+	uint32_t mapBytes = fs->numLogical*sizeof(id_t);
+	id_t start = area*fs->checkpointBlocks*fs->pagesPerBlock;
+
+	for (id_t p=0; p*pageSize < mapBytes; p++)
+	{
+		if (dev->readPage(dev, start+1+p, fs->buffer) != 0)
+			return -1;
+		memcpy(((void*) fs->map) + p*pageSize, fs->buffer, (p+1)*pageSize > mapBytes ? mapBytes - p*pageSize : pageSize);
+	}
+	if (flashChecksum(fs) != header[3])
+		return -1;
+	fs->checkpointSeq = header[1];
+	return 0;
+}
+
+static int8_t flashAppend(flashStorage *fs, id_t pageNum, void *buffer);
+
+/* Opens next free erase block for writing. Keeps at least one other free block by garbage collecting the block with fewest valid pages. */
+static int8_t flashNextBlock(flashStorage *fs)
+{
+	count_t first = 2*fs->checkpointBlocks, numData = fs->numBlocks - first;
+	count_t b, i, next = 0, numFree = 0;
+
+	/* Prefer next free block that does not require a checkpoint before erasing */
+	for (i=1; i <= numData; i++)
+	{
+		b = first + (fs->currentBlock - first + i) % numData;
+		if (FLASH_VALID(fs->blockValid[b]) == 0)
+		{
+			if (numFree == 0 || ((fs->blockValid[next] & FLASH_BLOCK_CHECKPOINT) && !(fs->blockValid[b] & FLASH_BLOCK_CHECKPOINT)))
+				next = b;
+			numFree++;
+		}
+	}
+	if (numFree == 0)
+		return -1;		/* Device full */
+
+	/* Stale pages in block may still be referenced by last checkpoint */
+	if ((fs->blockValid[next] & FLASH_BLOCK_CHECKPOINT) && flashCheckpoint(fs) != 0)
+		return -1;
+
+	if (fs->device->erase != NULL && fs->device->erase(fs->device, (id_t) next*fs->pagesPerBlock, fs->pagesPerBlock) != 0)
+		return -1;
+	fs->numErases++;
+	fs->currentBlock = next;
+	fs->nextPage = 0;
+	fs->blockValid[next] = 0;
+
+	if (numFree > 1)
+		return 0;
+
+	/* Garbage collect. Valid pages of victim fit in the new block as victim has fewer valid pages than a full block. */
+	count_t victim = 0;
+	for (b=first; b < fs->numBlocks; b++)
+	{
+		if (b != fs->currentBlock && (victim == 0 || FLASH_VALID(fs->blockValid[b]) < FLASH_VALID(fs->blockValid[victim])))
+			victim = b;
+	}
+	if (victim == 0 || FLASH_VALID(fs->blockValid[victim]) >= fs->pagesPerBlock)
+		return 0;		/* Nothing to reclaim. Device will be full after this block. */
+
+	for (id_t l=0; l < fs->logicalSize && FLASH_VALID(fs->blockValid[victim]) > 0; l++)
+	{
+		if (fs->map[l] != DBBUFFER_EMPTY && fs->map[l] / fs->pagesPerBlock == victim)
+		{
+			if (fs->device->readPage(fs->device, fs->map[l], fs->buffer) != 0 || flashAppend(fs, l, fs->buffer) != 0)
+				return -1;
+			fs->numRelocations++;
+		}
+	}
+	return 0;
+}
+
+static int8_t flashAppend(flashStorage *fs, id_t pageNum, void *buffer)
+{
+	if (fs->nextPage >= fs->pagesPerBlock && flashNextBlock(fs) != 0)
+		return -1;
+
+	id_t physical = (id_t) fs->currentBlock*fs->pagesPerBlock + fs->nextPage;
+	if (fs->device->writePage(fs->device, physical, buffer) != 0)
+		return -1;
+	fs->nextPage++;
+
+	if (fs->map[pageNum] != DBBUFFER_EMPTY)
+		fs->blockValid[fs->map[pageNum] / fs->pagesPerBlock]--;
+	fs->map[pageNum] = physical;
+	fs->blockValid[fs->currentBlock]++;
+	fs->mapChanged = 1;
+	if (pageNum >= fs->logicalSize)
+		fs->logicalSize = pageNum+1;
+	return 0;
+}
+
+static int8_t flashReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	flashStorage *fs = (flashStorage*) storage;
+
+	if (pageNum >= fs->numLogical || fs->map[pageNum] == DBBUFFER_EMPTY)
+		return -1;
+	return fs->device->readPage(fs->device, fs->map[pageNum], buffer);
+}
+
+static int8_t flashWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	flashStorage *fs = (flashStorage*) storage;
+
+	if (pageNum >= fs->numLogical)
+		return -1;
+	return flashAppend(fs, pageNum, buffer);
+}
+
+static int8_t flashWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	flashStorage *fs = (flashStorage*) storage;
+
+	/* Open new block first as garbage collection uses page buffer */
+	if (fs->nextPage >= fs->pagesPerBlock && flashNextBlock(fs) != 0)
+		return -1;
+
+	/* Pages cannot be partially rewritten on flash. Write whole page to new location. */
+	if (pageNum >= fs->numLogical)
+		return -1;
+	if (flashReadPage(storage, pageNum, fs->buffer) != 0)
+		memset(fs->buffer, 0, storage->pageSize);
+	memcpy(fs->buffer + offset, buffer, size);
+	return flashWritePage(storage, pageNum, fs->buffer);
+}
+
+static id_t flashSize(dbstorage *storage)
+{
+	return ((flashStorage*) storage)->logicalSize;
+}
+
+static int8_t flashSync(dbstorage *storage)
+{
+	flashStorage *fs = (flashStorage*) storage;
+
+	if (fs->device->sync(fs->device) != 0)
+		return -1;
+	if (fs->mapChanged)
+		return flashCheckpoint(fs);
+	return 0;
+}
+
+static void flashClose(dbstorage *storage)
+{
+	flashSync(storage);
+	((flashStorage*) storage)->device->close(((flashStorage*) storage)->device);
+}
+
+/**
+@brief     	Initializes flash storage that writes every page update to a new physical page. 
+			Recovers logical to physical page map from last checkpoint on device.
+@param     	fs
+                Flash storage structure
+@param     	device
+                Flash device storing physical pages
+@param     	pageSize
+                Page size. Must be same as buffer page size.
+@param     	pagesPerBlock
+                Number of pages in an erase block (less than 32768)
+@param     	numBlocks
+                Number of erase blocks on device
+@param     	map
+                Pre-allocated map with numLogical entries
+@param     	numLogical
+                Maximum number of logical pages
+@param     	blockValid
+                Pre-allocated array with numBlocks entries
+@param     	buffer
+                Pre-allocated page buffer
+@return		Returns pointer to storage interface or NULL if device is too small.
+*/
+dbstorage* flashStorageInit(flashStorage *fs, dbstorage *device, count_t pageSize, count_t pagesPerBlock, count_t numBlocks, 
+							id_t *map, id_t numLogical, count_t *blockValid, void *buffer)
+{
+	uint32_t header[2][4];
+	int8_t valid[2];
+	id_t i;
+
+	fs->device = device;
+	fs->map = map;
+	fs->numLogical = numLogical;
+	fs->blockValid = blockValid;
+	fs->numBlocks = numBlocks;
+	fs->pagesPerBlock = pagesPerBlock;
+	fs->buffer = buffer;
+	fs->checkpointSeq = 0;
+	fs->mapChanged = 0;
+	fs->numErases = 0;
+	fs->numRelocations = 0;
+	fs->numCheckpoints = 0;
+	fs->storage.readPage = flashReadPage;
+	fs->storage.writePage = flashWritePage;
+	fs->storage.writeBytes = flashWriteBytes;
+	fs->storage.size = flashSize;
+	fs->storage.sync = flashSync;
+	fs->storage.close = flashClose;
+	fs->storage.mapPage = NULL;
+	fs->storage.readPages = NULL;
+	fs->storage.readPageBatch = NULL;
+	fs->storage.writePages = NULL;
+	fs->storage.erase = NULL;
+	fs->storage.reserve = NULL;
+	fs->storage.pageSize = pageSize;
+	device->pageSize = pageSize;
+
+	/* Checkpoint area holds header page and map */
+	id_t checkpointPages = 1 + (numLogical*sizeof(id_t) + pageSize - 1) / pageSize;
+	fs->checkpointBlocks = (checkpointPages + pagesPerBlock - 1) / pagesPerBlock;
+	if (numBlocks < 2*fs->checkpointBlocks + 2)
+		return NULL;
+
+	/* Load newest valid checkpoint */
+	valid[0] = flashReadCheckpointHeader(fs, 0, header[0]) == 0;
+	valid[1] = flashReadCheckpointHeader(fs, 1, header[1]) == 0;
+	int8_t area = (valid[1] && (!valid[0] || header[1][1] > header[0][1])) ? 1 : 0;
+	if (!(valid[area] && flashLoadCheckpoint(fs, area, header[area]) == 0) && !(valid[1-area] && flashLoadCheckpoint(fs, 1-area, header[1-area]) == 0))
+	{	/* No checkpoint. Empty device. */
+		for (i=0; i < numLogical; i++)
+			map[i] = DBBUFFER_EMPTY;
+		fs->checkpointSeq = 0;
+	}
+
+	/* Rebuild block valid counts from map */
+	for (i=0; i < numBlocks; i++)
+		blockValid[i] = 0;
+	fs->logicalSize = 0;
+	for (i=0; i < numLogical; i++)
+	{
+		if (map[i] != DBBUFFER_EMPTY)
+		{
+			blockValid[map[i] / pagesPerBlock]++;
+			fs->logicalSize = i+1;
+		}
+	}
+
+	for (i=0; i < numBlocks; i++)
+	{
+		if (blockValid[i] > 0)
+			blockValid[i] |= FLASH_BLOCK_CHECKPOINT;
+	}
+
+	/* Start writing in a new block on first write */
+	fs->currentBlock = numBlocks-1;
+	fs->nextPage = pagesPerBlock;
+	return &fs->storage;
+}
+
+/*
+Simulated storage. Charges time for each operation according to model and forwards it to device storing the pages.
+*/
+static void simEraseBlock(simStorage *ss, id_t block)
+{
+	id_t p, first = block*ss->model.pagesPerBlock;
+
+	ss->time += ss->model.eraseTime;
+	for (p=first; p < first + ss->model.pagesPerBlock && p < ss->numPages; p++)
+		ss->pageWrites[p] = 0;
+	if (ss->blockErases != NULL)
+	{
+		ss->blockErases[block]++;
+		if (ss->blockErases[block] > ss->maxBlockErases)
+			ss->maxBlockErases = ss->blockErases[block];
+	}
+}
+
+/* Charges for programming a page. Page that cannot be written again before erase requires erasing its block 
+   and rewriting the other programmed pages of the block. */
+static void simProgram(simStorage *ss, id_t pageNum, int8_t fullPage)
+{
+	if (ss->pageWrites == NULL || ss->model.pagesPerBlock == 0 || pageNum >= ss->numPages)
+		return;
+
+	if (ss->pageWrites[pageNum] >= ss->model.maxPageWrites || (fullPage && ss->pageWrites[pageNum] > 0))
+	{
+		id_t first = pageNum - pageNum % ss->model.pagesPerBlock;
+		for (id_t p=first; p < first + ss->model.pagesPerBlock && p < ss->numPages; p++)
+		{
+			if (p != pageNum && ss->pageWrites[p] > 0)
+				ss->time += ss->model.readTime + ss->model.writeTime;
+		}
+		simEraseBlock(ss, pageNum / ss->model.pagesPerBlock);
+		for (id_t p=first; p < first + ss->model.pagesPerBlock && p < ss->numPages; p++)
+		{
+			if (p != pageNum)
+				ss->pageWrites[p] = 1;
+		}
+		ss->numImplicitErases++;
+	}
+	ss->pageWrites[pageNum] = fullPage ? ss->model.maxPageWrites : ss->pageWrites[pageNum]+1;
+}
+
+/* Returns device storing pages. Page size is set on simulated storage by buffer so it is passed on to device. */
+static dbstorage* simDevice(dbstorage *storage)
+{
+	dbstorage *device = ((simStorage*) storage)->device;
+
+	device->pageSize = storage->pageSize;
+	return device;
+}
+
+static void simChargeRead(simStorage *ss, id_t pageNum)
+{
+	ss->time += (pageNum == ss->lastRead+1) ? ss->model.seqReadTime : ss->model.readTime;
+	ss->lastRead = pageNum;
+	ss->numReads++;
+}
+
+static void simChargeWrite(simStorage *ss, id_t pageNum)
+{
+	ss->time += (pageNum == ss->lastWrite+1) ? ss->model.seqWriteTime : ss->model.writeTime;
+	ss->lastWrite = pageNum;
+	ss->numWrites++;
+	simProgram(ss, pageNum, 1);
+}
+
+static int8_t simReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	simChargeRead(ss, pageNum);
+	return device->readPage(device, pageNum, buffer);
+}
+
+static int8_t simReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	for (count_t i=0; i < numPages; i++)
+		simChargeRead(ss, pageNum+i);
+	if (device->readPages != NULL)
+		return device->readPages(device, pageNum, numPages, buffer);
+	for (count_t i=0; i < numPages; i++)
+	{
+		if (device->readPage(device, pageNum+i, buffer + i*storage->pageSize) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int8_t simWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	simChargeWrite(ss, pageNum);
+	return device->writePage(device, pageNum, buffer);
+}
+
+static int8_t simWritePages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	for (count_t i=0; i < numPages; i++)
+		simChargeWrite(ss, pageNum+i);
+	if (device->writePages != NULL)
+		return device->writePages(device, pageNum, numPages, buffer);
+	for (count_t i=0; i < numPages; i++)
+	{
+		if (device->writePage(device, pageNum+i, buffer + i*storage->pageSize) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int8_t simWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	ss->time += ss->model.partialWriteTime;
+	ss->lastWrite = pageNum;
+	ss->numPartialWrites++;
+	simProgram(ss, pageNum, 0);
+	return device->writeBytes(device, pageNum, offset, size, buffer);
+}
+
+static int8_t simErase(dbstorage *storage, id_t pageNum, count_t numPages)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	if (ss->model.pagesPerBlock > 0)
+	{
+		for (id_t b = pageNum / ss->model.pagesPerBlock; b <= (pageNum+numPages-1) / ss->model.pagesPerBlock; b++)
+		{
+			if (ss->pageWrites != NULL)
+				simEraseBlock(ss, b);
+			else
+				ss->time += ss->model.eraseTime;
+			ss->numErases++;
+		}
+	}
+	if (device->erase != NULL)
+		return device->erase(device, pageNum, numPages);
+	return 0;
+}
+
+static int8_t simReserve(dbstorage *storage, id_t numPages)
+{
+	dbstorage *device = simDevice(storage);
+
+	if (device->reserve == NULL)
+		return 0;
+	return device->reserve(device, numPages);
+}
+
+static id_t simSize(dbstorage *storage)
+{
+	dbstorage *device = simDevice(storage);
+
+	return device->size(device);
+}
+
+static int8_t simSync(dbstorage *storage)
+{
+	simStorage *ss = (simStorage*) storage;
+	dbstorage *device = simDevice(storage);
+
+	ss->time += ss->model.syncTime;
+	return device->sync(device);
+}
+
+static void simClose(dbstorage *storage)
+{
+	dbstorage *device = simDevice(storage);
+
+	device->close(device);
+}
+
+/**
+@brief     	Initializes storage that simulates time and wear of a device.
+@param     	ss
+                Simulated storage structure
+@param     	device
+                Storage holding page data
+@param     	model
+                Device model. Copied into simulated storage.
+@param     	numPages
+                Number of pages on device. Pages past end are not included in erase model.
+@param     	pageWrites
+                Pre-allocated array with numPages entries or NULL to disable erase model
+@param     	blockErases
+                Pre-allocated array with one entry per erase block or NULL if wear per block is not tracked
+@return		Returns pointer to storage interface.
+*/
+dbstorage* simStorageInit(simStorage *ss, dbstorage *device, simModel *model, id_t numPages, uint8_t *pageWrites, uint32_t *blockErases)
+{
+	ss->device = device;
+	ss->model = *model;
+	ss->numPages = numPages;
+	ss->pageWrites = pageWrites;
+	ss->blockErases = blockErases;
+	ss->lastRead = DBBUFFER_EMPTY-1;
+	ss->lastWrite = DBBUFFER_EMPTY-1;
+	ss->time = 0;
+	ss->numReads = 0;
+	ss->numWrites = 0;
+	ss->numPartialWrites = 0;
+	ss->numErases = 0;
+	ss->numImplicitErases = 0;
+	ss->maxBlockErases = 0;
+	if (ss->model.maxPageWrites == 0)
+		ss->model.maxPageWrites = 1;
+
+	if (pageWrites != NULL)
+	{	/* Device starts erased */
+		for (id_t i=0; i < numPages; i++)
+			pageWrites[i] = 0;
+	}
+	if (blockErases != NULL && model->pagesPerBlock > 0)
+	{
+		for (id_t i=0; i < (numPages + model->pagesPerBlock - 1) / model->pagesPerBlock; i++)
+			blockErases[i] = 0;
+	}
+
+	ss->storage.readPage = simReadPage;
+	ss->storage.writePage = simWritePage;
+	ss->storage.writeBytes = simWriteBytes;
+	ss->storage.size = simSize;
+	ss->storage.sync = simSync;
+	ss->storage.close = simClose;
+	ss->storage.mapPage = NULL;
+	ss->storage.readPages = simReadPages;
+	ss->storage.readPageBatch = NULL;		/* Device has queue depth of one */
+	ss->storage.writePages = simWritePages;
+	ss->storage.erase = simErase;
+	ss->storage.reserve = simReserve;
+	ss->storage.pageSize = 0;
+	return &ss->storage;
+}
+
+/*
+Raw block storage. First block of region holds header with magic value and number of blocks used. 
+Pages are mapped directly to blocks so there is no file system lookup or allocation.
+*/
+#define BLOCK_STORAGE_MAGIC		0x4B4C4254
+
+static uint32_t blockPageBlock(dbstorage *storage, id_t pageNum)
+{
+	return ((blockStorage*) storage)->firstBlock + 1 + pageNum * (storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE);
+}
+
+static int8_t blockReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	blockStorage *bs = (blockStorage*) storage;
+	uint32_t blocksPerPage = storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE;
+
+	if ((pageNum+numPages)*blocksPerPage > bs->usedBlocks)
+		return -1;
+	return bs->readBlocks(bs->device, blockPageBlock(storage, pageNum), numPages*blocksPerPage, buffer);
+}
+
+static int8_t blockReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return blockReadPages(storage, pageNum, 1, buffer);
+}
+
+static int8_t blockWritePages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	blockStorage *bs = (blockStorage*) storage;
+	uint32_t blocksPerPage = storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE;
+	uint32_t end = (pageNum+numPages)*blocksPerPage;
+
+	if (end > bs->numBlocks-1)
+		return -1;
+	if (bs->writeBlocks(bs->device, blockPageBlock(storage, pageNum), numPages*blocksPerPage, buffer) != 0)
+		return -1;
+	if (end > bs->usedBlocks)
+		bs->usedBlocks = end;
+	return 0;
+}
+
+static int8_t blockWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return blockWritePages(storage, pageNum, 1, buffer);
+}
+
+/* Writes part of page by reading and writing each block it covers */
+static int8_t blockWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	blockStorage *bs = (blockStorage*) storage;
+	uint32_t block = blockPageBlock(storage, pageNum) + offset / BLOCK_STORAGE_BLOCK_SIZE;
+	count_t start = offset % BLOCK_STORAGE_BLOCK_SIZE;
+
+	if ((pageNum+1)*(storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE) > bs->numBlocks-1)
+		return -1;
+	while (size > 0)
+	{
+		count_t len = BLOCK_STORAGE_BLOCK_SIZE - start < size ? BLOCK_STORAGE_BLOCK_SIZE - start : size;
+		if (block - bs->firstBlock - 1 < bs->usedBlocks)
+		{
+			if (bs->readBlocks(bs->device, block, 1, bs->buffer) != 0)
+				return -1;
+		}
+		else
+			memset(bs->buffer, 0, BLOCK_STORAGE_BLOCK_SIZE);
+		memcpy(bs->buffer + start, buffer, len);
+		if (bs->writeBlocks(bs->device, block, 1, bs->buffer) != 0)
+			return -1;
+		buffer += len;
+		size -= len;
+		start = 0;
+		block++;
+	}
+	/* Page is in use once any part of it is written */
+	if ((pageNum+1)*(storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE) > bs->usedBlocks)
+		bs->usedBlocks = (pageNum+1)*(storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE);
+	return 0;
+}
+
+static id_t blockSize(dbstorage *storage)
+{
+	return ((blockStorage*) storage)->usedBlocks / (storage->pageSize / BLOCK_STORAGE_BLOCK_SIZE);
+}
+
+/* Writes header with number of blocks used */
+static int8_t blockWriteHeader(blockStorage *bs)
+{
+	uint32_t header[2] = {BLOCK_STORAGE_MAGIC, bs->usedBlocks};
+
+	memset(bs->buffer, 0, BLOCK_STORAGE_BLOCK_SIZE);
+	memcpy(bs->buffer, header, sizeof(header));
+	if (bs->writeBlocks(bs->device, bs->firstBlock, 1, bs->buffer) != 0)
+		return -1;
+	bs->savedBlocks = bs->usedBlocks;
+	return 0;
+}
+
+static int8_t blockSync(dbstorage *storage)
+{
+	blockStorage *bs = (blockStorage*) storage;
+
+	if (bs->usedBlocks == bs->savedBlocks)
+		return 0;
+	return blockWriteHeader(bs);
+}
+
+static void blockClose(dbstorage *storage)
+{
+	blockSync(storage);
+}
+
+/**
+@brief     	Initializes storage on a region of a raw block device. Region is opened if its first block 
+			holds a valid header. Otherwise it is formatted as empty.
+@param     	bs
+                Block storage structure
+@param     	device
+                Block device (Sd2Card on Arduino or disk image)
+@param     	readBlocks
+                Function that reads blocks from device
+@param     	writeBlocks
+                Function that writes blocks to device
+@param     	firstBlock
+                First block of region on device
+@param     	numBlocks
+                Number of blocks in region
+@param     	buffer
+                Pre-allocated buffer of BLOCK_STORAGE_BLOCK_SIZE bytes
+@param     	format
+                1 to format region as empty even if it holds a valid header
+@return		Returns pointer to storage interface or NULL if error.
+*/
+dbstorage* blockStorageInit(blockStorage *bs, void *device, blockIo readBlocks, blockIo writeBlocks, 
+				uint32_t firstBlock, uint32_t numBlocks, void *buffer, int8_t format)
+{
+	uint32_t header[2];
+
+	if (numBlocks < 2)
+		return NULL;
+
+	bs->device = device;
+	bs->readBlocks = readBlocks;
+	bs->writeBlocks = writeBlocks;
+	bs->firstBlock = firstBlock;
+	bs->numBlocks = numBlocks;
+	bs->buffer = buffer;
+	bs->usedBlocks = 0;
+
+	if (!format && readBlocks(device, firstBlock, 1, buffer) == 0)
+	{
+		memcpy(header, buffer, sizeof(header));
+		if (header[0] == BLOCK_STORAGE_MAGIC && header[1] < numBlocks)
+			bs->usedBlocks = header[1];
+		else
+			format = 1;
+	}
+	else
+		format = 1;
+
+	if (format && blockWriteHeader(bs) != 0)
+		return NULL;
+	bs->savedBlocks = bs->usedBlocks;
+
+	bs->storage.readPage = blockReadPage;
+	bs->storage.writePage = blockWritePage;
+	bs->storage.writeBytes = blockWriteBytes;
+	bs->storage.size = blockSize;
+	bs->storage.sync = blockSync;
+	bs->storage.close = blockClose;
+	bs->storage.mapPage = NULL;
+	bs->storage.readPages = blockReadPages;
+	bs->storage.readPageBatch = NULL;
+	bs->storage.writePages = blockWritePages;
+	bs->storage.erase = NULL;
+	bs->storage.reserve = NULL;		/* Region is allocated in advance */
+	bs->storage.pageSize = 0;
+	return &bs->storage;
+}
+
+#if !defined(ARDUINO)
+/*
+Disk image block device. Blocks of a file standing in for a raw block device are read and written for block storage.
+*/
+int8_t imageReadBlocks(void *device, uint32_t block, uint32_t numBlocks, void *buffer)
+{
+	size_t size = (size_t) numBlocks*BLOCK_STORAGE_BLOCK_SIZE;
+	if (pread(*((int*) device), buffer, size, (off_t) block*BLOCK_STORAGE_BLOCK_SIZE) != (ssize_t) size)
+		return -1;
+	return 0;
+}
+
+int8_t imageWriteBlocks(void *device, uint32_t block, uint32_t numBlocks, void *buffer)
+{
+	size_t size = (size_t) numBlocks*BLOCK_STORAGE_BLOCK_SIZE;
+	if (pwrite(*((int*) device), buffer, size, (off_t) block*BLOCK_STORAGE_BLOCK_SIZE) != (ssize_t) size)
+		return -1;
+	return 0;
+}
+
+/*
+POSIX file storage. Uses positional I/O (pread/pwrite) with 64-bit offsets and no stdio buffering.
+Each page access is a single system call with no seek.
+*/
+static int8_t posixReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	int fd = ((posixStorage*) storage)->fd;
+	off_t pos = (off_t) pageNum*storage->pageSize;
+	size_t size = (size_t) numPages*storage->pageSize;
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t n = pread(fd, buffer+done, size-done, pos+done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;		/* Error or past end of file */
+		done += n;
+	}
+	return 0;
+}
+
+static int8_t posixReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return posixReadPages(storage, pageNum, 1, buffer);
+}
+
+static int8_t posixWrite(dbstorage *storage, off_t pos, size_t size, void *buffer)
+{
+	int fd = ((posixStorage*) storage)->fd;
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t n = pwrite(fd, buffer+done, size-done, pos+done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int8_t posixWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	return posixWrite(storage, (off_t) pageNum*storage->pageSize+offset, size, buffer);
+}
+
+static int8_t posixWritePages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	return posixWrite(storage, (off_t) pageNum*storage->pageSize, (size_t) numPages*storage->pageSize, buffer);
+}
+
+static int8_t posixWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return posixWritePages(storage, pageNum, 1, buffer);
+}
+
+static id_t posixSize(dbstorage *storage)
+{
+	struct stat st;
+
+	if (fstat(((posixStorage*) storage)->fd, &st) != 0)
+		return 0;
+	return st.st_size / storage->pageSize;
+}
+
+static int8_t posixReserve(dbstorage *storage, id_t numPages)
+{
+	return posix_fallocate(((posixStorage*) storage)->fd, 0, (off_t) numPages*storage->pageSize) == 0 ? 0 : -1;
+}
+
+static int8_t posixSync(dbstorage *storage)
+{
+	return fsync(((posixStorage*) storage)->fd) == 0 ? 0 : -1;
+}
+
+static void posixClose(dbstorage *storage)
+{
+	close(((posixStorage*) storage)->fd);
+}
+
+/**
+@brief     	Initializes storage on an open POSIX file descriptor.
+@param     	ps
+                POSIX storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@return		Returns pointer to storage interface.
+*/
+dbstorage* posixStorageInit(posixStorage *ps, int fd)
+{
+	ps->fd = fd;
+	ps->storage.readPage = posixReadPage;
+	ps->storage.writePage = posixWritePage;
+	ps->storage.writeBytes = posixWriteBytes;
+	ps->storage.size = posixSize;
+	ps->storage.sync = posixSync;
+	ps->storage.close = posixClose;
+	ps->storage.mapPage = NULL;
+	ps->storage.readPages = posixReadPages;
+	ps->storage.readPageBatch = NULL;
+	ps->storage.writePages = posixWritePages;
+	ps->storage.erase = NULL;
+	ps->storage.reserve = posixReserve;
+	ps->storage.pageSize = 0;
+	return &ps->storage;
+}
+
+/*
+Direct I/O storage. Reads and writes of aligned buffers go straight to the POSIX file operations. 
+Unaligned buffers and partial page writes are copied through the aligned page.
+*/
+static int8_t directAligned(directStorage *ds, void *buffer)
+{
+	return ((uintptr_t) buffer) % ds->alignment == 0;
+}
+
+static int8_t directReadPages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	directStorage *ds = (directStorage*) storage;
+
+	if (directAligned(ds, buffer))
+		return posixReadPages(storage, pageNum, numPages, buffer);
+
+	for (count_t i=0; i < numPages; i++)
+	{
+		if (posixReadPages(storage, pageNum+i, 1, ds->page) != 0)
+			return -1;
+		memcpy(buffer + (size_t) i*storage->pageSize, ds->page, storage->pageSize);
+	}
+	return 0;
+}
+
+static int8_t directReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return directReadPages(storage, pageNum, 1, buffer);
+}
+
+static int8_t directWritePages(dbstorage *storage, id_t pageNum, count_t numPages, void *buffer)
+{
+	directStorage *ds = (directStorage*) storage;
+
+	if (directAligned(ds, buffer))
+		return posixWritePages(storage, pageNum, numPages, buffer);
+
+	for (count_t i=0; i < numPages; i++)
+	{
+		memcpy(ds->page, buffer + (size_t) i*storage->pageSize, storage->pageSize);
+		if (posixWritePages(storage, pageNum+i, 1, ds->page) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int8_t directWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return directWritePages(storage, pageNum, 1, buffer);
+}
+
+/* Partial page writes read the page, update it, and write the whole page */
+static int8_t directWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	directStorage *ds = (directStorage*) storage;
+
+	if (directAligned(ds, buffer) && offset % ds->alignment == 0 && size % ds->alignment == 0)
+		return posixWriteBytes(storage, pageNum, offset, size, buffer);
+
+	if (pageNum >= posixSize(storage) || posixReadPages(storage, pageNum, 1, ds->page) != 0)
+		memset(ds->page, 0, storage->pageSize);
+	memcpy(ds->page + offset, buffer, size);
+	return posixWritePages(storage, pageNum, 1, ds->page);
+}
+
+/**
+@brief     	Returns alignment required for direct I/O on a file. Uses the direct I/O alignment 
+			reported by the file system if available, otherwise the block size of the file.
+@param     	fd
+                File descriptor
+@return		Returns alignment in bytes or 0 if error.
+*/
+uint32_t directStorageAlignment(int fd)
+{
+#if defined(STATX_DIOALIGN)
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) 
+			&& stx.stx_dio_offset_align != 0)
+		return stx.stx_dio_mem_align > stx.stx_dio_offset_align ? stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+#endif
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+	return st.st_blksize;
+}
+
+/**
+@brief     	Allocates memory aligned for direct I/O. Used for buffer pages (dbbuffer->buffer). Free with free().
+@param     	size
+                Number of bytes
+@param     	alignment
+                Alignment in bytes. Power of two.
+@return		Returns pointer to memory or NULL if error.
+*/
+void* directStorageAlloc(size_t size, uint32_t alignment)
+{
+	void *mem;
+
+	if (alignment < sizeof(void*))
+		alignment = sizeof(void*);
+	if (posix_memalign(&mem, alignment, size) != 0)
+		return NULL;
+	return mem;
+}
+
+/**
+@brief     	Initializes direct I/O storage on an open POSIX file descriptor. Enables O_DIRECT on the file.
+@param     	ds
+                Direct storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	pageSize
+                Page size of buffer. Must be a multiple of alignment.
+@param     	alignment
+                Alignment required by device or 0 to use directStorageAlignment()
+@param     	page
+                Buffer of pageSize bytes allocated with directStorageAlloc()
+@return		Returns pointer to storage interface or NULL if direct I/O is not supported or page size is not aligned.
+*/
+dbstorage* directStorageInit(directStorage *ds, int fd, count_t pageSize, uint32_t alignment, void *page)
+{
+	if (alignment == 0)
+		alignment = directStorageAlignment(fd);
+	if (alignment == 0 || pageSize % alignment != 0 || ((uintptr_t) page) % alignment != 0)
+		return NULL;
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+		return NULL;
+
+	posixStorageInit(&ds->posix, fd);
+	ds->alignment = alignment;
+	ds->page = page;
+	ds->posix.storage.readPage = directReadPage;
+	ds->posix.storage.writePage = directWritePage;
+	ds->posix.storage.writeBytes = directWriteBytes;
+	ds->posix.storage.readPages = directReadPages;
+	ds->posix.storage.writePages = directWritePages;
+	ds->posix.storage.pageSize = pageSize;
+	return &ds->posix.storage;
+}
+
+/*
+Memory-mapped file storage. Writes copy into the mapping and reads return a pointer into it.
+*/
+static int8_t mmapWriteBytes(dbstorage *storage, id_t pageNum, count_t offset, count_t size, void *buffer)
+{
+	mmapStorage *ms = (mmapStorage*) storage;
+	size_t start = (size_t) pageNum*storage->pageSize+offset;
+	size_t end = start+size;
+
+	if (end > ms->mapSize)
+		return -1;		/* Past reserved address space */
+
+	if (end > ms->allocSize)
+	{	/* Grow file by whole extents */
+		size_t alloc = (end + ms->extentSize - 1) / ms->extentSize * ms->extentSize;
+		if (alloc > ms->mapSize)
+			alloc = ms->mapSize;
+		if (ftruncate(ms->fd, alloc) != 0)
+			return -1;
+		ms->allocSize = alloc;
+	}
+
+	memcpy(ms->map + start, buffer, size);
+	if (end > ms->length)
+		ms->length = end;
+
+	if (ms->syncPolicy != MMAP_SYNC_NONE)
+	{	/* msync requires address aligned to OS page */
+		size_t osPage = sysconf(_SC_PAGESIZE);
+		size_t alignStart = start / osPage * osPage;
+		if (msync(ms->map + alignStart, end-alignStart, ms->syncPolicy == MMAP_SYNC_WRITE ? MS_SYNC : MS_ASYNC) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int8_t mmapWritePage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	return mmapWriteBytes(storage, pageNum, 0, storage->pageSize, buffer);
+}
+
+static void* mmapMapPage(dbstorage *storage, id_t pageNum)
+{
+	mmapStorage *ms = (mmapStorage*) storage;
+
+	if ((size_t) (pageNum+1)*storage->pageSize > ms->length)
+		return NULL;
+	return ms->map + (size_t) pageNum*storage->pageSize;
+}
+
+static int8_t mmapReadPage(dbstorage *storage, id_t pageNum, void *buffer)
+{
+	void *page = mmapMapPage(storage, pageNum);
+
+	if (page == NULL)
+		return -1;
+	memcpy(buffer, page, storage->pageSize);
+	return 0;
+}
+
+static id_t mmapSize(dbstorage *storage)
+{
+	return ((mmapStorage*) storage)->length / storage->pageSize;
+}
+
+static int8_t mmapSync(dbstorage *storage)
+{
+	mmapStorage *ms = (mmapStorage*) storage;
+
+	if (ms->allocSize == 0)
+		return 0;
+	return msync(ms->map, ms->allocSize, MS_SYNC) == 0 ? 0 : -1;
+}
+
+static void mmapClose(dbstorage *storage)
+{
+	mmapStorage *ms = (mmapStorage*) storage;
+
+	int8_t synced = mmapSync(storage) == 0;
+
+	munmap(ms->map, ms->mapSize);
+	/* Remove unused part of last extent only once data is on storage. If sync or truncate fails, 
+	   file keeps the zero-filled rest of the extent. */
+	if (synced && ms->length < ms->allocSize && ftruncate(ms->fd, ms->length) == 0)
+		ms->allocSize = ms->length;
+	close(ms->fd);
+}
+
+/**
+@brief     	Initializes storage on a memory-mapped file. Address space for the maximum file size is reserved
+			up front so that page pointers remain valid as the file grows.
+@param     	ms
+                Memory-mapped storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	maxSize
+                Maximum file size in bytes
+@param     	extentSize
+                Number of bytes to grow file by when writing past its end
+@param     	syncPolicy
+                One of MMAP_SYNC_*
+@return		Returns pointer to storage interface or NULL if mapping failed.
+*/
+dbstorage* mmapStorageInit(mmapStorage *ms, int fd, size_t maxSize, size_t extentSize, int8_t syncPolicy)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size > maxSize)
+		return NULL;
+
+	ms->map = mmap(NULL, maxSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ms->map == MAP_FAILED)
+		return NULL;
+
+	ms->fd = fd;
+	ms->mapSize = maxSize;
+	ms->allocSize = st.st_size;
+	ms->length = st.st_size;
+	ms->extentSize = extentSize;
+	ms->syncPolicy = syncPolicy;
+	ms->storage.readPage = mmapReadPage;
+	ms->storage.writePage = mmapWritePage;
+	ms->storage.writeBytes = mmapWriteBytes;
+	ms->storage.size = mmapSize;
+	ms->storage.sync = mmapSync;
+	ms->storage.close = mmapClose;
+	ms->storage.mapPage = mmapMapPage;
+	ms->storage.readPages = NULL;		/* Pages are not copied so no read-ahead */
+	ms->storage.readPageBatch = NULL;
+	ms->storage.writePages = NULL;
+	ms->storage.erase = NULL;
+	ms->storage.reserve = NULL;		/* Mapping is grown in chunks */
+	ms->storage.pageSize = 0;
+	return &ms->storage;
+}
+
+/*
+Asynchronous storage. Single page operations are POSIX storage operations.
+*/
+#if defined(__linux__)
+/**
+@brief     	Processes completed reads. A read that failed or was short is retried synchronously unless pageNums is NULL.
+@return		Returns number of completions processed.
+*/
+static count_t aioUringComplete(aioStorage *as, id_t *pageNums, count_t *frames, void *buffer, int8_t *err)
+{
+	dbstorage *storage = &as->posix.storage;
+	struct io_uring_cqe *cqes = (struct io_uring_cqe*) as->cqes;
+	uint32_t head = *as->cqHead;
+	count_t n = 0;
+
+	while (head != __atomic_load_n(as->cqTail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *as->cqMask];
+		count_t i = cqe->user_data;
+		if (pageNums != NULL && cqe->res != storage->pageSize)
+		{	/* Error or short read. Retry synchronously. */
+			if (posixReadPage(storage, pageNums[i], buffer + frames[i]*storage->pageSize) != 0)
+				*err = -1;
+		}
+		head++;
+		n++;
+	}
+	__atomic_store_n(as->cqHead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int8_t aioUringReadPageBatch(aioStorage *as, id_t *pageNums, count_t *frames, count_t num, void *buffer)
+{
+	dbstorage *storage = &as->posix.storage;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe*) as->sqes;
+	count_t submitted = 0, completed = 0, inFlight = 0, pending = 0, n;
+	int8_t err = 0;
+
+	while (completed < num)
+	{
+		/* Fill submission queue */
+		uint32_t tail = *as->sqTail;
+		while (submitted < num && inFlight < as->ringEntries)
+		{
+			uint32_t idx = tail & *as->sqMask;
+			struct io_uring_sqe *sqe = &sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = as->posix.fd;
+			sqe->addr = (uint64_t) (uintptr_t) (buffer + frames[submitted]*storage->pageSize);
+			sqe->len = storage->pageSize;
+			sqe->off = (uint64_t) pageNums[submitted]*storage->pageSize;
+			sqe->user_data = submitted;
+			as->sqArray[idx] = idx;
+			tail++;
+			submitted++;
+			inFlight++;
+			pending++;
+		}
+		__atomic_store_n(as->sqTail, tail, __ATOMIC_RELEASE);
+
+		/* Submit entries not yet taken by kernel and wait for at least one completion. 
+		   Entries are left queued if interrupted so they are submitted on the next call. */
+		int ret = syscall(__NR_io_uring_enter, as->ringFd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret > 0)
+			pending -= ret;
+
+		n = aioUringComplete(as, pageNums, frames, buffer, &err);
+		completed += n;
+		inFlight -= n;
+	}
+	if (completed == num)
+		return err;
+
+	/* Submit failed. Entries not taken by kernel are removed. Reads in flight write into buffer frames so they are waited for. */
+	__atomic_store_n(as->sqTail, *as->sqTail - pending, __ATOMIC_RELEASE);
+	inFlight -= pending;
+	while (inFlight > 0)
+	{
+		if (syscall(__NR_io_uring_enter, as->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			break;
+		inFlight -= aioUringComplete(as, NULL, frames, buffer, &err);
+	}
+	return -1;
+}
+
+static int8_t aioUringInit(aioStorage *as, uint32_t queueDepth)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	as->ringFd = syscall(__NR_io_uring_setup, queueDepth, &p);
+	if (as->ringFd < 0)
+		return -1;
+
+	as->ringEntries = p.sq_entries;
+	as->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+	as->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (as->cqRingSize > as->sqRingSize)
+			as->sqRingSize = as->cqRingSize;
+		as->cqRingSize = as->sqRingSize;
+	}
+
+	as->sqRing = mmap(NULL, as->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ringFd, IORING_OFF_SQ_RING);
+	if (as->sqRing == MAP_FAILED)
+		goto fail;
+	as->cqRing = as->sqRing;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		as->cqRing = mmap(NULL, as->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ringFd, IORING_OFF_CQ_RING);
+		if (as->cqRing == MAP_FAILED)
+		{
+			munmap(as->sqRing, as->sqRingSize);
+			goto fail;
+		}
+	}
+	as->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+	as->sqes = mmap(NULL, as->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ringFd, IORING_OFF_SQES);
+	if (as->sqes == MAP_FAILED)
+	{
+		if (as->cqRing != as->sqRing)
+			munmap(as->cqRing, as->cqRingSize);
+		munmap(as->sqRing, as->sqRingSize);
+		goto fail;
+	}
+
+	as->sqTail = as->sqRing + p.sq_off.tail;
+	as->sqMask = as->sqRing + p.sq_off.ring_mask;
+	as->sqArray = as->sqRing + p.sq_off.array;
+	as->cqHead = as->cqRing + p.cq_off.head;
+	as->cqTail = as->cqRing + p.cq_off.tail;
+	as->cqMask = as->cqRing + p.cq_off.ring_mask;
+	as->cqes = as->cqRing + p.cq_off.cqes;
+	return 0;
+
+fail:
+	close(as->ringFd);
+	as->ringFd = -1;
+	return -1;
+}
+
+static void aioUringClose(aioStorage *as)
+{
+	munmap(as->sqes, as->sqesSize);
+	if (as->cqRing != as->sqRing)
+		munmap(as->cqRing, as->cqRingSize);
+	munmap(as->sqRing, as->sqRingSize);
+	close(as->ringFd);
+}
+#endif
+
+static void* aioReader(void *arg)
+{
+	aioStorage *as = (aioStorage*) arg;
+	dbstorage *storage = &as->posix.storage;
+
+	pthread_mutex_lock(&as->lock);
+	while (1)
+	{
+		while (!as->shutdown && as->batchNext >= as->batchSize)
+			pthread_cond_wait(&as->workReady, &as->lock);
+		if (as->shutdown)
+			break;
+
+		/* Take next page of batch and read it without holding lock */
+		count_t i = as->batchNext++;
+		pthread_mutex_unlock(&as->lock);
+		int8_t err = posixReadPage(storage, as->batchPages[i], as->batchBuffer + as->batchFrames[i]*storage->pageSize);
+		pthread_mutex_lock(&as->lock);
+
+		if (err != 0)
+			as->batchError = -1;
+		if (++as->batchDone == as->batchSize)
+			pthread_cond_signal(&as->workDone);
+	}
+	pthread_mutex_unlock(&as->lock);
+	return NULL;
+}
+
+static int8_t aioReadPageBatch(dbstorage *storage, id_t *pageNums, count_t *frames, count_t num, void *buffer)
+{
+	aioStorage *as = (aioStorage*) storage;
+	int8_t err;
+
+	#if defined(__linux__)
+	if (as->ringFd >= 0)
+		return aioUringReadPageBatch(as, pageNums, frames, num, buffer);
+	#endif
+
+	pthread_mutex_lock(&as->lock);
+	as->batchPages = pageNums;
+	as->batchFrames = frames;
+	as->batchBuffer = buffer;
+	as->batchNext = 0;
+	as->batchDone = 0;
+	as->batchError = 0;
+	as->batchSize = num;
+	pthread_cond_broadcast(&as->workReady);
+	while (as->batchDone < num)
+		pthread_cond_wait(&as->workDone, &as->lock);
+	err = as->batchError;
+	as->batchSize = 0;
+	pthread_mutex_unlock(&as->lock);
+	return err;
+}
+
+static void aioStopThreads(aioStorage *as)
+{
+	pthread_mutex_lock(&as->lock);
+	as->shutdown = 1;
+	pthread_cond_broadcast(&as->workReady);
+	pthread_mutex_unlock(&as->lock);
+	for (uint8_t i=0; i < as->numThreads; i++)
+		pthread_join(as->threads[i], NULL);
+	pthread_cond_destroy(&as->workDone);
+	pthread_cond_destroy(&as->workReady);
+	pthread_mutex_destroy(&as->lock);
+}
+
+static void aioClose(dbstorage *storage)
+{
+	aioStorage *as = (aioStorage*) storage;
+
+	#if defined(__linux__)
+	if (as->ringFd >= 0)
+		aioUringClose(as);
+	#endif
+	if (as->numThreads > 0)
+		aioStopThreads(as);
+	posixClose(storage);
+}
+
+/**
+@brief     	Initializes storage on an open POSIX file descriptor that reads batches of pages asynchronously.
+@param     	as
+                Asynchronous storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	queueDepth
+                Maximum number of reads in flight
+@param     	numThreads
+                Number of reader threads if io_uring is not used (1 to AIO_MAX_THREADS)
+@param     	mode
+                One of AIO_MODE_*
+@return		Returns pointer to storage interface or NULL if neither io_uring nor reader threads could be started.
+*/
+dbstorage* aioStorageInit(aioStorage *as, int fd, uint32_t queueDepth, uint8_t numThreads, int8_t mode)
+{
+	posixStorageInit(&as->posix, fd);
+	as->posix.storage.readPageBatch = aioReadPageBatch;
+	as->posix.storage.close = aioClose;
+	as->ringFd = -1;
+	as->numThreads = 0;
+
+	#if defined(__linux__)
+	if (mode == AIO_MODE_AUTO && aioUringInit(as, queueDepth) == 0)
+		return &as->posix.storage;
+	#endif
+
+	/* Fall back to reader threads */
+	if (numThreads == 0 || numThreads > AIO_MAX_THREADS)
+		return NULL;
+	as->batchSize = 0;
+	as->batchNext = 0;
+	as->batchDone = 0;
+	as->shutdown = 0;
+	if (pthread_mutex_init(&as->lock, NULL) != 0)
+		return NULL;
+	pthread_cond_init(&as->workReady, NULL);
+	pthread_cond_init(&as->workDone, NULL);
+	for ( ; as->numThreads < numThreads; as->numThreads++)
+	{
+		if (pthread_create(&as->threads[as->numThreads], NULL, aioReader, as) != 0)
+		{
+			aioStopThreads(as);
+			return NULL;
+		}
+	}
+	return &as->posix.storage;
+}
+#endif
@@ -0,0 +1,417 @@
+/******************************************************************************/
+/**
+@file		dbstorage.h
+@author		Ramon Lawrence
+@brief		Storage device implementations for buffer page I/O.
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#ifndef DBSTORAGE_H
+#define DBSTORAGE_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "dbbuffer.h"
+
+#if !defined(ARDUINO)
+#include <pthread.h>
+#endif
+
+/* Storage using a stdio file (SD card file on Arduino). */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	SD_FILE	*file;					/* Open file for storing pages */
+} fileStorage;
+
+/* Storage using a pre-allocated memory region. Zero latency device. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	void	*memory;				/* Pre-allocated memory for pages */
+	uint32_t memorySize;			/* Size of memory in bytes */
+	id_t 	numPages;				/* Number of pages written (highest page id + 1) */
+} ramStorage;
+
+/**
+@brief     	Initializes storage on an open stdio file.
+@param     	fs
+                File storage structure
+@param     	file
+                File opened for reading and writing
+@return		Returns pointer to storage interface.
+*/
+dbstorage* fileStorageInit(fileStorage *fs, SD_FILE *file);
+
+/**
+@brief     	Initializes storage on a pre-allocated memory region. Memory is not freed on close.
+@param     	rs
+                RAM storage structure
+@param     	memory
+                Pre-allocated memory
+@param     	size
+                Size of memory in bytes
+@return		Returns pointer to storage interface.
+*/
+dbstorage* ramStorageInit(ramStorage *rs, void *memory, uint32_t size);
+
+/* Storage that maps logical pages to physical pages on a flash device. Every page write goes to a new physical page 
+   so the device is written sequentially and pages are never rewritten in place. Erase blocks with stale pages are 
+   reclaimed by garbage collection. The map is checkpointed to the device on sync and before an erase block is reused. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	dbstorage *device;				/* Flash device storing physical pages */
+	id_t	*map;					/* Physical page of each logical page or DBBUFFER_EMPTY. Allocated with numLogical entries. */
+	id_t	numLogical;				/* Maximum number of logical pages */
+	id_t	logicalSize;			/* Highest mapped logical page + 1 */
+	count_t	*blockValid;			/* Number of valid pages in each erase block. High bit set if block had valid pages at last checkpoint. Allocated with numBlocks entries. */
+	count_t	numBlocks;				/* Number of erase blocks on device */
+	count_t	pagesPerBlock;			/* Number of pages in an erase block */
+	count_t	checkpointBlocks;		/* Number of blocks in each of the two checkpoint areas */
+	count_t	currentBlock;			/* Erase block being written */
+	count_t	nextPage;				/* Next page to write in current block */
+	void	*buffer;				/* Page buffer for garbage collection and checkpoints */
+	uint32_t checkpointSeq;			/* Sequence number of last checkpoint */
+	int8_t	mapChanged;				/* 1 if map changed since last checkpoint */
+	id_t	numErases;				/* Number of erase blocks erased */
+	id_t	numRelocations;			/* Number of valid pages copied by garbage collection */
+	id_t	numCheckpoints;			/* Number of checkpoints written */
+} flashStorage;
+
+/**
+@brief     	Initializes flash storage that writes every page update to a new physical page. 
+			Recovers logical to physical page map from last checkpoint on device.
+@param     	fs
+                Flash storage structure
+@param     	device
+                Flash device storing physical pages
+@param     	pageSize
+                Page size. Must be same as buffer page size.
+@param     	pagesPerBlock
+                Number of pages in an erase block (less than 32768)
+@param     	numBlocks
+                Number of erase blocks on device
+@param     	map
+                Pre-allocated map with numLogical entries
+@param     	numLogical
+                Maximum number of logical pages
+@param     	blockValid
+                Pre-allocated array with numBlocks entries
+@param     	buffer
+                Pre-allocated page buffer
+@return		Returns pointer to storage interface or NULL if device is too small.
+*/
+dbstorage* flashStorageInit(flashStorage *fs, dbstorage *device, count_t pageSize, count_t pagesPerBlock, count_t numBlocks, 
+							id_t *map, id_t numLogical, count_t *blockValid, void *buffer);
+
+/* Timing and erase model of a simulated storage device. Times are in microseconds. */
+typedef struct {
+	uint32_t readTime;				/* Page read at random location */
+	uint32_t seqReadTime;			/* Page read following previous page read */
+	uint32_t writeTime;				/* Page write at random location */
+	uint32_t seqWriteTime;			/* Page write following previous page write */
+	uint32_t partialWriteTime;		/* Write of part of a page */
+	uint32_t eraseTime;				/* Erase of one erase block */
+	uint32_t syncTime;				/* Flush of device write cache */
+	count_t	pagesPerBlock;			/* Number of pages in an erase block. 0 if device erases internally (SD card). */
+	uint8_t	maxPageWrites;			/* Number of writes (full or partial) allowed to a page between erases. Rewriting page after limit erases its block. */
+} simModel;
+
+/* Example models. Calibrate with measurements of actual device. */
+#define SIM_MODEL_SD_CARD	{ 1200, 600, 2500, 900, 2500, 0, 5000, 0, 0 }			/* SD card on SPI bus with internal controller */
+#define SIM_MODEL_NOR_FLASH	{ 150, 120, 2000, 2000, 600, 45000, 0, 8, 4 }			/* Raw serial NOR flash with 4 KB erase blocks */
+
+/* Storage that simulates the time and wear of a device. Page data is kept by another storage (usually RAM or file). 
+   Simulation is deterministic so results are the same for every run. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	dbstorage *device;				/* Storage holding page data */
+	simModel model;					/* Device model */
+	id_t	numPages;				/* Number of pages on device. Required for erase model. */
+	uint8_t	*pageWrites;			/* Number of writes to each page since its block was erased. Allocated with numPages entries. NULL disables erase model. */
+	uint32_t *blockErases;			/* Number of erases of each block. Allocated with numPages/pagesPerBlock entries. May be NULL. */
+	id_t	lastRead;				/* Last page read */
+	id_t	lastWrite;				/* Last page written */
+	uint64_t time;					/* Simulated device time in microseconds */
+	id_t	numReads;				/* Number of pages read */
+	id_t	numWrites;				/* Number of full pages written */
+	id_t	numPartialWrites;		/* Number of partial page writes */
+	id_t	numErases;				/* Number of blocks erased by erase requests */
+	id_t	numImplicitErases;		/* Number of blocks erased to rewrite a page in place */
+	uint32_t maxBlockErases;		/* Highest erase count of any block */
+} simStorage;
+
+/**
+@brief     	Initializes storage that simulates time and wear of a device.
+@param     	ss
+                Simulated storage structure
+@param     	device
+                Storage holding page data
+@param     	model
+                Device model. Copied into simulated storage.
+@param     	numPages
+                Number of pages on device. Pages past end are not included in erase model.
+@param     	pageWrites
+                Pre-allocated array with numPages entries or NULL to disable erase model
+@param     	blockErases
+                Pre-allocated array with one entry per erase block or NULL if wear per block is not tracked
+@return		Returns pointer to storage interface.
+*/
+dbstorage* simStorageInit(simStorage *ss, dbstorage *device, simModel *model, id_t numPages, uint8_t *pageWrites, uint32_t *blockErases);
+
+/* Size of block of a raw block device */
+#define BLOCK_STORAGE_BLOCK_SIZE	512
+
+/* Reads or writes consecutive blocks of a raw block device. Returns 0 if success. */
+typedef int8_t (*blockIo)(void *device, uint32_t block, uint32_t numBlocks, void *buffer);
+
+/* Storage on a region of a raw block device (SD card without file system). Page size must be a multiple of BLOCK_STORAGE_BLOCK_SIZE. 
+   First block of region holds number of blocks used. Page i is stored in the blocks following it. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	void	*device;				/* Block device passed to readBlocks and writeBlocks */
+	blockIo	readBlocks;				/* Reads blocks */
+	blockIo	writeBlocks;			/* Writes blocks */
+	uint32_t firstBlock;			/* First block of region */
+	uint32_t numBlocks;				/* Number of blocks in region */
+	uint32_t usedBlocks;			/* Number of blocks after first block holding pages */
+	uint32_t savedBlocks;			/* Number of blocks used as stored in first block */
+	void	*buffer;				/* Buffer of BLOCK_STORAGE_BLOCK_SIZE bytes for partial page writes */
+} blockStorage;
+
+/**
+@brief     	Initializes storage on a region of a raw block device. Region is opened if its first block 
+			holds a valid header. Otherwise it is formatted as empty.
+@param     	bs
+                Block storage structure
+@param     	device
+                Block device (Sd2Card on Arduino or disk image)
+@param     	readBlocks
+                Function that reads blocks from device
+@param     	writeBlocks
+                Function that writes blocks to device
+@param     	firstBlock
+                First block of region on device
+@param     	numBlocks
+                Number of blocks in region
+@param     	buffer
+                Pre-allocated buffer of BLOCK_STORAGE_BLOCK_SIZE bytes
+@param     	format
+                1 to format region as empty even if it holds a valid header
+@return		Returns pointer to storage interface or NULL if error.
+*/
+dbstorage* blockStorageInit(blockStorage *bs, void *device, blockIo readBlocks, blockIo writeBlocks, 
+				uint32_t firstBlock, uint32_t numBlocks, void *buffer, int8_t format);
+
+#if !defined(ARDUINO)
+/* Storage using a POSIX file descriptor. Pages are accessed with pread/pwrite at 64-bit offsets. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	int		fd;						/* Open file descriptor */
+} posixStorage;
+
+/**
+@brief     	Initializes storage on an open POSIX file descriptor.
+@param     	ps
+                POSIX storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@return		Returns pointer to storage interface.
+*/
+dbstorage* posixStorageInit(posixStorage *ps, int fd);
+
+/**
+@brief     	Reads blocks from a disk image file standing in for a raw block device.
+@param     	device
+                Pointer to file descriptor of disk image
+@param     	block
+                First block to read
+@param     	numBlocks
+                Number of blocks
+@param     	buffer
+                Buffer for blocks
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t imageReadBlocks(void *device, uint32_t block, uint32_t numBlocks, void *buffer);
+
+/**
+@brief     	Writes blocks to a disk image file standing in for a raw block device.
+@param     	device
+                Pointer to file descriptor of disk image
+@param     	block
+                First block to write
+@param     	numBlocks
+                Number of blocks
+@param     	buffer
+                Buffer holding blocks
+@return		Returns 0 if success. -1 if failure.
+*/
+int8_t imageWriteBlocks(void *device, uint32_t block, uint32_t numBlocks, void *buffer);
+
+/* Storage using a POSIX file descriptor opened with O_DIRECT so pages bypass the OS page cache and 
+   the buffer is the only cache. Buffers, offsets and sizes must be aligned. Unaligned buffers and 
+   partial page writes are copied through an aligned page. */
+typedef struct {
+	posixStorage posix;				/* POSIX storage used for aligned I/O. Must be first. */
+	uint32_t alignment;				/* Alignment of buffers, offsets and sizes required by device */
+	void	*page;					/* Aligned buffer of one page for unaligned I/O */
+} directStorage;
+
+/**
+@brief     	Returns alignment required for direct I/O on a file. Uses the direct I/O alignment 
+			reported by the file system if available, otherwise the block size of the file.
+@param     	fd
+                File descriptor
+@return		Returns alignment in bytes or 0 if error.
+*/
+uint32_t directStorageAlignment(int fd);
+
+/**
+@brief     	Allocates memory aligned for direct I/O. Used for buffer pages (dbbuffer->buffer). Free with free().
+@param     	size
+                Number of bytes
+@param     	alignment
+                Alignment in bytes. Power of two.
+@return		Returns pointer to memory or NULL if error.
+*/
+void* directStorageAlloc(size_t size, uint32_t alignment);
+
+/**
+@brief     	Initializes direct I/O storage on an open POSIX file descriptor. Enables O_DIRECT on the file.
+@param     	ds
+                Direct storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	pageSize
+                Page size of buffer. Must be a multiple of alignment.
+@param     	alignment
+                Alignment required by device or 0 to use directStorageAlignment()
+@param     	page
+                Buffer of pageSize bytes allocated with directStorageAlloc()
+@return		Returns pointer to storage interface or NULL if direct I/O is not supported or page size is not aligned.
+*/
+dbstorage* directStorageInit(directStorage *ds, int fd, count_t pageSize, uint32_t alignment, void *page);
+
+/* Sync policies for memory-mapped storage */
+#define MMAP_SYNC_NONE		0		/* Pages written back by OS or on sync() */
+#define MMAP_SYNC_ASYNC		1		/* Schedule write back (MS_ASYNC) after every write */
+#define MMAP_SYNC_WRITE		2		/* Wait for write back (MS_SYNC) after every write */
+
+/* Storage using a memory-mapped file. Pages are read directly from the mapping without copying. */
+typedef struct {
+	dbstorage storage;				/* Storage interface. Must be first. */
+	int		fd;						/* Open file descriptor */
+	void	*map;					/* Start of mapping */
+	size_t	mapSize;				/* Size of address space reserved for mapping. Maximum file size. */
+	size_t	allocSize;				/* Current file size. File is grown in extents. */
+	size_t	length;					/* Bytes of file containing pages */
+	size_t	extentSize;				/* Number of bytes to grow file by */
+	int8_t	syncPolicy;				/* One of MMAP_SYNC_* */
+} mmapStorage;
+
+/**
+@brief     	Initializes storage on a memory-mapped file. Address space for the maximum file size is reserved
+			up front so that page pointers remain valid as the file grows.
+@param     	ms
+                Memory-mapped storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	maxSize
+                Maximum file size in bytes
+@param     	extentSize
+                Number of bytes to grow file by when writing past its end
+@param     	syncPolicy
+                One of MMAP_SYNC_*
+@return		Returns pointer to storage interface or NULL if mapping failed.
+*/
+dbstorage* mmapStorageInit(mmapStorage *ms, int fd, size_t maxSize, size_t extentSize, int8_t syncPolicy);
+
+/* Modes for asynchronous storage */
+#define AIO_MODE_AUTO		0		/* io_uring if available, otherwise reader threads */
+#define AIO_MODE_THREADS	1		/* Always use reader threads */
+
+/* Maximum number of reader threads */
+#define AIO_MAX_THREADS		16
+
+/* Storage using a POSIX file descriptor that reads batches of pages asynchronously. 
+   Batches are submitted to io_uring on Linux or otherwise read in parallel by a pool of reader threads. */
+typedef struct {
+	posixStorage posix;				/* POSIX storage used for all other operations. Must be first. */
+	int		ringFd;					/* io_uring file descriptor or -1 if using reader threads */
+	uint32_t ringEntries;			/* Number of submission queue entries */
+	void	*sqRing;				/* Mapped submission queue ring */
+	size_t	sqRingSize;
+	void	*cqRing;				/* Mapped completion queue ring. May be same mapping as submission ring. */
+	size_t	cqRingSize;
+	void	*sqes;					/* Mapped submission queue entries */
+	size_t	sqesSize;
+	uint32_t *sqTail, *sqMask, *sqArray;	/* Submission ring fields */
+	uint32_t *cqHead, *cqTail, *cqMask;		/* Completion ring fields */
+	void	*cqes;					/* Completion queue entries */
+	uint8_t	numThreads;				/* Number of reader threads. 0 if using io_uring. */
+	pthread_t threads[AIO_MAX_THREADS];
+	pthread_mutex_t lock;			/* Protects batch state */
+	pthread_cond_t workReady;		/* Signalled when batch submitted or shutting down */
+	pthread_cond_t workDone;		/* Signalled when last page of batch read */
+	id_t	*batchPages;			/* Current batch */
+	count_t	*batchFrames;
+	void	*batchBuffer;
+	count_t	batchSize;
+	count_t	batchNext;				/* Next page of batch to start reading */
+	count_t	batchDone;				/* Number of pages of batch read */
+	int8_t	batchError;
+	int8_t	shutdown;
+} aioStorage;
+
+/**
+@brief     	Initializes storage on an open POSIX file descriptor that reads batches of pages asynchronously.
+@param     	as
+                Asynchronous storage structure
+@param     	fd
+                File descriptor opened for reading and writing
+@param     	queueDepth
+                Maximum number of reads in flight
+@param     	numThreads
+                Number of reader threads if io_uring is not used (1 to AIO_MAX_THREADS)
+@param     	mode
+                One of AIO_MODE_*
+@return		Returns pointer to storage interface or NULL if neither io_uring nor reader threads could be started.
+*/
+dbstorage* aioStorageInit(aioStorage *as, int fd, uint32_t queueDepth, uint8_t numThreads, int8_t mode);
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+/******************************************************************************/
+/**
+@file		sd_raw_c_iface.cpp
+@author		Ramon Lawrence
+@brief		Raw block I/O on an Arduino SD card for block storage.
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#include "sd_raw_c_iface.h"
+
+#if defined(ARDUINO)
+
+#include <SPI.h>
+#include <SD.h>
+
+int8_t
+sd_raw_read_blocks(
+	void		*device,
+	uint32_t	block,
+	uint32_t	numBlocks,
+	void		*buffer
+) {
+	Sd2Card *card	= (Sd2Card *) device;
+	uint8_t *dst	= (uint8_t *) buffer;
+
+	for (uint32_t i = 0; i < numBlocks; i++) {
+		if (!card->readBlock(block + i, dst)) {
+			return -1;
+		}
+
+		dst += 512;
+	}
+
+	return 0;
+}
+
+int8_t
+sd_raw_write_blocks(
+	void		*device,
+	uint32_t	block,
+	uint32_t	numBlocks,
+	void		*buffer
+) {
+	Sd2Card *card	= (Sd2Card *) device;
+	uint8_t *src	= (uint8_t *) buffer;
+
+	if (1 == numBlocks) {
+		return card->writeBlock(block, src) ? 0 : -1;
+	}
+
+	/* Pre-erase count lets the card allocate all blocks for one write command. */
+	if (!card->writeStart(block, numBlocks)) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < numBlocks; i++) {
+		if (!card->writeData(src)) {
+			return -1;
+		}
+
+		src += 512;
+	}
+
+	return card->writeStop() ? 0 : -1;
+}
+
+uint32_t
+sd_raw_num_blocks(
+	void *device
+) {
+	return ((Sd2Card *) device)->cardSize();
+}
+
+#endif /* ARDUINO */
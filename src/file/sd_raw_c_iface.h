@@ -0,0 +1,106 @@
+/******************************************************************************/
+/**
+@file		sd_raw_c_iface.h
+@author		Ramon Lawrence
+@brief		Raw block I/O on an Arduino SD card for block storage.
+@copyright	Copyright 2021
+			The University of British Columbia,	
+			Ramon Lawrence	
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#if !defined(SD_RAW_C_IFACE_H_)
+#define SD_RAW_C_IFACE_H_
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+@brief		Reads consecutive 512 byte blocks from an SD card.
+@param		device
+				A pointer to an initialized Sd2Card object.
+@param		block
+				The first block to read.
+@param		numBlocks
+				The number of blocks to read.
+@param		buffer
+				The buffer to read the blocks into.
+@returns	@c 0 on success, @c -1 on failure.
+*/
+int8_t
+sd_raw_read_blocks(
+	void		*device,
+	uint32_t	block,
+	uint32_t	numBlocks,
+	void		*buffer
+);
+
+/**
+@brief		Writes consecutive 512 byte blocks to an SD card. More than
+			one block is written with a single multiple block write command.
+@param		device
+				A pointer to an initialized Sd2Card object.
+@param		block
+				The first block to write.
+@param		numBlocks
+				The number of blocks to write.
+@param		buffer
+				The buffer holding the blocks.
+@returns	@c 0 on success, @c -1 on failure.
+*/
+int8_t
+sd_raw_write_blocks(
+	void		*device,
+	uint32_t	block,
+	uint32_t	numBlocks,
+	void		*buffer
+);
+
+/**
+@brief		Returns the number of 512 byte blocks on an SD card.
+@param		device
+				A pointer to an initialized Sd2Card object.
+@returns	The number of blocks or @c 0 if it cannot be determined.
+*/
+uint32_t
+sd_raw_num_blocks(
+	void *device
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* ARDUINO */
+
+#endif /* SD_RAW_C_IFACE_H_ */
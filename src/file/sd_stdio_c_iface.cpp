@@ -200,6 +200,47 @@ sd_fread(
 	return num_bytes / size;
 }
 
+/**
+@brief		Writes zeros at the current position of an Arduino SD file.
+@details	The first write ends on a block boundary so that the remaining
+			writes are whole aligned blocks.
+@param		stream
+				A pointer to a C file struct type associated with an SD
+				file object.
+@param		num_bytes
+				The number of zero bytes to write.
+@returns	The number of bytes written.
+*/
+static unsigned long
+sd_fzero(
+	SD_FILE			*stream,
+	unsigned long	num_bytes
+) {
+	uint8_t			zeros[SD_ZERO_BLOCK_SIZE];
+	unsigned long	total	= 0;
+	size_t			len		= SD_ZERO_BLOCK_SIZE - stream->f.position() % SD_ZERO_BLOCK_SIZE;
+
+	memset(zeros, 0, sizeof(zeros));
+
+	while (total < num_bytes) {
+		if (len > num_bytes - total) {
+			len = num_bytes - total;
+		}
+
+		size_t written = stream->f.write(zeros, len);
+
+		total += written;
+
+		if (written != len) {
+			break;
+		}
+
+		len = SD_ZERO_BLOCK_SIZE;
+	}
+
+	return total;
+}
+
 int
 sd_fseek(
 	SD_FILE				*stream,
@@ -228,8 +269,7 @@ sd_fseek(
 				}
 
 				unsigned long	bytes_to_pad	= offset - cur_end;
-				char			payload			= 0x0;
-				size_t			num_written		= sd_fwrite(&payload, sizeof(payload), bytes_to_pad, stream);
+				unsigned long	num_written		= sd_fzero(stream, bytes_to_pad);
 
 				if (num_written != bytes_to_pad) {
 					return -1;
@@ -250,8 +290,7 @@ sd_fseek(
 				}
 
 				unsigned long	bytes_to_pad	= (offset + cur_pos) - cur_end;
-				char			payload			= 0x0;
-				size_t			num_written		= sd_fwrite(&payload, sizeof(payload), bytes_to_pad, stream);
+				unsigned long	num_written		= sd_fzero(stream, bytes_to_pad);
 
 				if (num_written != bytes_to_pad) {
 					return -1;
@@ -276,8 +315,7 @@ sd_fseek(
 				}
 
 				unsigned long	bytes_to_pad	= offset;
-				char			payload			= 0x0;
-				size_t			num_written		= sd_fwrite(&payload, sizeof(payload), bytes_to_pad, stream);
+				unsigned long	num_written		= sd_fzero(stream, bytes_to_pad);
 
 				if (num_written != bytes_to_pad) {
 					return -1;
@@ -296,6 +334,35 @@ sd_fseek(
 	}
 }
 
+int
+sd_fpreallocate(
+	SD_FILE				*stream,
+	unsigned long int	length
+) {
+	if (NULL == stream) {
+		return -1;
+	}
+
+	unsigned long	cur_pos = stream->f.position();
+	unsigned long	cur_end = stream->f.size();
+
+	if (length <= cur_end) {
+		return 0;
+	}
+
+	if (!stream->f.seek(cur_end)) {
+		return -1;
+	}
+
+	unsigned long num_written = sd_fzero(stream, length - cur_end);
+
+	if (!stream->f.seek(cur_pos) || (num_written != length - cur_end)) {
+		return -1;
+	}
+
+	return 0;
+}
+
 long int
 sd_ftell(
 	SD_FILE *stream
@@ -316,27 +383,14 @@ sd_fwrite(
 	size_t	nmemb,
 	SD_FILE *stream
 ) {
-	size_t	idx;
-	size_t	bytes_written	= 0;
-	size_t	total_count		= 0;
-
-	/* for each element, continue to write */
-	for (idx = 0; idx < nmemb; idx++) {
-		bytes_written = stream->f.write((uint8_t *) ptr, size);
-
-		if (bytes_written != size) {
-			return total_count;
-		}
-
-		total_count += 1;
+	if (0 == size) {
+		return 0;
 	}
 
-	if (total_count != nmemb) {
-		return -1;
-	}
-	else {
-		return total_count;
-	}
+	/* All elements are written in one call so whole blocks go to the card together */
+	size_t bytes_written = stream->f.write((uint8_t *) ptr, size * nmemb);
+
+	return bytes_written / size;
 }
 
 int
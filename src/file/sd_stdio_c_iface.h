@@ -48,6 +48,13 @@
 extern "C" {
 #endif
 
+/* Size of zero-filled block written when a file is extended. Writes are aligned to this size.
+   sd_fzero() keeps a block of this size on the stack while it runs (512 bytes of the 8 KB on an ATmega2560).
+   A smaller size (such as 64) reduces stack use, but writes are then no longer whole SD blocks. */
+#if !defined(SD_ZERO_BLOCK_SIZE)
+#define SD_ZERO_BLOCK_SIZE	512
+#endif
+
 /* Redefine stdio.h functions for operation on Arduino SD card. */
 #define  fopen(x, y)		sd_fopen(x, y)
 #define  fclose(x)			sd_fclose(x)
@@ -185,6 +192,27 @@ sd_fseek(
 	int					whence
 );
 
+/**
+@brief		Extends an Arduino SD file to at least a given size so that
+			later writes within that size do not allocate clusters.
+@details	The SD library cannot allocate clusters without writing them,
+			so the file is extended by writing zero blocks in one pass.
+			Clusters allocated together are contiguous if the free space
+			on the card is not fragmented. The file position is not changed.
+@param		stream
+				A pointer to a C file struct type associated with an SD
+				file object.
+@param		length
+				The file size in bytes to reserve. A smaller file is not
+				truncated.
+@returns	@c 0 for success, a non-zero integer otherwise.
+*/
+int
+sd_fpreallocate(
+	SD_FILE				*stream,
+	unsigned long int	length
+);
+
 /**
 @brief		Set the current position of an Arduino SD file.
 @details	The parameter @pos should be retrieved using fgetpos.
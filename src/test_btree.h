@@ -35,169 +35,1702 @@
 /******************************************************************************/
 #include <time.h>
 #include <string.h>
+#if !defined(ARDUINO)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "btree.h"
+#include "dbstorage.h"
 #include "randomseq.h"
 
+/**
+ * Opens file storage on myfile.bin. Mode "w+b" starts with an empty file. Mode "r+b" opens the existing file.
+ * Returns NULL if file cannot be opened.
+ */
+dbstorage* testFileStorage(fileStorage *fs, const char *mode)
+{
+    SD_FILE *fp;
+    fp = fopen("myfile.bin", mode);
+    if (NULL == fp) {
+        printf("Error: Can't open file!\n");
+        return NULL;
+    }
+    return fileStorageInit(fs, fp);
+}
+
+/**
+ * Allocates a buffer of M frames on storage with the given replacement policy and a B-tree state for 4 byte keys and 12 byte data.
+ * Other buffer options are off. They may be changed before calling btreeInit or btreeRecover.
+ * Returns NULL if storage is NULL or allocation fails.
+ */
+btreeState* testOpenTree(dbstorage *storage, uint8_t policy, count_t M)
+{
+    if (storage == NULL)
+        return NULL;
+
+    /* Configure buffer */
+    dbbuffer* buffer = (dbbuffer*) malloc(sizeof(dbbuffer));
+    btreeState* state = (btreeState*) malloc(sizeof(btreeState));
+    if (buffer == NULL || state == NULL)
+    {   printf("Failed to allocate buffer or B-tree state struct.\n");
+        free(buffer);
+        free(state);
+        return NULL;
+    }
+    buffer->pageSize = 512;
+    buffer->numPages = M;
+    buffer->status = (id_t*) malloc(sizeof(id_t)*M);
+    buffer->frames = (dbframe*) malloc(sizeof(dbframe)*M);
+    buffer->buffer  = malloc((size_t) buffer->numPages * buffer->pageSize);   
+    buffer->storage = storage;
+    buffer->maxDirty = 0;       /* Write-through. Set to at most M for write-back. */
+    buffer->hashTable = NULL;   /* Buffer is small enough to scan. Use a hash table for large buffers. */
+    buffer->policy = policy;
+    buffer->numPrefetch = 0;    /* Frames reserved for iterator read-ahead. At most M-2. */
+    buffer->numScan = 0;        /* Frames reserved for leaves read by iterators. 0 inserts them at cold end of replacement order. */
+    buffer->appendSize = 0;     /* Pages staged before writing appended pages. Requires appendBuffer. */
+    buffer->superblock = NULL;  /* Superblock for fast recovery. Point to dbsuperblock struct to enable. */
+    buffer->reserveSize = 0;    /* Pages of file space reserved ahead of writes when file is extended */
+    buffer->syncPolicy = DBBUFFER_SYNC_NONE;    /* Sync after every operation, every syncInterval ms, or every syncInterval operations */
+
+    /* Configure btree state */
+    state->recordSize = 16;
+    state->keySize = 4;
+    state->dataSize = 12;       
+    state->buffer = buffer;
+    state->tempKey = malloc(state->keySize); 
+    state->tempData = malloc(state->dataSize);          	
+
+    if (buffer->status == NULL || buffer->frames == NULL || buffer->buffer == NULL || state->tempKey == NULL || state->tempData == NULL)
+    {   printf("Failed to allocate buffer.\n");
+        free(buffer->status);
+        free(buffer->frames);
+        free(buffer->buffer);
+        free(state->tempKey);
+        free(state->tempData);
+        free(buffer);
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Closes buffer and its storage and frees buffer and B-tree state allocated by testOpenTree.
+ * Returns result of closeBuffer.
+ */
+int8_t testCloseTree(btreeState *state)
+{
+    dbbuffer *buffer = state->buffer;
+
+    int8_t result = closeBuffer(buffer);    
+    free(state->tempKey);
+    free(state->tempData);
+    free(buffer->status);
+    free(buffer->frames);
+    free(buffer->buffer);
+    free(buffer);
+    free(state);
+    return result;
+}
+
+
+void testIterator(btreeState *state, void *recordBuffer)
+{
+     /* Below minimum key search */
+    int32_t key = -1;
+    int8_t result = btreeGet(state, &key, recordBuffer);
+    if (result == 0) 
+        printf("Error1: Key found: %li\n", key);
+
+    /* Above maximum key search */
+    key = 3500000;
+    result = btreeGet(state, &key, recordBuffer);
+    if (result == 0) 
+        printf("Error2: Key found: %li\n", key);
+    
+    free(recordBuffer);
+    
+    btreeIterator it;
+    uint32_t mv = 40;     // For all records, select mv = 1.
+    it.minKey = &mv;
+    int v = 299;
+    it.maxKey = &v;       
+
+    // btreePrint(state); 
+
+    btreeInitIterator(state, &it);
+    uint32_t i = 0;
+    int8_t success = 1;    
+    uint32_t *itKey, *itData;
+
+    while (btreeNext(state, &it, (void**) &itKey, (void**) &itData))
+    {                      
+        // printf("Key: %d  Data: %d\n", *itKey, *itData);
+        if (i+mv != *itKey)
+        {   success = 0;
+            printf("Key: %lu Error\n", *itKey);
+        }
+        i++;        
+    }
+    printf("\nRead records: %lu\n", i);
+
+    if (success && i == (v-mv+1))
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE\n");           
+}
+
+/**
+ * Returns number of nodes in subtree rooted at node pageNum by reading every node. Depth of root is 0.
+ */
+id_t testCountNodes(btreeState *state, id_t pageNum, int8_t depth)
+{
+    void *buf = readPage(state->buffer, pageNum);
+    if (buf == NULL)
+        return 0;
+    if (depth == state->levels-1)
+        return 1;
+
+    id_t child, total = 1;
+    count_t count = BTREE_GET_COUNT(buf);
+    for (count_t c = 0; c <= count; c++)
+    {
+        memcpy(&child, buf + state->headerSize + state->keySize * state->maxInteriorRecordsPerPage + c*sizeof(id_t), sizeof(id_t));
+        if (c == count && child == 0)
+            break;      /* Last child is not used */
+        total += testCountNodes(state, child, depth+1);
+
+        /* Node may have been replaced in buffer while reading child */
+        buf = readPage(state->buffer, pageNum);
+        if (buf == NULL)
+            return total;
+    }
+    return total;
+}
+
+void testRecovery()
+{
+    srand(3);
+    randomseqState rnd;
+    rnd.size = 1000;
+    uint32_t n = rnd.size; 
+    rnd.prime = 0;
+    uint32_t end, i, errors = 0;
+
+    /* Open existing file. Must run main test first to generate it. */
+    fileStorage fs;
+    btreeState *state = testOpenTree(testFileStorage(&fs, "r+b"), DBBUFFER_POLICY_ROUNDROBIN, 3);
+    if (state == NULL)
+        return;
+    state->buffer->maxDirty = 3;
+
+    int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);    	
+
+    /* Initialize btree structure with parameters */
+    btreeRecover(state);
+        
+    /* Data record is empty. Only need to reset to 0 once as reusing struct. */        
+    for (i = 0; i < (uint16_t) (state->recordSize-4); i++) // 4 is the size of the key
+    {
+        recordBuffer[i + sizeof(int32_t)] = 0;
+    }
+
+    unsigned long start = millis();   
+
+    
+    printf("\nVerifying and searching for all values.\n");
+    start = millis();
+
+    srand(3);
+    randomseqInit(&rnd);
+
+    /* Verify that can find all values inserted */    
+    for (i = 1; i <= n; i++) 
+    { 
+        int32_t key = randomseqNext(&rnd);
+        int8_t result = btreeGet(state, &key, recordBuffer);
+        if (result != 0) 
+        {   errors++;
+            printf("ERROR: Failed to find: %li\n", key);
+            btreeGet(state, &key, recordBuffer);
+        }
+        else if (*((int32_t*) recordBuffer) != key)
+        {   printf("ERROR: Wrong data for: %li\n", key);
+            printf("Key: %lu Data: %lu\n", key, *((int32_t*) recordBuffer));
+        }       
+    }
+
+    id_t nodes = testCountNodes(state, state->activePath[0], 0);
+    if (nodes != state->numNodes)
+    {   errors++;
+        printf("ERROR: Node count is %lu but tree has %lu nodes\n", state->numNodes, nodes);
+    }
+
+    if (errors > 0)
+        printf("FAILURE: Errors: %lu\n", errors);
+    else
+        printf("SUCCESS. All values found!\n");
+    
+    end = millis();
+    printf("Elapsed Time: %lu s\n", (end - start));
+    printf("Records queried: %lu\n", n);   
+    printStats(state->buffer);     
+
+    testCloseTree(state);
+
+    /* Recover B-tree with superblock. Close writes a clean superblock. After recovery, records are added with pages
+       written through and buffer is closed without writing a clean superblock so recovery starts from a dirty superblock. */
+    dbsuperblock sb;
+    uint32_t numAdd = 5;
+    id_t numFree = 1;
+    void *page = calloc(1, 512);
+    errors = 0;
+    for (uint8_t step = 0; step < 3 && page != NULL; step++)
+    {
+        state = testOpenTree(testFileStorage(&fs, step == 0 ? "w+b" : "r+b"), DBBUFFER_POLICY_ROUNDROBIN, 3);
+        if (state == NULL)
+        {   errors++;
+            break;
+        }
+        state->buffer->superblock = &sb;
+        if (step == 0)
+        {   /* Page written after the B-tree and freed is not a node */
+            btreeInit(state);
+            for (int32_t key = 0; key < (int32_t) n; key++)
+            {
+                *((int32_t*) recordBuffer) = key;
+                *((int32_t*) (recordBuffer+4)) = key;
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+            if (dbbufferFreePage(state->buffer, writePage(state->buffer, page)) != 0 || state->buffer->numFree != numFree)
+            {   errors++;
+                printf("ERROR: Free pages: %lu\n", state->buffer->numFree);
+            }
+        }
+        else
+        {
+            btreeRecover(state);
+            if (state->buffer->superblock == NULL || sb.clean != (step == 1) || state->buffer->numFree != numFree)
+            {   errors++;
+                printf("ERROR: Superblock clean: %d  Free pages: %lu\n", sb.clean, state->buffer->numFree);
+            }
+        }
+
+        uint32_t numKeys = n + (step == 2 ? numAdd : 0);
+        for (int32_t key = 0; key < (int32_t) numKeys; key++)
+        {
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %li\n", key);
+            }
+        }
+        nodes = testCountNodes(state, state->activePath[0], 0);
+        printf("%s: Nodes: %lu  Counted: %lu  Levels: %d\n", step == 0 ? "Created" : (step == 1 ? "Clean superblock" : "Dirty superblock"), 
+            state->numNodes, nodes, state->levels);
+        if (nodes != state->numNodes)
+        {   errors++;
+            printf("ERROR: Node count is %lu but tree has %lu nodes\n", state->numNodes, nodes);
+        }
+
+        if (step == 1)
+        {
+            for (int32_t key = n; key < (int32_t) (n + numAdd); key++)
+            {
+                *((int32_t*) recordBuffer) = key;
+                *((int32_t*) (recordBuffer+4)) = key;
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+            numFree = state->buffer->numFree;       /* Free page is reused if a leaf is split */
+            state->buffer->superblock = NULL;       /* Pages are written through. Close without writing clean superblock. */
+        }
+        testCloseTree(state);
+    }
+    free(page);
+    free(recordBuffer);
+
+    if (errors > 0)
+        printf("FAILURE: Errors: %lu\n", errors);
+    else
+        printf("SUCCESS. Recovered with clean and dirty superblock.\n");
+}
+
+/**
+ * Looks up keys in a small range, closes the B-tree with a superblock, and recovers it.
+ * Checks that the pages buffered at close are read back on recovery so the same lookups need no reads.
+ */
+void testWarmRecovery()
+{
+    int8_t M = 16;
+    uint32_t i, n = 3000, numHot = 50, errors = 0;
+    int8_t* recordBuffer = NULL;
+
+    for (uint8_t reopen = 0; reopen < 2; reopen++)
+    {
+        fileStorage fs;
+        dbsuperblock sb;
+        btreeState *state = testOpenTree(testFileStorage(&fs, reopen ? "r+b" : "w+b"), DBBUFFER_POLICY_LRU, M);
+        if (state == NULL)
+            break;
+        dbbuffer *buffer = state->buffer;
+        buffer->superblock = &sb;
+        recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+
+        if (!reopen)
+        {
+            btreeInit(state);
+            srand(1);
+            randomseqState rnd;
+            rnd.size = n;
+            rnd.prime = 0;
+            randomseqInit(&rnd);
+            for (i = 0; i < n; i++)
+            {
+                uint32_t key = randomseqNext(&rnd);
+                memcpy(recordBuffer, &key, sizeof(uint32_t));
+                memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+        }
+        else
+            btreeRecover(state);
+
+        /* Lookups after recovery are all buffer hits */
+        id_t r0 = buffer->numReads, h0 = buffer->bufferHits;
+        for (int32_t key = 0; key < (int32_t) numHot; key++)
+        {
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %lu\n", key);
+            }
+        }
+        printf("%s: Lookup reads: %lu  Hits: %lu\n", reopen ? "Recovered" : "Created", buffer->numReads - r0, buffer->bufferHits - h0);
+        if (reopen && (buffer->numReads != r0 || buffer->superblock == NULL))
+        {   errors++;
+            printf("ERROR: Lookups after recovery needed %lu reads\n", buffer->numReads - r0);
+        }
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
+}
+
+/**
+ * Writes pages after the B-tree, frees them, and writes more pages. Checks that freed pages are reused without extending storage,
+ * that the remaining free pages are recovered from the free page list saved in the superblock, and that the B-tree is unchanged.
+ */
+void testFreePages()
+{
+    int8_t M = 4;
+    uint32_t i, n = 1000, numPages = 10, errors = 0;
+    id_t ids[10];
+    int8_t* recordBuffer = NULL;
+    void *page = malloc(512);
+    dbsuperblock sb;
+
+    for (uint8_t reopen = 0; reopen < 2 && page != NULL; reopen++)
+    {
+        fileStorage fs;
+        btreeState *state = testOpenTree(testFileStorage(&fs, reopen ? "r+b" : "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+            break;
+        dbbuffer *buffer = state->buffer;
+        buffer->superblock = &sb;
+        dbstorage *storage = buffer->storage;
+        recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+        memset(page, 0, 512);
+        uint32_t numReused = numPages / 2, numLeft = reopen ? 0 : numPages - numReused;
+
+        if (!reopen)
+        {
+            btreeInit(state);
+            for (i = 0; i < n; i++)
+            {
+                *((int32_t*) recordBuffer) = i;
+                *((int32_t*) (recordBuffer+4)) = i;
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+            for (i = 0; i < numPages; i++)
+                ids[i] = writePage(buffer, page);
+
+            /* Every other page is freed first */
+            for (i = 0; i < numPages; i++)
+            {
+                if (dbbufferFreePage(buffer, ids[(2*i) % numPages + (2*i) / numPages]) != 0)
+                    errors++;
+            }
+        }
+        else
+            btreeRecover(state);
+
+        /* Free pages are reused before storage is extended */
+        id_t size = storage->size(storage);
+        if (buffer->numFree != numReused + numLeft)
+        {   errors++;
+            printf("ERROR: Free pages: %lu  Expected: %lu\n", buffer->numFree, numReused + numLeft);
+        }
+        for (i = 0; i < numReused; i++)
+        {
+            id_t pageNum = writePage(buffer, page);
+            uint32_t j;
+            for (j = 0; j < numPages && ids[j] != pageNum; j++);
+            if (j == numPages)
+            {   errors++;
+                printf("ERROR: Page %lu written is not a free page\n", pageNum);
+            }
+            else
+                ids[j] = DBBUFFER_EMPTY;    /* Page is in use */
+        }
+        if (storage->size(storage) != size || buffer->numFree != numLeft)
+        {   errors++;
+            printf("ERROR: Storage grew from %lu to %lu pages. Free pages: %lu\n", size, storage->size(storage), buffer->numFree);
+        }
+        if (reopen && writePage(buffer, page) != (int32_t) size)
+        {   errors++;
+            printf("ERROR: Storage not extended when no free pages\n");
+        }
+
+        for (int32_t key = 0; key < (int32_t) n; key++)
+        {
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %li\n", key);
+            }
+        }
+        printf("%s: Pages: %lu  Free pages: %lu\n", reopen ? "Recovered" : "Created", storage->size(storage), buffer->numFree);
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+    free(page);
+
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
+}
+
+/**
+ * Compares buffer hit rate of each replacement policy for random inserts and for lookups of a small hot key range
+ * while a one-pass scan looks up keys across the whole tree. Checks that 2Q keeps the most hot leaves buffered,
+ * then LRU, then CLOCK, and that interior pages on the hot path stay buffered for all three.
+ */
+void testBufferPolicies()
+{
+    const char *names[] = {"Round robin", "CLOCK", "LRU", "2Q"};
+    int8_t M = 24;
+    uint32_t i, n = 10000, hotKeys = 40, scanStep = 20, hotEvery = 10, numHot = 5;
+    id_t hotReads[4];
+    int8_t success = 1;
+
+    for (uint8_t policy = DBBUFFER_POLICY_ROUNDROBIN; policy <= DBBUFFER_POLICY_2Q; policy++)
+    {
+        fileStorage fs;
+        btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), policy, M);
+        if (state == NULL)
+            return;
+        dbbuffer *buffer = state->buffer;
+        buffer->maxDirty = M;
+
+        btreeInit(state);
+
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);  
+        for (i = 0; i < (uint16_t) (state->recordSize-4); i++)
+            recordBuffer[i + sizeof(int32_t)] = 0;
+
+        srand(1);
+        randomseqState rnd;
+        rnd.size = n;
+        rnd.prime = 0;
+        randomseqInit(&rnd);
+        for (i = 1; i <= n; i++)
+        {           
+            id_t v = randomseqNext(&rnd);
+            *((int32_t*) recordBuffer) = v;
+            *((int32_t*) (recordBuffer+4)) = v;             
+            btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+        }
+        uint32_t insertHits = buffer->bufferHits, insertReads = buffer->numReads;
+        dbbufferFlush(buffer);
+
+        /* Scan looks up every scanStep key once. Every hotEvery scan lookups, numHot keys below hotKeys are looked up. */
+        btreeClearStats(state);
+        id_t hotHits = 0;
+        hotReads[policy] = 0;
+        srand(2);
+        for (i = 0; i < n; i += scanStep)
+        {
+            int32_t key = i;
+            btreeGet(state, &key, recordBuffer);
+            if ((i / scanStep) % hotEvery != 0)
+                continue;
+
+            id_t r0 = buffer->numReads, h0 = buffer->bufferHits;
+            for (uint32_t j = 0; j < numHot; j++)
+            {
+                key = rand() % hotKeys;
+                btreeGet(state, &key, recordBuffer);
+            }
+            hotReads[policy] += buffer->numReads - r0;
+            hotHits += buffer->bufferHits - h0;
+        }
+
+        /* Interior pages on path to hot keys are still buffered after scan */
+        int32_t key = 0;
+        btreeGet(state, &key, recordBuffer);
+        count_t resident = 0;
+        for (int8_t l = 0; l < state->levels-1; l++)
+        {
+            for (count_t f = 1; f < buffer->numPages; f++)
+            {
+                if (buffer->status[f] == state->activePath[l])
+                {
+                    resident++;
+                    break;
+                }
+            }
+        }
+        if (policy != DBBUFFER_POLICY_ROUNDROBIN && resident != state->levels-1)
+        {   success = 0;
+            printf("ERROR: %s buffered %d of %d interior pages on hot path\n", names[policy], resident, state->levels-1);
+        }
+
+        printf("%s: Insert hits: %lu reads: %lu hit rate: %lu%%  Hot hits: %lu reads: %lu hit rate: %lu%%\n", names[policy],
+            insertHits, insertReads, insertHits*100/(insertHits+insertReads),
+            hotHits, hotReads[policy], hotHits*100/(hotHits+hotReads[policy]));
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+
+    if (hotReads[DBBUFFER_POLICY_2Q] > hotReads[DBBUFFER_POLICY_LRU] || hotReads[DBBUFFER_POLICY_LRU] > hotReads[DBBUFFER_POLICY_CLOCK]
+        || hotReads[DBBUFFER_POLICY_2Q] >= hotReads[DBBUFFER_POLICY_ROUNDROBIN])
+    {   success = 0;
+        printf("ERROR: Hot reads not ordered 2Q <= LRU <= CLOCK and 2Q < round robin\n");
+    }
+
+    if (success)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE\n");
+}
+
+/**
+ * Estimates device time and wear for random inserts and queries on simulated SD card and NOR flash.
+ * Checks that the SD card erases nothing, that raw NOR flash erases blocks to rewrite pages in place, 
+ * and that the flash translation layer replaces those with fewer, evenly spread erases. Queries must not write.
+ */
+void testSimulatedDevice()
+{
+    const char *names[] = {"SD card", "NOR flash", "NOR flash with FTL"};
+    simModel models[] = {SIM_MODEL_SD_CARD, SIM_MODEL_NOR_FLASH, SIM_MODEL_NOR_FLASH};
+    int8_t M = 4;
+    uint32_t i, n = 1000;
+    id_t numPages = 1024, numLogical = 512;
+    count_t pagesPerBlock = 8, numBlocks = 1024/8;
+    id_t erases[3], maxErases[3];
+    int8_t success = 1;
+
+    for (uint8_t config = 0; config < 3; config++)
+    {
+        fileStorage fs;
+        simStorage ss;
+        flashStorage fls;
+        uint8_t *pageWrites = (uint8_t*) malloc(numPages);
+        uint32_t *blockErases = (uint32_t*) malloc(sizeof(uint32_t)*numBlocks);
+        id_t *map = (id_t*) malloc(sizeof(id_t)*numLogical);
+        count_t *blockValid = (count_t*) malloc(sizeof(count_t)*numBlocks);
+        void *flashBuffer = malloc(512);
+        dbstorage *storage = testFileStorage(&fs, "w+b");
+        if (storage == NULL)
+            return;
+        storage = simStorageInit(&ss, storage, &models[config], numPages, pageWrites, blockErases);
+        if (config == 2)
+            storage = flashStorageInit(&fls, storage, 512, pagesPerBlock, numBlocks, map, numLogical, blockValid, flashBuffer);
+
+        btreeState *state = testOpenTree(storage, DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+            return;
+        dbbuffer *buffer = state->buffer;
+        buffer->maxDirty = M;
+
+        btreeInit(state);
+
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);  
+        for (i = 0; i < (uint16_t) (state->recordSize-4); i++)
+            recordBuffer[i + sizeof(int32_t)] = 0;
+
+        srand(1);
+        randomseqState rnd;
+        rnd.size = n;
+        rnd.prime = 0;
+        randomseqInit(&rnd);
+        for (i = 1; i <= n; i++)
+        {           
+            id_t v = randomseqNext(&rnd);
+            *((int32_t*) recordBuffer) = v;
+            *((int32_t*) (recordBuffer+4)) = v;             
+            btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+        }
+        dbbufferFlush(buffer);
+        uint32_t insertTime = (uint32_t) (ss.time / 1000);
+        id_t writes = ss.numWrites + ss.numPartialWrites, reads = ss.numReads;
+
+        srand(2);
+        randomseqInit(&rnd);
+        for (i = 1; i <= n; i++) 
+        { 
+            int32_t key = randomseqNext(&rnd);
+            btreeGet(state, &key, recordBuffer);
+        }
+
+        printf("%s: Insert time: %lu ms  Query time: %lu ms  Erases: %lu  Rewrite erases: %lu  Max block erases: %lu\n", names[config],
+            insertTime, (uint32_t) (ss.time / 1000) - insertTime, ss.numErases, ss.numImplicitErases, ss.maxBlockErases);
+
+        erases[config] = ss.numErases + ss.numImplicitErases;
+        maxErases[config] = ss.maxBlockErases;
+        if (writes == 0 || ss.numWrites + ss.numPartialWrites != writes || ss.numReads <= reads)
+        {   success = 0;
+            printf("ERROR: %s inserts must write and queries must read without writing\n", names[config]);
+        }
+        if ((config == 0 && erases[config] != 0) || (config == 1 && (ss.numImplicitErases == 0 || ss.numErases != 0))
+            || (config == 2 && (ss.numImplicitErases != 0 || ss.numErases == 0)))
+        {   success = 0;
+            printf("ERROR: %s erased blocks other than expected\n", names[config]);
+        }
+
+        testCloseTree(state);
+        free(recordBuffer);
+        free(pageWrites);
+        free(blockErases);
+        free(map);
+        free(blockValid);
+        free(flashBuffer);
+    }
+
+    if (erases[2] >= erases[1] || maxErases[2] >= maxErases[1])
+    {   success = 0;
+        printf("ERROR: Flash translation layer did not reduce erases\n");
+    }
+
+    if (success)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE\n");
+}
+
+/**
+ * Puts records with a write-back buffer on simulated storage with sync every syncInterval operations and every syncInterval ms.
+ * Checks with the write counter of the device that dirty pages are written to storage at each sync and are kept buffered between syncs.
+ * Then checks that the background flusher writes and syncs pages of puts while no operations run, so a second file 
+ * descriptor finds all records, and that the B-tree is recovered from a clean superblock.
+ */
+void testSyncPolicy()
+{
+    int8_t M = 8;
+    uint32_t i, n = 1000, numSyncs = 10, errors = 0;
+    simModel model = SIM_MODEL_SD_CARD;
+
+    for (uint8_t policy = DBBUFFER_SYNC_TIME; policy <= DBBUFFER_SYNC_COUNT; policy++)
+    {
+        fileStorage fs;
+        simStorage ss;
+        btreeState *state = testOpenTree(simStorageInit(&ss, testFileStorage(&fs, "w+b"), &model, 0, NULL, NULL), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+            return;
+        dbbuffer *buffer = state->buffer;
+        buffer->maxDirty = M;
+        buffer->syncPolicy = policy;
+        buffer->syncInterval = policy == DBBUFFER_SYNC_COUNT ? n / numSyncs : 20;
+        btreeInit(state);
+
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+        id_t syncs = buffer->numSyncs, maxDirty = 0;
+        for (i = 1; i <= n; i++)
+        {
+            if (policy == DBBUFFER_SYNC_TIME && i % (n / numSyncs) == 0)
+            {   /* Wait for sync interval to pass so next put syncs */
+                uint32_t start = millis();
+                while (millis() - start <= buffer->syncInterval);
+            }
+            id_t writes = ss.numWrites + ss.numPartialWrites, dirty = buffer->numDirty;
+            *((int32_t*) recordBuffer) = i;
+            *((int32_t*) (recordBuffer+4)) = i;
+            btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            if (dirty > maxDirty)
+                maxDirty = dirty;
+
+            if (i % (n / numSyncs) == 0 && (buffer->numDirty != 0 || ss.numWrites + ss.numPartialWrites < writes + dirty))
+            {   errors++;
+                printf("ERROR: Put: %lu  Dirty pages: %lu  Pages written: %lu of %lu\n", i, buffer->numDirty, 
+                    ss.numWrites + ss.numPartialWrites - writes, dirty);
+            }
+        }
+        printf("%s: Syncs: %lu  Writes: %lu  Most dirty pages: %lu\n", policy == DBBUFFER_SYNC_COUNT ? "Sync count" : "Sync time", 
+            buffer->numSyncs - syncs, ss.numWrites + ss.numPartialWrites, maxDirty);
+        if (maxDirty == 0 || (policy == DBBUFFER_SYNC_COUNT ? buffer->numSyncs - syncs != numSyncs : buffer->numSyncs - syncs < numSyncs))
+        {   errors++;
+            printf("ERROR: Pages were not kept buffered between syncs\n");
+        }
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+
+#if !defined(ARDUINO)
+    /* Flusher thread syncs pages written by puts. Close writes clean superblock. */
+    for (uint8_t reopen = 0; reopen < 2; reopen++)
+    {
+        int fd = open("myfile.bin", reopen ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {   printf("Error: Can't open file!\n");
+            return;
+        }
+        posixStorage ps;
+        dbsuperblock sb;
+        dbflusher flusher;
+        btreeState *state = testOpenTree(posixStorageInit(&ps, fd), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+        {   close(fd);
+            return;
+        }
+        dbbuffer *buffer = state->buffer;
+        buffer->maxDirty = M;
+        buffer->superblock = &sb;
+        buffer->syncPolicy = DBBUFFER_SYNC_TIME;
+        buffer->syncInterval = 20;
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+
+        if (!reopen)
+        {
+            btreeInit(state);
+            if (dbbufferStartFlusher(buffer, &flusher) != 0)
+            {   errors++;
+                printf("ERROR: Failed to start flusher\n");
+            }
+            for (i = 1; i <= n; i++)
+            {
+                *((int32_t*) recordBuffer) = i;
+                *((int32_t*) (recordBuffer+4)) = i;
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+
+            /* No operations for several intervals. Thread writes and syncs dirty pages. */
+            uint32_t start = millis();
+            while (millis() - start <= 3 * buffer->syncInterval);
+            dbbufferLock(buffer);
+            count_t dirty = buffer->numDirty + buffer->numAppend;
+            id_t syncs = flusher.numSyncs;
+            dbbufferUnlock(buffer);
+            if (dirty != 0 || syncs == 0)
+            {   errors++;
+                printf("ERROR: Flusher did not write and sync when idle. Dirty pages: %lu\n", dirty);
+            }
+
+            /* Tree recovered from a second file descriptor finds all records on storage */
+            int fd2 = open("myfile.bin", O_RDWR);
+            posixStorage ps2;
+            dbsuperblock sb2;
+            btreeState *state2 = fd2 < 0 ? NULL : testOpenTree(posixStorageInit(&ps2, fd2), DBBUFFER_POLICY_ROUNDROBIN, M);
+            if (state2 == NULL)
+            {   errors++;
+                printf("ERROR: Failed to open file to check flushed pages\n");
+            }
+            else
+            {
+                state2->buffer->superblock = &sb2;
+                btreeRecover(state2);
+                for (int32_t key = 1; key <= (int32_t) n; key++)
+                {
+                    if (btreeGet(state2, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+                    {   errors++;
+                        printf("ERROR: Flushed record not on storage: %li\n", key);
+                        break;
+                    }
+                }
+                state2->buffer->superblock = NULL;     /* Superblock is written only by first tree */
+                testCloseTree(state2);
+            }
+
+            if (dbbufferStopFlusher(buffer) != 0 || flusher.numSyncs == 0)
+            {   errors++;
+                printf("ERROR: Flusher sync failed\n");
+            }
+            printf("Flusher: Syncs: %lu\n", flusher.numSyncs);
+        }
+        else
+        {
+            btreeRecover(state);
+            if (buffer->superblock == NULL || !sb.clean)
+            {   errors++;
+                printf("ERROR: Superblock not clean after close with flusher\n");
+            }
+            for (int32_t key = 1; key <= (int32_t) n; key++)
+            {
+                if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+                {   errors++;
+                    printf("ERROR: Failed to find: %li\n", key);
+                }
+            }
+        }
+
+        if (testCloseTree(state) != 0)
+        {   errors++;
+            printf("ERROR: Failed to close\n");
+        }
+        free(recordBuffer);
+    }
+#endif
+
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
+}
+
+/**
+ * Compares hit rate of lookups on a small key range with and without full iterator scans running between them.
+ * Checks that pages for the lookup range are still buffered after the scans for every policy.
+ * Buffer holds the lookup range and the interior nodes read by the scans but not the scanned leaves.
+ */
+void testScanResistance()
+{
+    const char *policies[] = {"Round robin", "CLOCK", "LRU", "2Q"};
+    int8_t M = 20, success = 1;
+    uint32_t i, n = 10000, numLookups = 5, numRounds = 2;
+
+    for (uint8_t policy = 0; policy < 4; policy++)
+    {
+        /* Lookups only, lookups with scans placed at cold end, and lookups with scans in 2 scan frames */
+        for (uint8_t config = 0; config < 3; config++)
+        {
+            fileStorage fs;
+            btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), policy, M);
+            if (state == NULL)
+                return;
+            dbbuffer *buffer = state->buffer;
+            buffer->numScan = config == 2 ? 2 : 0;
+            btreeInit(state);
+
+            int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);  
+            for (i = 0; i < (uint16_t) (state->recordSize-4); i++)
+                recordBuffer[i + sizeof(int32_t)] = 0;
+
+            srand(1);
+            randomseqState rnd;
+            rnd.size = n;
+            rnd.prime = 0;
+            randomseqInit(&rnd);
+            for (i = 1; i <= n; i++)
+            {           
+                id_t v = randomseqNext(&rnd);
+                *((int32_t*) recordBuffer) = v;
+                *((int32_t*) (recordBuffer+4)) = v;             
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+
+            /* Hit rate of lookups on keys in a small range while full scans run. Lookups are done after every 100 scanned records. */
+            id_t reads = 0, hits = 0;
+            btreeIterator it;
+            uint32_t minKey = 0, maxKey = n;
+            void *key, *data;
+            srand(2);
+            for (uint32_t round = 0; round < numRounds; round++)
+            {
+                it.minKey = &minKey;
+                it.maxKey = &maxKey;
+                if (config > 0)
+                    btreeInitIterator(state, &it);
+
+                for (uint32_t k = 0; k < n; k += 100)
+                {
+                    id_t r0 = buffer->numReads, h0 = buffer->bufferHits;
+                    for (i = 0; i < numLookups; i++) 
+                    { 
+                        int32_t lookupKey = rand() % (n / 100);
+                        btreeGet(state, &lookupKey, recordBuffer);
+                    }
+                    reads += buffer->numReads - r0;
+                    hits += buffer->bufferHits - h0;
+
+                    for (i = 0; i < 100 && config > 0; i++)
+                        btreeNext(state, &it, &key, &data);
+                }
+            }
+
+            printf("%s %s: Lookup reads: %lu  Hits: %lu  Hit rate: %lu%%\n", policies[policy], 
+                config == 0 ? "no scans" : (config == 1 ? "scans at cold end" : "scans in scan frames"),
+                reads, hits, (uint32_t) (100 * hits / (reads + hits)));
+
+            /* Pages for every key in lookup range are still buffered after scans */
+            id_t r0 = buffer->numReads;
+            for (int32_t lookupKey = 0; lookupKey < (int32_t) (n / 100); lookupKey++)
+                btreeGet(state, &lookupKey, recordBuffer);
+            if (buffer->numReads != r0)
+            {   success = 0;
+                printf("ERROR: Lookup range needed %lu reads after scans\n", buffer->numReads - r0);
+            }
+
+            testCloseTree(state);
+            free(recordBuffer);
+        }
+    }
+
+    if (success)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE\n");
+}
+
+/* Record source for testBulkLoad. Returns keys 0 to n-1 in order (or in random order if rnd is set) with data equal to key. */
+typedef struct {
+    uint32_t next;
+    uint32_t n;
+    randomseqState *rnd;
+} bulkLoadSource;
+
+int8_t bulkLoadNext(void *source, void *key, void *data)
+{
+    bulkLoadSource *src = (bulkLoadSource*) source;
+    if (src->next >= src->n)
+        return 0;
+    uint32_t v = src->rnd == NULL ? src->next : randomseqNext(src->rnd);
+    memcpy(key, &v, sizeof(uint32_t));
+    memcpy(data, &v, sizeof(uint32_t));
+    src->next++;
+    return 1;
+}
+
+void testBulkLoad()
+{
+    int8_t M = 8;
+    uint32_t i, n = 10000;
+    uint8_t fill[] = {100, 100, 70, 100, 100, 100};
+    const char *configs[] = {"Put sorted", "Bulk load", "Bulk load", "Put random", "Sort load in buffer", "Sort load in 64 pages"};
+
+    /* Sorted records inserted with btreePut then bulk loaded at 100% and 70% fill.
+       Random records inserted with btreePut then sorted in buffer frames and in a larger work area. */
+    for (uint8_t config = 0; config < 6; config++)
+    {
+        fileStorage fs;
+        btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+            return;
+        dbbuffer *buffer = state->buffer;
+        btreeInit(state);
+
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);  
+        for (i = 0; i < (uint16_t) (state->recordSize-4); i++)
+            recordBuffer[i + sizeof(int32_t)] = 0;
+
+        srand(1);
+        randomseqState rnd;
+        rnd.size = n;
+        rnd.prime = 0;
+        randomseqInit(&rnd);
+        bulkLoadSource src;
+        src.next = 0;
+        src.n = n;
+        src.rnd = config >= 3 ? &rnd : NULL;
+
+        SD_FILE *sfp = fopen("sort.bin", "w+b");
+        if (NULL == sfp) {
+            printf("Error: Can't open file!\n");
+            return;
+        }
+        fileStorage scratch;
+        fileStorageInit(&scratch, sfp);
+        void *work = config == 5 ? malloc(64 * buffer->pageSize) : NULL;
+
+        unsigned long start = millis();
+        int8_t result = 0;
+        if (config == 0 || config == 3)
+        {
+            for (i = 0; i < n; i++)
+            {           
+                bulkLoadNext(&src, recordBuffer, recordBuffer + 4);
+                btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+            }
+        }
+        else if (config < 3)
+            result = btreeBulkLoad(state, bulkLoadNext, &src, fill[config]);
+        else
+            result = btreeSortLoad(state, bulkLoadNext, &src, &scratch.storage, work, 64 * buffer->pageSize, fill[config]);
+        if (result != 0)
+            printf("Load failed.\n");
+        dbbufferFlush(buffer);
+        unsigned long end = millis();
+        scratch.storage.close(&scratch.storage);
+        free(work);
+
+        uint32_t errors = 0;
+        for (i = 0; i < n; i++)
+        {
+            int32_t key = i;
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+                errors++;
+        }
+
+        /* Node count kept by tree matches nodes reachable from root */
+        id_t nodes = testCountNodes(state, state->activePath[0], 0);
+        if (nodes != state->numNodes)
+        {   errors++;
+            printf("ERROR: Node count is %lu but tree has %lu nodes\n", state->numNodes, nodes);
+        }
+
+        printf("%s %d%% fill: ", configs[config], fill[config]);
+        printf("Time: %lu  Writes: %lu  Overwrites: %lu  Nodes: %lu  Levels: %d  Errors: %lu\n", end-start, 
+            buffer->numWrites, buffer->numOverWrites, state->numNodes, state->levels, errors);
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+}
+
+void testAppend()
+{
+    int8_t M = 8;
+    uint32_t i, j, n = 10000, batchSize = 200;
+    const char *configs[] = {"Sorted", "Mostly sorted", "Random", "Batch mostly sorted", "Batch random"};
+
+    /* Sorted keys are appended to rightmost leaf. Mostly sorted keys have one key in ten arriving late.
+       Batches put batchSize records at a time with btreePutBatch. */
+    for (uint8_t config = 0; config < 5; config++)
+    {
+        fileStorage fs;
+        btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+            return;
+        dbbuffer *buffer = state->buffer;
+        btreeInit(state);
+
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize * batchSize);  
+        for (i = 0; i < state->recordSize * batchSize; i++)
+            recordBuffer[i] = 0;
+
+        srand(1);
+        randomseqState rnd;
+        rnd.size = n;
+        rnd.prime = 0;
+        randomseqInit(&rnd);
+
+        unsigned long start = millis();
+        for (i = 0, j = 0; i < n; i++)
+        {
+            uint32_t key = i;
+            if (config % 2 == 1 && i % 20 == 0 && i + 10 < n)
+                key = i + 10;
+            else if (config % 2 == 1 && i % 20 == 10)
+                key = i - 10;
+            else if (config == 2 || config == 4)
+                key = randomseqNext(&rnd);
+
+            int8_t *rec = recordBuffer + state->recordSize * j;
+            memcpy(rec, &key, sizeof(uint32_t));
+            memcpy(rec + 4, &key, sizeof(uint32_t));
+            if (config < 3)
+                btreePut(state, rec, (void*) (rec + 4));
+            else if (++j == batchSize || i == n-1)
+            {
+                btreePutBatch(state, recordBuffer, j);
+                j = 0;
+            }
+        }
+        dbbufferFlush(buffer);
+        unsigned long end = millis();
+
+        uint32_t errors = 0;
+        for (i = 0; i < n; i++)
+        {
+            int32_t key = i;
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+                errors++;
+        }
+
+        printf("%s: ", configs[config]);
+        printf("Time: %lu  Reads: %lu  Writes: %lu  Overwrites: %lu  Nodes: %lu  Levels: %d  Errors: %lu\n", end-start, 
+            buffer->numReads, buffer->numWrites, buffer->numOverWrites, state->numNodes, state->levels, errors);
+
+        testCloseTree(state);
+        free(recordBuffer);
+    }
+}
+
+/**
+ * Puts batches that each hold keys from across the whole key range so every batch overlaps all earlier ones.
+ * The first batch splits the root leaf into more leaves than one split pass makes and later batches split most leaves.
+ * Checks that every key is found with its data, that missing keys are not found, and that the node count is correct.
+ */
+void testPutBatch()
+{
+    int8_t M = 8;
+    uint32_t i, j, numBatches = 8, batchSize = 1000, n = numBatches * batchSize, errors = 0;
+
+    fileStorage fs;
+    btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
+    if (state == NULL)
+        return;
+    btreeInit(state);
+
+    int8_t* recordBuffer = (int8_t*) malloc(state->recordSize * batchSize);
+    memset(recordBuffer, 0, state->recordSize * batchSize);
+
+    /* Batch b holds keys j*2*numBatches + 2*b in random order. Odd keys are never put. */
+    srand(1);
+    randomseqState rnd;
+    rnd.size = batchSize;
+    rnd.prime = 0;
+    for (uint32_t b = 0; b < numBatches; b++)
+    {
+        randomseqInit(&rnd);
+        for (j = 0; j < batchSize; j++)
+        {
+            uint32_t key = randomseqNext(&rnd) * 2 * numBatches + 2 * b;
+            memcpy(recordBuffer + state->recordSize * j, &key, sizeof(uint32_t));
+            memcpy(recordBuffer + state->recordSize * j + 4, &key, sizeof(uint32_t));
+        }
+        if (btreePutBatch(state, recordBuffer, batchSize) != 0)
+        {   errors++;
+            printf("ERROR: Batch %lu failed\n", b);
+        }
+    }
+
+    for (i = 0; i < 2 * n; i++)
+    {
+        int32_t key = i;
+        int8_t result = btreeGet(state, &key, recordBuffer);
+        if ((i % 2 == 0) != (result == 0) || (result == 0 && *((int32_t*) recordBuffer) != key))
+        {   errors++;
+            printf("ERROR: Key: %lu Result: %d\n", i, result);
+        }
+    }
+
+    id_t nodes = testCountNodes(state, state->activePath[0], 0);
+    if (nodes != state->numNodes)
+    {   errors++;
+        printf("ERROR: Node count is %lu but tree has %lu nodes\n", state->numNodes, nodes);
+    }
+
+    printf("Batches: %lu  Reads: %lu  Writes: %lu  Overwrites: %lu  Nodes: %lu  Levels: %d\n", numBatches,
+        state->buffer->numReads, state->buffer->numWrites, state->buffer->numOverWrites, state->numNodes, state->levels);
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
+
+    testCloseTree(state);
+    free(recordBuffer);
+}
+
+/**
+ * Checks that btreeGetBatch returns the same results as btreeGet for unsorted keys that are present, missing, 
+ * and past either end of the key range, and again for the keys once sorted
+ */
+void testGetBatch()
+{
+    int8_t M = 8;
+    uint32_t i, n = 5000, numKeys = 500, errors = 0;
+
+    fileStorage fs;
+    btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
+    if (state == NULL)
+        return;
+    btreeInit(state);
+
+    /* Even keys are inserted in random order. Odd keys are missing. */
+    int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+    memset(recordBuffer, 0, state->recordSize);
+    srand(1);
+    randomseqState rnd;
+    rnd.size = n;
+    rnd.prime = 0;
+    randomseqInit(&rnd);
+    for (i = 0; i < n; i++)
+    {
+        uint32_t key = 2 * randomseqNext(&rnd) + 2;
+        memcpy(recordBuffer, &key, sizeof(uint32_t));
+        memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+        btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+    }
+
+    uint32_t *keys = (uint32_t*) malloc(sizeof(uint32_t) * numKeys);
+    uint8_t *data = (uint8_t*) malloc(state->dataSize * numKeys);
+    int8_t *results = (int8_t*) malloc(numKeys);
+    for (i = 0; i < numKeys; i++)
+        keys[i] = rand() % (2 * n + 10);
+
+    /* Keys are sorted in place by first call so second call has sorted input */
+    for (uint8_t sorted = 0; sorted < 2; sorted++)
+    {
+        int32_t found = btreeGetBatch(state, keys, data, results, numKeys), expected = 0;
+        for (i = 0; i < numKeys; i++)
+        {
+            int8_t result = btreeGet(state, &keys[i], recordBuffer);
+            if (result == 0)
+                expected++;
+            if (result != results[i] || (result == 0 && memcmp(recordBuffer, data + state->dataSize * i, state->dataSize) != 0)
+                || (i > 0 && keys[i-1] > keys[i]))
+            {   errors++;
+                printf("ERROR: Key: %lu Get: %d GetBatch: %d\n", keys[i], result, results[i]);
+            }
+        }
+        if (found != expected || expected == 0 || expected == (int32_t) numKeys)
+        {   errors++;
+            printf("ERROR: Found: %ld  Expected: %ld\n", found, expected);
+        }
+        printf("%s keys: Found: %ld of %lu keys\n", sorted ? "Sorted" : "Unsorted", found, numKeys);
+    }
+
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
+
+    testCloseTree(state);
+    free(recordBuffer);
+    free(keys);
+    free(data);
+    free(results);
+}
+
+#if !defined(ARDUINO)
+/**
+ * Checks that btreeMultiGet returns the same results as btreeGet for keys that are present and missing
+ * with asynchronous storage using io_uring (if available) and reader threads
+ */
+void testMultiGet()
+{
+    const char *modes[] = {"Auto", "Threads"};
+    int8_t M = 16;
+    uint32_t i, n = 5000, numKeys = 200;
+
+    for (uint8_t mode = AIO_MODE_AUTO; mode <= AIO_MODE_THREADS; mode++)
+    {
+        int fd = open("myfile.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {   printf("Error: Can't open file!\n");
+            return;
+        }
+        aioStorage as;
+        btreeState *state = testOpenTree(aioStorageInit(&as, fd, 32, 4, mode), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+        {   close(fd);
+            return;
+        }
+        btreeInit(state);
+
+        /* Even keys are inserted in random order. Odd keys are missing. */
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+        srand(1);
+        randomseqState rnd;
+        rnd.size = n;
+        rnd.prime = 0;
+        randomseqInit(&rnd);
+        for (i = 0; i < n; i++)
+        {
+            uint32_t key = 2 * randomseqNext(&rnd);
+            memcpy(recordBuffer, &key, sizeof(uint32_t));
+            memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+            btreePut(state, recordBuffer, (void*) (recordBuffer + 4));
+        }
+        dbbufferFlush(state->buffer);
+
+        uint32_t *keys = (uint32_t*) malloc(sizeof(uint32_t) * numKeys);
+        uint8_t *data = (uint8_t*) malloc(state->dataSize * numKeys);
+        int8_t *results = (int8_t*) malloc(numKeys);
+        id_t *pageIds = (id_t*) malloc(sizeof(id_t) * numKeys);
+        for (i = 0; i < numKeys; i++)
+            keys[i] = rand() % (2 * n + 10);
+
+        int32_t found = btreeMultiGet(state, keys, data, results, pageIds, numKeys);
+        uint32_t errors = 0, expected = 0;
+        for (i = 0; i < numKeys; i++)
+        {
+            int8_t result = btreeGet(state, &keys[i], recordBuffer);
+            if (result == 0)
+                expected++;
+            if (result != results[i] || (result == 0 && memcmp(recordBuffer, data + state->dataSize * i, state->dataSize) != 0))
+            {   errors++;
+                printf("ERROR: Key: %lu Get: %d MultiGet: %d\n", keys[i], result, results[i]);
+            }
+        }
 
-void testIterator(btreeState *state, void *recordBuffer)
+        if (errors == 0 && found == (int32_t) expected && expected > 0 && expected < numKeys)
+            printf("%s: SUCCESS. Found: %ld of %lu keys\n", modes[mode], found, numKeys);
+        else
+            printf("%s: FAILURE. Found: %ld  Expected: %lu  Errors: %lu\n", modes[mode], found, expected, errors);
+
+        testCloseTree(state);
+        free(recordBuffer);
+        free(keys);
+        free(data);
+        free(results);
+        free(pageIds);
+    }
+}
+
+/**
+ * Puts records on memory-mapped storage that grows by small extents, then closes and reopens it.
+ * Checks that reads return pages in the mapping without copying, that a page pointer stays valid as the file grows,
+ * that the file is trimmed to its pages on close, and that every key is found after recovery.
+ */
+void testMmap()
 {
-     /* Below minimum key search */
-    int32_t key = -1;
-    int8_t result = btreeGet(state, &key, recordBuffer);
-    if (result == 0) 
-        printf("Error1: Key found: %li\n", key);
+    int8_t M = 8;
+    uint32_t i, n = 3000, errors = 0;
+    size_t maxSize = 16*1024*1024, extentSize = 8*512;
 
-    /* Above maximum key search */
-    key = 3500000;
-    result = btreeGet(state, &key, recordBuffer);
-    if (result == 0) 
-        printf("Error2: Key found: %li\n", key);
-    
-    free(recordBuffer);
-    
-    btreeIterator it;
-    uint32_t mv = 40;     // For all records, select mv = 1.
-    it.minKey = &mv;
-    int v = 299;
-    it.maxKey = &v;       
+    for (uint8_t reopen = 0; reopen < 2; reopen++)
+    {
+        int fd = open("myfile.bin", reopen ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {   printf("Error: Can't open file!\n");
+            return;
+        }
+        off_t fileSize = lseek(fd, 0, SEEK_END);
+        mmapStorage ms;
+        btreeState *state = testOpenTree(mmapStorageInit(&ms, fd, maxSize, extentSize, MMAP_SYNC_NONE), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+        {   close(fd);
+            return;
+        }
+        dbstorage *storage = state->buffer->storage;
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
 
-    // btreePrint(state); 
+        if (!reopen)
+        {
+            btreeInit(state);
+            void *first = storage->mapPage(storage, 0);
+            srand(1);
+            randomseqState rnd;
+            rnd.size = n;
+            rnd.prime = 0;
+            randomseqInit(&rnd);
+            for (i = 0; i < n; i++)
+            {
+                uint32_t key = randomseqNext(&rnd);
+                memcpy(recordBuffer, &key, sizeof(uint32_t));
+                memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+                if (btreePut(state, recordBuffer, (void*) (recordBuffer + 4)) != 0)
+                    errors++;
+            }
 
-    btreeInitIterator(state, &it);
-    uint32_t i = 0;
-    int8_t success = 1;    
-    uint32_t *itKey, *itData;
+            /* File grew by many extents and first page did not move */
+            if (ms.allocSize <= extentSize || first == NULL || storage->mapPage(storage, 0) != first)
+            {   errors++;
+                printf("ERROR: File size: %lu  First page moved: %d\n", (uint32_t) ms.allocSize, first != storage->mapPage(storage, 0));
+            }
+        }
+        else
+        {
+            btreeRecover(state);
 
-    while (btreeNext(state, &it, (void**) &itKey, (void**) &itData))
-    {                      
-        // printf("Key: %d  Data: %d\n", *itKey, *itData);
-        if (i+mv != *itKey)
-        {   success = 0;
-            printf("Key: %lu Error\n", *itKey);
+            /* File was trimmed to pages written when closed */
+            if (fileSize <= 0 || fileSize % 512 != 0 || (size_t) fileSize != ms.length)
+            {   errors++;
+                printf("ERROR: File size after close: %lu\n", (uint32_t) fileSize);
+            }
         }
-        i++;        
+
+        /* Root is read from mapping without copying into a buffer frame */
+        void *root = readPage(state->buffer, state->activePath[0]);
+        if (root == NULL || root != storage->mapPage(storage, state->activePath[0]) || root < ms.map || root >= ms.map + ms.length)
+        {   errors++;
+            printf("ERROR: Root page not read from mapping\n");
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            int32_t key = i;
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %lu\n", key);
+            }
+        }
+        printf("%s: File size: %lu  Pages: %lu  Reads: %lu  Levels: %d\n", reopen ? "Reopened" : "Created", 
+            (uint32_t) ms.allocSize, (uint32_t) (ms.length / 512), state->buffer->numReads, state->levels);
+
+        testCloseTree(state);
+        free(recordBuffer);
     }
-    printf("\nRead records: %lu\n", i);
 
-    if (success && i == (v-mv+1))
+    if (errors == 0)
         printf("SUCCESS\n");
     else
-        printf("FAILURE\n");           
+        printf("FAILURE: Errors: %lu\n", errors);
 }
 
-void testRecovery()
+/**
+ * Writes whole and partial pages with direct I/O from aligned and unaligned buffers, then puts records with an aligned buffer,
+ * closes, and recovers the B-tree with an unaligned buffer. Checks that unaligned buffers are copied through the aligned page,
+ * that partial page writes keep the rest of the page or zero fill a page past the end of the file, and that every key is found.
+ * Skipped if the file system does not support direct I/O for 512 byte pages.
+ */
+void testDirectIO()
 {
-    srand(3);
-    randomseqState rnd;
-    rnd.size = 1000;
-    uint32_t n = rnd.size; 
-    rnd.prime = 0;
-    uint32_t end, i, errors = 0;
+    int8_t M = 8;
+    uint32_t i, n = 3000, errors = 0;
+    count_t pageSize = 512;
 
-    /* Configure buffer */
-    dbbuffer* buffer = (dbbuffer*) malloc(sizeof(dbbuffer));
-    if (buffer == NULL)
-    {   printf("Failed to allocate buffer struct.\n");
+    int fd = open("myfile.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {   printf("Error: Can't open file!\n");
         return;
     }
-    buffer->pageSize = 512;
-    buffer->numPages = 3;
-    buffer->status = (id_t*) malloc(sizeof(id_t)*3);
-    if (buffer->status == NULL)
-    {   printf("Failed to allocate buffer status array.\n");
+    uint32_t alignment = directStorageAlignment(fd);
+    uint8_t *page = (uint8_t*) directStorageAlloc(pageSize, alignment);
+    uint8_t *aligned = (uint8_t*) directStorageAlloc(2 * pageSize, alignment);
+    uint8_t *unaligned = (uint8_t*) directStorageAlloc(2 * pageSize + 1, alignment);
+    directStorage ds;
+    dbstorage *storage = NULL;
+    if (page != NULL && aligned != NULL && unaligned != NULL)
+        storage = directStorageInit(&ds, fd, pageSize, alignment, page);
+    if (storage == NULL)
+    {   printf("Direct I/O not supported. Alignment: %lu. Skipped.\n", alignment);
+        close(fd);
+        free(page);
+        free(aligned);
+        free(unaligned);
         return;
     }
-        
-    buffer->buffer  = malloc((size_t) buffer->numPages * buffer->pageSize);   
-    if (buffer->buffer == NULL)
-    {   printf("Failed to allocate buffer.\n");
-        return;
+    uint8_t *misaligned = unaligned + 1;
+
+    /* Page 0 from aligned buffer. Pages 1 and 2 from unaligned buffer are copied through the aligned page. */
+    memset(aligned, 1, pageSize);
+    memset(misaligned, 2, pageSize);
+    memset(misaligned + pageSize, 3, pageSize);
+    if (storage->writePage(storage, 0, aligned) != 0 || storage->writePages(storage, 1, 2, misaligned) != 0)
+    {   errors++;
+        printf("ERROR: Failed to write pages\n");
     }
-    /* Configure btree state */
-    btreeState* state = (btreeState*) malloc(sizeof(btreeState));
-    if (state == NULL)
-    {   printf("Failed to allocate B-tree state struct.\n");
-        return;
+    memset(misaligned, 0, 2 * pageSize);
+    memset(aligned, 0, 2 * pageSize);
+    if (storage->readPage(storage, 0, misaligned) != 0 || storage->readPages(storage, 1, 2, aligned) != 0)
+    {   errors++;
+        printf("ERROR: Failed to read pages\n");
     }
-    state->recordSize = 16;
-    state->keySize = 4;
-    state->dataSize = 12;         
-    state->buffer = buffer;
-    state->tempKey = malloc(sizeof(int32_t)); 
-    state->tempData = malloc(12); 
-    
-    /* Setup output file. File must exist. */
-    SD_FILE *fp;
-    fp = fopen("myfile.bin", "r+b");
-    if (NULL == fp) {
-        printf("Error: Can't open file!\n");
-        return;
+    for (i = 0; i < pageSize; i++)
+    {
+        if (misaligned[i] != 1 || aligned[i] != 2 || aligned[pageSize + i] != 3)
+        {   errors++;
+            printf("ERROR: Page contents differ at offset: %lu\n", i);
+            break;
+        }
     }
-    
-    buffer->file = fp;    
 
-    int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);    	
-
-    /* Initialize btree structure with parameters */
-    btreeRecover(state);
-        
-    /* Data record is empty. Only need to reset to 0 once as reusing struct. */        
-    for (i = 0; i < (uint16_t) (state->recordSize-4); i++) // 4 is the size of the key
+    /* Partial page writes read, update, and write the whole page. Page 5 is past the end of the file. */
+    memset(misaligned, 4, pageSize);
+    if (storage->writeBytes(storage, 1, 100, 10, misaligned) != 0 || storage->writeBytes(storage, 5, 3, 7, misaligned) != 0)
+    {   errors++;
+        printf("ERROR: Failed to write partial pages\n");
+    }
+    if (storage->readPage(storage, 1, aligned) != 0 || storage->readPage(storage, 5, aligned + pageSize) != 0)
+    {   errors++;
+        printf("ERROR: Failed to read partial pages\n");
+    }
+    for (i = 0; i < pageSize; i++)
     {
-        recordBuffer[i + sizeof(int32_t)] = 0;
+        if (aligned[i] != (i >= 100 && i < 110 ? 4 : 2) || aligned[pageSize + i] != (i >= 3 && i < 10 ? 4 : 0))
+        {   errors++;
+            printf("ERROR: Partial page contents differ at offset: %lu\n", i);
+            break;
+        }
     }
+    if (storage->size(storage) != 6)
+    {   errors++;
+        printf("ERROR: File size: %lu pages\n", storage->size(storage));
+    }
+    storage->close(storage);
 
-    unsigned long start = millis();   
+    for (uint8_t reopen = 0; reopen < 2; reopen++)
+    {
+        fd = open("myfile.bin", reopen ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        btreeState *state = NULL;
+        if (fd >= 0)
+            state = testOpenTree(directStorageInit(&ds, fd, pageSize, alignment, page), DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+        {   printf("Error: Can't open direct I/O storage!\n");
+            if (fd >= 0)
+                close(fd);
+            errors++;
+            break;
+        }
 
-    
-    printf("\nVerifying and searching for all values.\n");
-    start = millis();
+        /* Records are put with aligned frames and recovered with frames that are not */
+        uint8_t *frames = (uint8_t*) directStorageAlloc((size_t) M * pageSize + 8, alignment);
+        free(state->buffer->buffer);
+        state->buffer->buffer = frames + (reopen ? 8 : 0);
 
-    srand(3);
-    randomseqInit(&rnd);
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+        if (!reopen)
+        {
+            btreeInit(state);
+            srand(1);
+            randomseqState rnd;
+            rnd.size = n;
+            rnd.prime = 0;
+            randomseqInit(&rnd);
+            for (i = 0; i < n; i++)
+            {
+                uint32_t key = randomseqNext(&rnd);
+                memcpy(recordBuffer, &key, sizeof(uint32_t));
+                memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+                if (btreePut(state, recordBuffer, (void*) (recordBuffer + 4)) != 0)
+                    errors++;
+            }
+        }
+        else
+            btreeRecover(state);
 
-    /* Verify that can find all values inserted */    
-    for (i = 1; i <= n; i++) 
-    { 
-        int32_t key = randomseqNext(&rnd);
-        int8_t result = btreeGet(state, &key, recordBuffer);
-        if (result != 0) 
-        {   errors++;
-            printf("ERROR: Failed to find: %li\n", key);
-            btreeGet(state, &key, recordBuffer);
+        for (i = 0; i < n; i++)
+        {
+            int32_t key = i;
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %lu\n", key);
+            }
         }
-        else if (*((int32_t*) recordBuffer) != key)
-        {   printf("ERROR: Wrong data for: %li\n", key);
-            printf("Key: %lu Data: %lu\n", key, *((int32_t*) recordBuffer));
-        }       
+        printf("%s: Pages: %lu  Reads: %lu  Writes: %lu  Levels: %d\n", reopen ? "Reopened" : "Created", 
+            state->buffer->storage->size(state->buffer->storage), state->buffer->numReads, state->buffer->numWrites, state->levels);
+        state->buffer->buffer = frames;
+        testCloseTree(state);
+        free(recordBuffer);
     }
+    free(page);
+    free(aligned);
+    free(unaligned);
 
-    if (errors > 0)
-        printf("FAILURE: Errors: %lu\n", errors);
+    if (errors == 0)
+        printf("SUCCESS\n");
     else
-        printf("SUCCESS. All values found!\n");
-    
-    end = millis();
-    printf("Elapsed Time: %lu s\n", (end - start));
-    printf("Records queried: %lu\n", n);   
-    printStats(state->buffer);     
+        printf("FAILURE: Errors: %lu\n", errors);
+}
 
-    closeBuffer(buffer);    
-        
-    free(state->tempKey);
-    free(state->tempData);
-    free(recordBuffer);
+/**
+ * Puts records on block storage in a region of a disk image file, closes it, and reopens the region without formatting.
+ * Checks that the number of blocks used is read back from the region header, that every key is found after recovery,
+ * that blocks before the region are not written, and that formatting empties the region.
+ */
+void testBlockStorage()
+{
+    int8_t M = 8;
+    uint32_t i, n = 3000, errors = 0, firstBlock = 4, numBlocks = 4096, usedBlocks = 0;
+    uint8_t *block = (uint8_t*) malloc(BLOCK_STORAGE_BLOCK_SIZE);
+    uint8_t *blockBuffer = (uint8_t*) malloc(BLOCK_STORAGE_BLOCK_SIZE);
+    if (block == NULL || blockBuffer == NULL)
+    {   free(block);
+        free(blockBuffer);
+        return;
+    }
 
-    free(buffer->status);
-    free(state->buffer->buffer);
-    free(buffer);
-    free(state);
+    for (uint8_t reopen = 0; reopen < 2; reopen++)
+    {
+        int fd = open("myfile.bin", reopen ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {   printf("Error: Can't open file!\n");
+            break;
+        }
+        if (!reopen)
+        {   /* Blocks before region are not part of storage */
+            memset(block, 0xAB, BLOCK_STORAGE_BLOCK_SIZE);
+            for (i = 0; i < firstBlock; i++)
+                imageWriteBlocks(&fd, i, 1, block);
+        }
+
+        blockStorage bs;
+        btreeState *state = testOpenTree(blockStorageInit(&bs, &fd, imageReadBlocks, imageWriteBlocks, firstBlock, numBlocks, blockBuffer, !reopen),
+            DBBUFFER_POLICY_ROUNDROBIN, M);
+        if (state == NULL)
+        {   printf("Error: Can't open block storage!\n");
+            close(fd);
+            errors++;
+            break;
+        }
+        int8_t* recordBuffer = (int8_t*) malloc(state->recordSize);
+        memset(recordBuffer, 0, state->recordSize);
+
+        if (!reopen)
+        {
+            btreeInit(state);
+            srand(1);
+            randomseqState rnd;
+            rnd.size = n;
+            rnd.prime = 0;
+            randomseqInit(&rnd);
+            for (i = 0; i < n; i++)
+            {
+                uint32_t key = randomseqNext(&rnd);
+                memcpy(recordBuffer, &key, sizeof(uint32_t));
+                memcpy(recordBuffer + 4, &key, sizeof(uint32_t));
+                if (btreePut(state, recordBuffer, (void*) (recordBuffer + 4)) != 0)
+                    errors++;
+            }
+        }
+        else
+        {
+            if (bs.usedBlocks != usedBlocks)
+            {   errors++;
+                printf("ERROR: Blocks used: %lu  Blocks used at close: %lu\n", bs.usedBlocks, usedBlocks);
+            }
+            btreeRecover(state);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            int32_t key = i;
+            if (btreeGet(state, &key, recordBuffer) != 0 || *((int32_t*) recordBuffer) != key)
+            {   errors++;
+                printf("ERROR: Failed to find: %lu\n", key);
+            }
+        }
+        printf("%s: Blocks used: %lu  Pages: %lu  Levels: %d\n", reopen ? "Reopened" : "Formatted", bs.usedBlocks, 
+            state->buffer->storage->size(state->buffer->storage), state->levels);
+
+        testCloseTree(state);
+        usedBlocks = bs.usedBlocks;
+        if (usedBlocks == 0)
+            errors++;
+        free(recordBuffer);
+
+        if (reopen)
+        {   /* Blocks before region are unchanged. Formatting empties region. */
+            for (i = 0; i < firstBlock; i++)
+            {
+                if (imageReadBlocks(&fd, i, 1, block) != 0 || block[0] != 0xAB || block[BLOCK_STORAGE_BLOCK_SIZE-1] != 0xAB)
+                {   errors++;
+                    printf("ERROR: Block %lu before region was written\n", i);
+                }
+            }
+            if (blockStorageInit(&bs, &fd, imageReadBlocks, imageWriteBlocks, firstBlock, numBlocks, blockBuffer, 1) == NULL || bs.usedBlocks != 0)
+            {   errors++;
+                printf("ERROR: Region not empty after format\n");
+            }
+        }
+        close(fd);
+    }
+    free(block);
+    free(blockBuffer);
+
+    if (errors == 0)
+        printf("SUCCESS\n");
+    else
+        printf("FAILURE: Errors: %lu\n", errors);
 }
+#endif
 
-/**
- * Runs all tests and collects benchmarks
- */ 
 void runalltests_btree()
 {    
     uint32_t stepSize = 100, numSteps = 10;
@@ -217,6 +1750,62 @@ void runalltests_btree()
     // testRecovery();
     // return;
 
+    /* Optional: Check pages buffered at close are preloaded on recovery. */
+    // testWarmRecovery();
+    // return;
+
+    /* Optional: Check freed pages are reused and found on recovery. */
+    // testFreePages();
+    // return;
+
+    /* Optional: Compare buffer replacement policies. */
+    // testBufferPolicies();
+    // return;
+
+    /* Optional: Estimate device time and wear with simulated storage. */
+    // testSimulatedDevice();
+    // return;
+
+    /* Optional: Check dirty pages are written at each sync with sync policies and the background flusher. */
+    // testSyncPolicy();
+    // return;
+
+    /* Optional: Compare lookup hit rate with and without scans. */
+    // testScanResistance();
+    // return;
+
+    /* Optional: Compare bulk loading and sort loading records with inserting them. */
+    // testBulkLoad();
+    // return;
+
+    /* Optional: Compare inserting keys in order, mostly in order, and in random order one at a time and in batches. */
+    // testAppend();
+    // return;
+
+    /* Optional: Check putting overlapping batches that split leaves. */
+    // testPutBatch();
+    // return;
+
+    /* Optional: Check looking up a batch of unsorted keys. */
+    // testGetBatch();
+    // return;
+
+    /* Optional: Check lookups of many keys with asynchronous storage. */
+    // testMultiGet();
+    // return;
+
+    /* Optional: Check B-tree on memory-mapped storage. */
+    // testMmap();
+    // return;
+
+    /* Optional: Check B-tree and partial page writes on direct I/O storage. */
+    // testDirectIO();
+    // return;
+
+    /* Optional: Check B-tree on block storage in a disk image. */
+    // testBlockStorage();
+    // return;
+
     for (r=0; r < numRuns; r++)
     {
         uint32_t errors = 0;
@@ -228,48 +1817,12 @@ void runalltests_btree()
         uint32_t n = rnd.size; 
         rnd.prime = 0;
     
-        /* Configure buffer */
-        dbbuffer* buffer = (dbbuffer*) malloc(sizeof(dbbuffer));
-        if (buffer == NULL)
-        {   printf("Failed to allocate buffer struct.\n");
-            return;
-        }
-        buffer->pageSize = 512;
-        buffer->numPages = M;
-        buffer->status = (id_t*) malloc(sizeof(id_t)*M);
-        if (buffer->status == NULL)
-        {   printf("Failed to allocate buffer status array.\n");
-            return;
-        }
-        
-        buffer->buffer  = malloc((size_t) buffer->numPages * buffer->pageSize);   
-        if (buffer->buffer == NULL)
-        {   printf("Failed to allocate buffer.\n");
-            return;
-        }
-        /* Configure btree state */
-        btreeState* state = (btreeState*) malloc(sizeof(btreeState));
+        /* Configure buffer and setup output file */
+        fileStorage fs;
+        btreeState *state = testOpenTree(testFileStorage(&fs, "w+b"), DBBUFFER_POLICY_ROUNDROBIN, M);
         if (state == NULL)
-        {   printf("Failed to allocate B-tree state struct.\n");
-            return;
-        }
-        state->recordSize = 16;
-        state->keySize = 4;
-        state->dataSize = 12;       
-        state->buffer = buffer;
-        
-        state->tempKey = malloc(state->keySize); 
-        state->tempData = malloc(state->dataSize);          	
-
-        /* Setup output file. */
-        SD_FILE *fp;
-        fp = fopen("myfile.bin", "w+b");
-        if (NULL == fp) {
-            printf("Error: Can't open file!\n");
             return;
-        }
-        
-        buffer->file = fp;          
+        state->buffer->maxDirty = M;       /* Write-back. Set to 0 for write-through. */
 
         /* Initialize B-tree structure */
         btreeInit(state);
@@ -389,16 +1942,8 @@ void runalltests_btree()
         // printStats(buffer);
 
         /* Clean up and free memory */
-        closeBuffer(buffer);    
-        
-        free(state->tempKey);
-        free(state->tempData);
+        testCloseTree(state);
         free(recordBuffer);
-
-        free(buffer->status);
-        free(state->buffer->buffer);
-        free(buffer);
-        free(state);
     }
 
     // Prints results